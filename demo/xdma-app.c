@@ -1,33 +1,328 @@
+/*
+ * Loopback demo for libxdma
+ *
+ * Without options it sends one buffer and prints the first characters of
+ * the dst buffer before and after. '-n' runs a soak test of that many
+ * transfers instead and reports the throughput. With '-v' every transfer is
+ * verified in full: a thread on another core computes the CRC32C of the src
+ * and dst buffers while the next transfer runs on a second pair of buffers,
+ * so verification does not slow down the transfers it checks, unless it
+ * cannot keep up. That is reported as 'verify stall'.
+ *
+ * Needs a loopback design or dev/xdma-loopback.ko.
+ */
+#define _GNU_SOURCE
 #include "libxdma.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define XA_DMA_LENGTH	(32 * 1024 * 1024)
+
+enum xa_state {
+	XA_READY,		// filled, may be sent
+	XA_SENT,		// waiting for the verifier
+};
+
+struct xa_pair {
+	uint32_t *src;
+	uint32_t *dst;
+	uint32_t seq;		// transfer the pair was filled for
+	enum xa_state state;
+};
+
+struct xa_config {
+	int iterations;
+	int length;		// in words
+	int cpu;		// of the verifier, -1 for the last one
+	bool verify;
+};
+
+struct xa_verifier {
+	struct xa_config *cfg;
+	struct xa_pair pair[2];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	bool quit;
+
+	uint64_t mismatches;
+	uint64_t busy_ns;	// spent verifying and refilling
+};
+
+static uint64_t xa_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Every transfer carries different data, so stale or partial dst buffers
+ * are caught as well as corrupt ones.
+ */
+static void xa_pair_fill(struct xa_pair *p, uint32_t seq, int length)
+{
+	int i;
+
+	for (i = 0; i < length; i++) {
+		p->src[i] = (seq * 0x9E3779B1) ^ (i * 0x85EBCA77);
+	}
+	xdma_buf_fill(p->dst, ~seq, length * sizeof(uint32_t));
+	p->seq = seq;
+}
+
+static void xa_pair_check(struct xa_verifier *v, struct xa_pair *p)
+{
+	const size_t bytes = v->cfg->length * sizeof(uint32_t);
+	uint32_t src_crc, dst_crc;
+	ssize_t offset;
+
+	src_crc = xdma_buf_crc32c(0, p->src, bytes);
+	dst_crc = xdma_buf_crc32c(0, p->dst, bytes);
+	if (src_crc == dst_crc) {
+		return;
+	}
+
+	offset = xdma_buf_compare(p->src, p->dst, bytes);
+	fprintf(stderr, "transfer %u: mismatch at byte offset %zd, "
+		"src crc32c %08x, dst crc32c %08x\n",
+		p->seq, offset, src_crc, dst_crc);
+	v->mismatches++;
+}
+
+/* libxdma doesn't print its errors, this demo wants them on stderr. */
+static void xa_log(void *arg, const struct xdma_error_info *err)
+{
+	(void)arg;
+	fprintf(stderr, "Error %s: %s (%s)\n", err->call,
+		xdma_error_string(err->code), strerror(err->sys_errno));
+}
+
+static void xa_pin(pthread_t thread, int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(thread, sizeof(set), &set)) {
+		fprintf(stderr, "Warning: could not pin a thread to cpu %d\n",
+			cpu);
+	}
+}
+
+/* Checks the pairs in the order they were sent and refills each for the
+ * transfer after next.
+ */
+static void *xa_verifier_run(void *arg)
+{
+	struct xa_verifier *v = arg;
+	struct xa_pair *p;
+	uint64_t start;
+	bool sent;
+	int next = 0;
+
+	for (;;) {
+		p = &v->pair[next];
+
+		pthread_mutex_lock(&v->lock);
+		while ((p->state != XA_SENT) && !v->quit) {
+			pthread_cond_wait(&v->cond, &v->lock);
+		}
+		sent = (p->state == XA_SENT);
+		pthread_mutex_unlock(&v->lock);
+
+		if (!sent) {
+			break;	// quit, and nothing left to check
+		}
+
+		start = xa_now();
+		xa_pair_check(v, p);
+		xa_pair_fill(p, p->seq + 2, v->cfg->length);
+		v->busy_ns += xa_now() - start;
+
+		pthread_mutex_lock(&v->lock);
+		p->state = XA_READY;
+		pthread_cond_broadcast(&v->cond);
+		pthread_mutex_unlock(&v->lock);
+
+		next ^= 1;
+	}
+
+	return NULL;
+}
+
+static int xa_soak(struct xa_config *cfg)
+{
+	const uint64_t bytes = (uint64_t) cfg->length * sizeof(uint32_t);
+	struct xa_verifier v = {
+		.cfg = cfg,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	struct xa_pair *p;
+	uint64_t start, elapsed, t0;
+	uint64_t stall_ns = 0;
+	uint64_t errors = 0;
+	long cpus;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		v.pair[i].src = xdma_alloc_src(cfg->length, sizeof(uint32_t));
+		v.pair[i].dst = xdma_alloc(cfg->length, sizeof(uint32_t));
+		if (!v.pair[i].src || !v.pair[i].dst) {
+			return EXIT_FAILURE;
+		}
+		xa_pair_fill(&v.pair[i], i, cfg->length);
+		v.pair[i].state = XA_READY;
+	}
+
+	if (cfg->verify) {
+		if (pthread_create(&v.thread, NULL, xa_verifier_run, &v)) {
+			perror("Error creating verifier thread");
+			return EXIT_FAILURE;
+		}
+
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		if (cpus > 1) {
+			xa_pin(pthread_self(), 0);
+			xa_pin(v.thread, (cfg->cpu < 0) ? cpus - 1 : cfg->cpu);
+		}
+	}
+
+	start = xa_now();
+	for (i = 0; i < cfg->iterations; i++) {
+		p = &v.pair[i & 1];
+
+		if (cfg->verify) {
+			t0 = xa_now();
+			pthread_mutex_lock(&v.lock);
+			while (p->state != XA_READY) {
+				pthread_cond_wait(&v.cond, &v.lock);
+			}
+			pthread_mutex_unlock(&v.lock);
+			stall_ns += xa_now() - t0;
+		}
+
+		if (xdma_perform_transaction(0, XDMA_WAIT_BOTH,
+					     p->src, cfg->length,
+					     p->dst, cfg->length) < 0) {
+			errors++;
+		}
+
+		if (cfg->verify) {
+			pthread_mutex_lock(&v.lock);
+			p->state = XA_SENT;
+			pthread_cond_broadcast(&v.cond);
+			pthread_mutex_unlock(&v.lock);
+		}
+	}
+	elapsed = xa_now() - start;
+
+	if (cfg->verify) {
+		pthread_mutex_lock(&v.lock);
+		v.quit = true;
+		pthread_cond_broadcast(&v.cond);
+		pthread_mutex_unlock(&v.lock);
+		pthread_join(v.thread, NULL);
+	}
+
+	printf("transfers: %d, errors: %llu\n", cfg->iterations,
+	       (unsigned long long)errors);
+	printf("loopback: %llu bytes in %.3f ms, %.3f GB/s\n",
+	       (unsigned long long)(bytes * cfg->iterations), elapsed / 1e6,
+	       elapsed ? (bytes * cfg->iterations / (double)elapsed) : 0.0);
+	if (cfg->verify) {
+		printf("verify: %llu mismatches, %.3f GB/s on its core, "
+		       "verify stall %.3f ms\n",
+		       (unsigned long long)v.mismatches,
+		       v.busy_ns ? (2.0 * bytes * cfg->iterations / v.busy_ns) :
+		       0.0, stall_ns / 1e6);
+	}
+
+	return (errors || v.mismatches) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void xa_usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-n iterations] [-l words] [-v] [-c cpu]\n"
+		"  -n  soak test with this many transfers\n"
+		"  -l  words per transfer (1025)\n"
+		"  -v  verify every transfer on another core\n"
+		"  -c  core of the verifier (the last one)\n", prog);
+}
 
 int main(int argc, char *argv[])
 {
-	const int LENGTH = 1025;
+	struct xa_config cfg = {
+		.iterations = 0,
+		.length = 1025,
+		.cpu = -1,
+		.verify = false,
+	};
 	int i;
+	int opt;
+	int ret;
 	uint32_t *src;
 	uint32_t *dst;
 
+	while ((opt = getopt(argc, argv, "n:l:vc:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			cfg.iterations = atoi(optarg);
+			break;
+		case 'l':
+			cfg.length = atoi(optarg);
+			break;
+		case 'v':
+			cfg.verify = true;
+			break;
+		case 'c':
+			cfg.cpu = atoi(optarg);
+			break;
+		default:
+			xa_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	// the soak test uses two pairs of buffers
+	if ((optind != argc) || (cfg.iterations < 0) || (cfg.length <= 0) ||
+	    ((uint64_t) cfg.length * 4 * sizeof(uint32_t) > XA_DMA_LENGTH) ||
+	    (cfg.verify && !cfg.iterations)) {
+		xa_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	xdma_set_log(xa_log, NULL);
 	if (xdma_init() < 0) {
 		exit(EXIT_FAILURE);
 	}
 
-	dst = (uint32_t *) xdma_alloc(LENGTH, sizeof(uint32_t));
-	src = (uint32_t *) xdma_alloc(LENGTH, sizeof(uint32_t));
+	if (cfg.iterations) {
+		ret = (0 < xdma_num_of_devices()) ? xa_soak(&cfg) :
+		    EXIT_FAILURE;
+		xdma_exit();
+		return ret;
+	}
+
+	dst = (uint32_t *) xdma_alloc(cfg.length, sizeof(uint32_t));
+	src = (uint32_t *) xdma_alloc_src(cfg.length, sizeof(uint32_t));
 
 	// fill src with a value
-	for (i = 0; i < LENGTH; i++) {
-		src[i] = 'B';
-	}
-	src[LENGTH - 1] = '\n';
+	xdma_buf_fill(src, 'B', cfg.length * sizeof(uint32_t));
+	src[cfg.length - 1] = '\n';
 
 	// fill dst with a value
-	for (i = 0; i < LENGTH; i++) {
-		dst[i] = 'A';
-	}
-	dst[LENGTH - 1] = '\n';
+	xdma_buf_fill(dst, 'A', cfg.length * sizeof(uint32_t));
+	dst[cfg.length - 1] = '\n';
 
 	printf("test: dst buffer before transmit:\n");
 	for (i = 0; i < 10; i++) {
@@ -36,8 +331,8 @@ int main(int argc, char *argv[])
 	printf("\n");
 
 	if (0 < xdma_num_of_devices()) {
-		xdma_perform_transaction(0, XDMA_WAIT_NONE, src, LENGTH, dst,
-					 LENGTH);
+		xdma_perform_transaction(0, XDMA_WAIT_NONE, src, cfg.length,
+					 dst, cfg.length);
 	}
 
 	printf("test: dst buffer after transmit:\n");
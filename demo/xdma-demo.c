@@ -1,7 +1,5 @@
-// the below define is a hack
-#define u32 unsigned int
-#define dma_cookie_t unsigned int
 #include "xdma.h"
+#include "libxdma.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,9 +10,9 @@
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 
-#define FILEPATH "/dev/xdma"
-#define MAP_SIZE  (4000)
-#define FILESIZE (MAP_SIZE * sizeof(char))
+#define DEMO_FILEPATH "/dev/xdma0"
+#define DEMO_MAP_SIZE  (4000)
+#define DEMO_FILESIZE (DEMO_MAP_SIZE * sizeof(char))
 
 int main(int argc, char *argv[])
 {
@@ -29,7 +27,7 @@ int main(int argc, char *argv[])
 	 *
 	 * Note: "O_WRONLY" mode is not sufficient when mmaping.
 	 */
-	fd = open(FILEPATH, O_RDWR | O_CREAT | O_TRUNC, (mode_t) 0600);
+	fd = open(DEMO_FILEPATH, O_RDWR | O_CREAT | O_TRUNC, (mode_t) 0600);
 	if (fd == -1) {
 		perror("Error opening file for writing");
 		exit(EXIT_FAILURE);
@@ -37,7 +35,7 @@ int main(int argc, char *argv[])
 
 	/* mmap the file to get access to the memory area.
 	 */
-	map = mmap(0, FILESIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	map = mmap(0, DEMO_FILESIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 	if (map == MAP_FAILED) {
 		close(fd);
 		perror("Error mmapping the file");
@@ -76,17 +74,14 @@ int main(int argc, char *argv[])
 	/* Query driver for number of devices.
 	 */
 	struct xdma_dev dev;
-	dev.tx_chan = (u32) NULL;
-	dev.tx_cmp = (u32) NULL;
-	dev.rx_chan = (u32) NULL;
-	dev.rx_cmp = (u32) NULL;
-	dev.device_id = num_devices - 1;
+	dev.tx_chan = XDMA_NO_CHAN;
+	dev.rx_chan = XDMA_NO_CHAN;
+	dev.device_id = 0;
 	if (ioctl(fd, XDMA_GET_DEV_INFO, &dev) < 0) {
 		perror("Error ioctl getting device info");
 		exit(EXIT_FAILURE);
 	}
-	printf("devices tx chan: %x, tx cmp:%x, rx chan: %x, rx cmp: %x\n",
-	       dev.tx_chan, dev.tx_cmp, dev.rx_chan, dev.rx_cmp);
+	printf("devices tx chan: %u, rx chan: %u\n", dev.tx_chan, dev.rx_chan);
 
 	struct xdma_chan_cfg rx_config;
 	rx_config.chan = dev.rx_chan;
@@ -114,11 +109,11 @@ int main(int argc, char *argv[])
 
 	struct xdma_buf_info rx_buf;
 	rx_buf.chan = dev.rx_chan;
-	rx_buf.completion = dev.rx_cmp;
-	rx_buf.cookie = (u32) NULL;
-	rx_buf.buf_offset = (u32) 0;
-	rx_buf.buf_size = (u32) LENGTH;
+	rx_buf.cookie = 0;
+	rx_buf.buf_offset = 0;
+	rx_buf.buf_size = LENGTH;
 	rx_buf.dir = XDMA_DEV_TO_MEM;
+	rx_buf.flags = 0;
 	if (ioctl(fd, XDMA_PREP_BUF, &rx_buf) < 0) {
 		perror("Error ioctl set rx buf");
 		exit(EXIT_FAILURE);
@@ -127,11 +122,11 @@ int main(int argc, char *argv[])
 
 	struct xdma_buf_info tx_buf;
 	tx_buf.chan = dev.tx_chan;
-	tx_buf.completion = dev.tx_cmp;
-	tx_buf.cookie = (u32) NULL;
-	tx_buf.buf_offset = (u32) LENGTH;
-	tx_buf.buf_size = (u32) LENGTH;
+	tx_buf.cookie = 0;
+	tx_buf.buf_offset = LENGTH;
+	tx_buf.buf_size = LENGTH;
 	tx_buf.dir = XDMA_MEM_TO_DEV;
+	tx_buf.flags = 0;
 	if (ioctl(fd, XDMA_PREP_BUF, &tx_buf) < 0) {
 		perror("Error ioctl set tx buf");
 		exit(EXIT_FAILURE);
@@ -140,7 +135,6 @@ int main(int argc, char *argv[])
 
 	struct xdma_transfer rx_trans;
 	rx_trans.chan = dev.rx_chan;
-	rx_trans.completion = dev.rx_cmp;
 	rx_trans.cookie = rx_buf.cookie;
 	rx_trans.wait = 0;
 	if (ioctl(fd, XDMA_START_TRANSFER, &rx_trans) < 0) {
@@ -151,7 +145,6 @@ int main(int argc, char *argv[])
 
 	struct xdma_transfer tx_trans;
 	tx_trans.chan = dev.tx_chan;
-	tx_trans.completion = dev.tx_cmp;
 	tx_trans.cookie = tx_buf.cookie;
 	tx_trans.wait = 0;
 	if (ioctl(fd, XDMA_START_TRANSFER, &tx_trans) < 0) {
@@ -160,14 +153,31 @@ int main(int argc, char *argv[])
 	}
 	printf("config tx trans\n");
 
+	/* Wait for the rx transfer, then check all of the buffer rather than
+	 * the first characters.
+	 */
+	rx_trans.wait = 1;
+	if (ioctl(fd, XDMA_START_TRANSFER, &rx_trans) < 0) {
+		perror("Error ioctl wait for rx trans");
+		exit(EXIT_FAILURE);
+	}
+
 	printf("test: rx buffer after transmit:\n");
 	for (i = 0; i < 10; i++) {
 		printf("%c\t", map[i]);
 	}
 	printf("\n");
 
+	uint32_t tx_crc = xdma_buf_crc32c(0, &map[LENGTH], LENGTH);
+	uint32_t rx_crc = xdma_buf_crc32c(0, &map[0], LENGTH);
+	printf("crc32c tx: %08x, rx: %08x\n", tx_crc, rx_crc);
+	if (tx_crc != rx_crc) {
+		printf("test: mismatch at byte offset %zd\n",
+		       xdma_buf_compare(&map[LENGTH], &map[0], LENGTH));
+	}
+
 #if 0
-	for (i = 0; i < MAP_SIZE; i++) {
+	for (i = 0; i < DEMO_MAP_SIZE; i++) {
 		printf("%d\t", map[i]);
 	}
 	printf("\n");
@@ -175,7 +185,7 @@ int main(int argc, char *argv[])
 
 	/* Don't forget to free the mmapped memory
 	 */
-	if (munmap(map, FILESIZE) == -1) {
+	if (munmap(map, DEMO_FILESIZE) == -1) {
 		perror("Error un-mmapping the file");
 		/* Decide here whether to close(fd) and exit() or not. Depends... */
 	}
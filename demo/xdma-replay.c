@@ -0,0 +1,331 @@
+/*
+ * Replay a libxdma call trace
+ *
+ * Plays back the transactions and stops recorded with XDMA_TRACE=<file> (or
+ * xdma_trace_start()) against the hardware or dev/xdma-loopback.ko, and
+ * reports the throughput and the latency of every call. Running the same
+ * trace on different library and driver versions compares them on real
+ * traffic shapes.
+ *
+ * Buffers are addressed by their offset in the DMA memory, so the data is
+ * whatever the memory holds, only the sizes and timing are reproduced. By
+ * default calls are issued at their original times, '-s' speeds that up and
+ * '-f' issues them back to back.
+ */
+#include "libxdma.h"
+#include "xdma.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+struct xr_config {
+	const char *path;
+	double speed;		/* 0 issues the calls back to back */
+	int loops;
+	bool verbose;
+};
+
+struct xr_stats {
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t skipped;	/* device not present */
+	uint64_t bytes;
+	uint64_t lat_sum;
+	uint64_t *lat;		/* ns, per transaction */
+	uint64_t lat_num;
+	uint64_t lat_max;
+	uint64_t trace_bytes;
+	uint64_t trace_calls;
+	uint64_t trace_lat_sum;
+	uint64_t trace_span;	/* ns from the first to the last record */
+};
+
+static uint64_t xr_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void xr_sleep_until(uint64_t when)
+{
+	struct timespec ts;
+
+	ts.tv_sec = when / 1000000000ULL;
+	ts.tv_nsec = when % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)) ;
+}
+
+static int xr_cmp(const void *a, const void *b)
+{
+	const uint64_t x = *(const uint64_t *)a;
+	const uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static struct xdma_trace_record *xr_load(const char *path, size_t * num)
+{
+	struct xdma_trace_header hdr;
+	struct xdma_trace_record *recs = NULL;
+	size_t cap = 0;
+	size_t n = 0;
+	FILE *file;
+
+	file = fopen(path, "rb");
+	if (!file) {
+		perror("Error opening trace");
+		return NULL;
+	}
+
+	if ((fread(&hdr, sizeof(hdr), 1, file) != 1) ||
+	    (hdr.magic != XDMA_TRACE_MAGIC) ||
+	    (hdr.version != XDMA_TRACE_VERSION) ||
+	    (hdr.record_size != sizeof(struct xdma_trace_record))) {
+		fprintf(stderr, "%s is not a trace of this libxdma\n", path);
+		fclose(file);
+		return NULL;
+	}
+
+	for (;;) {
+		if (n == cap) {
+			cap = cap ? 2 * cap : 4096;
+			recs = realloc(recs, cap * sizeof(recs[0]));
+			if (!recs) {
+				perror("Error allocating trace");
+				fclose(file);
+				return NULL;
+			}
+		}
+
+		if (fread(&recs[n], sizeof(recs[0]), 1, file) != 1) {
+			break;
+		}
+		n++;
+	}
+
+	fclose(file);
+
+	*num = n;
+	return recs;
+}
+
+/* Pointer to 'offset' of the DMA memory of a device, NULL for no buffer. */
+static uint32_t *xr_ptr(uint8_t * base, uint32_t offset, uint32_t length)
+{
+	if ((offset == UINT32_MAX) || (length == 0)) {
+		return NULL;
+	}
+
+	return (uint32_t *) (base + offset);
+}
+
+static void xr_replay(const struct xr_config *cfg,
+		      const struct xdma_trace_record *recs, size_t num,
+		      uint8_t ** base, struct xr_stats *st)
+{
+	const struct xdma_trace_record *r;
+	uint64_t start = xr_now();
+	uint64_t t0, t1;
+	uint32_t *src, *dst;
+	size_t i;
+	int ret;
+
+	for (i = 0; i < num; i++) {
+		r = &recs[i];
+
+		if ((r->op != XDMA_TRACE_PERFORM) &&
+		    (r->op != XDMA_TRACE_SUBMIT) && (r->op != XDMA_TRACE_STOP)) {
+			continue;	// allocations are replayed by offset
+		}
+
+		if ((r->device_id >= xdma_num_of_devices()) ||
+		    !base[r->device_id]) {
+			st->skipped++;
+			continue;
+		}
+
+		if (cfg->speed > 0) {
+			xr_sleep_until(start + (uint64_t)
+				       ((r->timestamp - recs[0].timestamp) /
+					cfg->speed));
+		}
+
+		src = xr_ptr(base[r->device_id], r->src_offset, r->src_length);
+		dst = xr_ptr(base[r->device_id], r->dst_offset, r->dst_length);
+
+		t0 = xr_now();
+		if (r->op == XDMA_TRACE_STOP) {
+			ret = xdma_stop_transaction(r->device_id,
+						    src, r->src_length / 4,
+						    dst, r->dst_length / 4);
+		} else {
+			ret = xdma_perform_transaction(r->device_id, r->wait,
+						       src, r->src_length / 4,
+						       dst, r->dst_length / 4);
+		}
+		t1 = xr_now();
+
+		st->calls++;
+		if (ret < 0) {
+			st->errors++;
+		}
+
+		if (cfg->verbose) {
+			printf("%zu: op %d dev %d src %u dst %u: %d, %llu ns\n",
+			       i, r->op, r->device_id, r->src_length,
+			       r->dst_length, ret,
+			       (unsigned long long)(t1 - t0));
+		}
+
+		if (r->op != XDMA_TRACE_STOP) {
+			st->bytes += r->src_length + r->dst_length;
+			st->lat[st->lat_num++] = t1 - t0;
+			st->lat_sum += t1 - t0;
+			if (t1 - t0 > st->lat_max) {
+				st->lat_max = t1 - t0;
+			}
+		}
+	}
+}
+
+static void xr_usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-s speed] [-f] [-l loops] [-v] trace\n"
+		"  -s  speed up the original timing by this factor (1)\n"
+		"  -f  issue the calls back to back\n"
+		"  -l  play the trace this many times (1)\n"
+		"  -v  print every call\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct xr_config cfg = {
+		.path = NULL,
+		.speed = 1.0,
+		.loops = 1,
+		.verbose = false,
+	};
+	struct xr_stats st;
+	struct xdma_trace_record *recs;
+	uint8_t *base[MAX_DEVICES];
+	uint64_t start, elapsed;
+	size_t num = 0;
+	size_t i;
+	int opt;
+	int ret;
+
+	while ((opt = getopt(argc, argv, "s:fl:v")) != -1) {
+		switch (opt) {
+		case 's':
+			cfg.speed = atof(optarg);
+			break;
+		case 'f':
+			cfg.speed = 0;
+			break;
+		case 'l':
+			cfg.loops = atoi(optarg);
+			break;
+		case 'v':
+			cfg.verbose = true;
+			break;
+		default:
+			xr_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if ((optind != argc - 1) || (cfg.speed < 0) || (cfg.loops <= 0)) {
+		xr_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	cfg.path = argv[optind];
+
+	recs = xr_load(cfg.path, &num);
+	if (!recs) {
+		return EXIT_FAILURE;
+	}
+
+	// don't trace the replay into the trace being replayed
+	unsetenv("XDMA_TRACE");
+
+	if (xdma_init() < 0) {
+		fprintf(stderr, "Error %s: %s\n", xdma_last_error()->call,
+			xdma_error_string(xdma_last_error()->code));
+		free(recs);
+		return EXIT_FAILURE;
+	}
+
+	memset(&st, 0, sizeof(st));
+	st.lat = calloc(num * cfg.loops + 1, sizeof(st.lat[0]));
+	if (!st.lat) {
+		perror("Error allocating latencies");
+		xdma_exit();
+		free(recs);
+		return EXIT_FAILURE;
+	}
+
+	// the buffers are the offsets the trace recorded, from the map base
+	xdma_alloc_reset();
+	for (i = 0; i < MAX_DEVICES; i++) {
+		base[i] = ((int)i < xdma_num_of_devices()) ?
+		    xdma_alloc_dev(i, 0, 1) : NULL;
+	}
+
+	for (i = 0; i < num; i++) {
+		if ((recs[i].op == XDMA_TRACE_PERFORM) ||
+		    (recs[i].op == XDMA_TRACE_SUBMIT)) {
+			st.trace_bytes += recs[i].src_length +
+			    recs[i].dst_length;
+			st.trace_lat_sum += recs[i].duration;
+			st.trace_calls++;
+		}
+	}
+	if (num) {
+		st.trace_span = recs[num - 1].timestamp - recs[0].timestamp +
+		    recs[num - 1].duration;
+	}
+
+	start = xr_now();
+	for (i = 0; i < (size_t) cfg.loops; i++) {
+		xr_replay(&cfg, recs, num, base, &st);
+	}
+	elapsed = xr_now() - start;
+
+	qsort(st.lat, st.lat_num, sizeof(st.lat[0]), xr_cmp);
+
+	printf("records: %zu, calls: %llu, errors: %llu, skipped: %llu\n",
+	       num, (unsigned long long)st.calls,
+	       (unsigned long long)st.errors, (unsigned long long)st.skipped);
+	printf("replay: %llu bytes in %.3f ms, %.1f MB/s\n",
+	       (unsigned long long)st.bytes, elapsed / 1e6,
+	       elapsed ? (st.bytes * 1e3 / elapsed) : 0.0);
+	if (st.lat_num) {
+		printf("latency [us]: avg %.1f, p50 %.1f, p99 %.1f, max %.1f\n",
+		       st.lat_sum / 1e3 / st.lat_num,
+		       st.lat[st.lat_num / 2] / 1e3,
+		       st.lat[(st.lat_num * 99) / 100] / 1e3,
+		       st.lat_max / 1e3);
+	}
+	if (st.trace_span && st.trace_calls) {
+		printf("trace: %llu bytes in %.3f ms, %.1f MB/s, "
+		       "avg latency %.1f us\n",
+		       (unsigned long long)st.trace_bytes, st.trace_span / 1e6,
+		       st.trace_bytes * 1e3 / st.trace_span,
+		       st.trace_lat_sum / 1e3 / st.trace_calls);
+	}
+
+	ret = (st.errors == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+	free(st.lat);
+	free(recs);
+	xdma_exit();
+
+	return ret;
+}
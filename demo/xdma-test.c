@@ -1,6 +1,3 @@
-// the below define is a hack
-#define u32 unsigned int
-#define dma_cookie_t unsigned int
 #include "xdma.h"
 
 #include <stdio.h>
@@ -9,7 +6,7 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 
-#define FILEPATH "/dev/xdma"
+#define FILEPATH "/dev/xdma0"
 #define NUMINTS  (1000)
 #define FILESIZE (NUMINTS * sizeof(int))
 
@@ -0,0 +1,488 @@
+/*
+ * Torture test for the driver and libxdma
+ *
+ * Runs workers in several processes, each a separate client of the driver,
+ * and threads, which share their process's client. All of them do loopback
+ * transfers on the same devices at the same time, with random sizes and
+ * optional stops. Every packet carries the id of its worker, a sequence
+ * number and its length. The receiver checks the payload, and a tally in
+ * shared memory finds packets that were lost or delivered twice. rx buffers
+ * are shared by all workers of a device, so a packet usually arrives in the
+ * buffer of another worker.
+ *
+ * With -c it first calibrates every device while the process splits its
+ * transfers at XT_CALIB_CHUNK, which xdma_calibrate() has to lift for the
+ * sizes past it.
+ *
+ * Needs a loopback design or dev/xdma-loopback.ko.
+ */
+#include "libxdma.h"
+#include "xdma.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define XT_MAGIC	0x58544f52	// "XTOR"
+#define XT_HDR_WORDS	4	// magic, worker, seq, words
+#define XT_MIN_WORDS	(XT_HDR_WORDS + 1)	// header and trailer
+#define XT_DMA_LENGTH	(32 * 1024 * 1024)
+#define XT_CALIB_CHUNK	(256 * 1024)
+
+struct xt_stats {
+	uint64_t sent;
+	uint64_t received;
+	uint64_t bytes;
+	uint64_t duplicated;
+	uint64_t corrupt;
+	uint64_t torn;
+	uint64_t errors;
+	uint64_t timeouts;
+	uint64_t stops;
+};
+
+struct xt_config {
+	int procs;
+	int threads;
+	int iterations;
+	int max_words;
+	int stop_percent;
+	int timeout_ms;
+	int num_devices;
+	bool calibrate;
+};
+
+struct xt_worker {
+	int id;
+	int device_id;
+	unsigned int seed;
+	uint32_t *tx;
+	uint32_t *rx;
+	pthread_t thread;
+};
+
+/* shared by all processes */
+static struct xt_stats *stats;
+static uint8_t *sent;		// per worker and sequence number
+static uint8_t *tally;		// times a packet was received
+
+static struct xt_config cfg = {
+	.procs = 2,
+	.threads = 2,
+	.iterations = 1000,
+	.max_words = 16384,
+	.stop_percent = 0,
+	.timeout_ms = 5000,
+};
+
+static uint32_t xt_pattern(uint32_t worker, uint32_t seq, uint32_t i)
+{
+	return (worker * 0x9E3779B1) ^ (seq * 0x85EBCA77) ^ (i * 0xC2B2AE3D);
+}
+
+static uint32_t xt_trailer(uint32_t worker, uint32_t seq)
+{
+	return ~seq ^ (worker << 16);
+}
+
+static uint64_t xt_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void xt_packet_fill(uint32_t * buf, uint32_t worker, uint32_t seq,
+			   uint32_t words)
+{
+	uint32_t i;
+
+	buf[0] = XT_MAGIC;
+	buf[1] = worker;
+	buf[2] = seq;
+	buf[3] = words;
+	for (i = XT_HDR_WORDS; i < words - 1; i++) {
+		buf[i] = xt_pattern(worker, seq, i);
+	}
+	buf[words - 1] = xt_trailer(worker, seq);
+}
+
+/* Wait until a whole packet is in 'buf', the engine writes it in order so
+ * the trailer is the last word to arrive. Returns its length in words, 0 on
+ * timeout and -1 if only part of a packet arrived.
+ */
+static int xt_packet_wait(volatile uint32_t * buf, uint64_t deadline)
+{
+	uint32_t words;
+
+	while (buf[0] != XT_MAGIC) {
+		if (xt_now_ms() > deadline) {
+			return 0;
+		}
+		sched_yield();
+	}
+
+	words = buf[3];
+	if ((words < XT_MIN_WORDS) || (words > cfg.max_words)) {
+		return -1;
+	}
+
+	while (buf[words - 1] != xt_trailer(buf[1], buf[2])) {
+		if (xt_now_ms() > deadline) {
+			return -1;
+		}
+		sched_yield();
+	}
+
+	return (int)words;
+}
+
+static void xt_packet_check(struct xt_worker *w, const uint32_t * buf,
+			    uint32_t words)
+{
+	const uint32_t workers = cfg.procs * cfg.threads;
+	uint32_t worker = buf[1];
+	uint32_t seq = buf[2];
+	uint32_t i;
+
+	if ((worker >= workers) || (seq >= cfg.iterations)) {
+		__sync_fetch_and_add(&stats->corrupt, 1);
+		return;
+	}
+
+	for (i = XT_HDR_WORDS; i < words - 1; i++) {
+		if (buf[i] != xt_pattern(worker, seq, i)) {
+			fprintf(stderr,
+				"worker %d: packet %u/%u corrupt at word %u\n",
+				w->id, worker, seq, i);
+			__sync_fetch_and_add(&stats->corrupt, 1);
+			return;
+		}
+	}
+
+	if (__sync_fetch_and_add(&tally[worker * cfg.iterations + seq], 1)) {
+		fprintf(stderr, "worker %d: packet %u/%u received twice\n",
+			w->id, worker, seq);
+		__sync_fetch_and_add(&stats->duplicated, 1);
+	}
+
+	__sync_fetch_and_add(&stats->received, 1);
+	__sync_fetch_and_add(&stats->bytes, words * sizeof(uint32_t));
+}
+
+static int xt_post_rx(struct xt_worker *w)
+{
+	w->rx[0] = 0;
+	return xdma_perform_transaction(w->device_id, XDMA_WAIT_NONE,
+					NULL, 0, w->rx, cfg.max_words);
+}
+
+static void xt_iteration(struct xt_worker *w, uint32_t seq)
+{
+	uint32_t words;
+	uint64_t deadline;
+	int ret;
+
+	words = XT_MIN_WORDS + rand_r(&w->seed) % (cfg.max_words -
+						   XT_MIN_WORDS + 1);
+
+	// post the rx buffer first, so the tx never waits for a missing one
+	if (xt_post_rx(w) < 0) {
+		__sync_fetch_and_add(&stats->errors, 1);
+		return;
+	}
+
+	// a stop aborts all rx transfers of this process, maybe mid packet
+	if ((rand_r(&w->seed) % 100) < cfg.stop_percent) {
+		xdma_stop_transaction(w->device_id, NULL, 0, w->rx,
+				      cfg.max_words);
+		__sync_fetch_and_add(&stats->stops, 1);
+
+		if (xt_post_rx(w) < 0) {
+			__sync_fetch_and_add(&stats->errors, 1);
+			return;
+		}
+	}
+
+	xt_packet_fill(w->tx, w->id, seq, words);
+	ret = xdma_perform_transaction(w->device_id, XDMA_WAIT_SRC, w->tx,
+				       words, NULL, 0);
+	if (ret < 0) {
+		__sync_fetch_and_add(&stats->errors, 1);
+	} else {
+		sent[w->id * cfg.iterations + seq] = 1;
+		__sync_fetch_and_add(&stats->sent, 1);
+	}
+
+	// a packet from any worker of the device lands in our rx buffer
+	deadline = xt_now_ms() + cfg.timeout_ms;
+	ret = xt_packet_wait(w->rx, deadline);
+	if (ret > 0) {
+		xt_packet_check(w, w->rx, ret);
+		return;
+	}
+
+	if (ret == 0) {
+		__sync_fetch_and_add(&stats->timeouts, 1);
+	} else {
+		__sync_fetch_and_add(&stats->torn, 1);
+	}
+
+	// do not leave the buffer posted, it is reused by the next iteration
+	xdma_stop_transaction(w->device_id, NULL, 0, w->rx, cfg.max_words);
+}
+
+static void *xt_worker_run(void *arg)
+{
+	struct xt_worker *w = arg;
+	int i;
+
+	for (i = 0; i < cfg.iterations; i++) {
+		xt_iteration(w, i);
+	}
+
+	return NULL;
+}
+
+/* Each process allocates its buffers behind those of the processes before
+ * it, all processes map the same DMA memory of a device.
+ */
+static int xt_process(int proc)
+{
+	const uint32_t bytes = cfg.max_words * sizeof(uint32_t);
+	struct xt_worker *workers;
+	uint32_t size;
+	int i;
+
+	if (xdma_init() != 0) {
+		fprintf(stderr, "Error %s: %s\n", xdma_last_error()->call,
+			xdma_error_string(xdma_last_error()->code));
+		return EXIT_FAILURE;
+	}
+
+	workers = calloc(cfg.threads, sizeof(struct xt_worker));
+	if (!workers) {
+		xdma_exit();
+		return EXIT_FAILURE;
+	}
+
+	// the processes before allocated 2 buffers per thread, each rounded
+	for (i = 0; i < xdma_num_of_devices(); i++) {
+		size = (bytes + xdma_buf_align(i) - 1) &
+		    ~(xdma_buf_align(i) - 1);
+		if (proc) {
+			xdma_alloc_dev(i, proc * cfg.threads * 2 * size, 1);
+		}
+	}
+
+	for (i = 0; i < cfg.threads; i++) {
+		struct xt_worker *w = &workers[i];
+
+		w->id = proc * cfg.threads + i;
+		w->device_id = w->id % xdma_num_of_devices();
+		w->seed = (unsigned int)(time(NULL) ^ (w->id * 7919));
+		w->tx = xdma_alloc_src_dev(w->device_id, cfg.max_words,
+					   sizeof(uint32_t));
+		w->rx = xdma_alloc_dev(w->device_id, cfg.max_words,
+				       sizeof(uint32_t));
+		if (!w->tx || !w->rx) {
+			fprintf(stderr, "Error buffers exceed the DMA memory\n");
+			free(workers);
+			xdma_exit();
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (i = 0; i < cfg.threads; i++) {
+		if (pthread_create(&workers[i].thread, NULL, xt_worker_run,
+				   &workers[i])) {
+			perror("Error creating worker thread");
+			cfg.threads = i;
+			break;
+		}
+	}
+
+	for (i = 0; i < cfg.threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	free(workers);
+	xdma_exit();
+
+	return EXIT_SUCCESS;
+}
+
+/* Calibrate every device with a 'max_chunk' smaller than the largest
+ * calibration transfer. A transfer that is split anyway arrives short and
+ * fails the calibration.
+ */
+static int xt_calibrate(void)
+{
+	struct xdma_calibration cal;
+	int ret = EXIT_SUCCESS;
+	int i;
+
+	if (xdma_init() != 0) {
+		fprintf(stderr, "Error %s: %s\n", xdma_last_error()->call,
+			xdma_error_string(xdma_last_error()->code));
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < xdma_num_of_devices(); i++) {
+		if ((xdma_set_qos(i, XDMA_PRIO_NORMAL, 1,
+				  XT_CALIB_CHUNK) < 0) ||
+		    (xdma_calibrate(i) < 0) ||
+		    (xdma_get_calibration(i, &cal) < 0)) {
+			fprintf(stderr, "Error device %d %s: %s\n", i,
+				xdma_last_error()->call,
+				xdma_error_string(xdma_last_error()->code));
+			ret = EXIT_FAILURE;
+			continue;
+		}
+
+		printf("calibrate: device %d overhead %u ns, %u MB/s, "
+		       "chunk %u bytes\n", i, cal.overhead_ns, cal.bandwidth,
+		       cal.chunk);
+	}
+
+	xdma_exit();
+
+	return ret;
+}
+
+static void xt_usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-p procs] [-t threads] [-n iterations]\n"
+		"\t[-w max words] [-s stop percent] [-T timeout ms] [-c]\n",
+		prog);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *verdict;
+	uint64_t start, elapsed, lost = 0;
+	size_t entries;
+	pid_t pid;
+	int status;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "p:t:n:w:s:T:ch")) != -1) {
+		switch (opt) {
+		case 'p':
+			cfg.procs = atoi(optarg);
+			break;
+		case 't':
+			cfg.threads = atoi(optarg);
+			break;
+		case 'n':
+			cfg.iterations = atoi(optarg);
+			break;
+		case 'w':
+			cfg.max_words = atoi(optarg);
+			break;
+		case 's':
+			cfg.stop_percent = atoi(optarg);
+			break;
+		case 'T':
+			cfg.timeout_ms = atoi(optarg);
+			break;
+		case 'c':
+			cfg.calibrate = true;
+			break;
+		default:
+			xt_usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if ((cfg.procs < 1) || (cfg.threads < 1) || (cfg.iterations < 1) ||
+	    (cfg.max_words < XT_MIN_WORDS) ||
+	    ((uint64_t) cfg.procs * cfg.threads * 2 * cfg.max_words *
+	     sizeof(uint32_t) > XT_DMA_LENGTH)) {
+		fprintf(stderr, "Error invalid arguments or buffers exceed "
+			"the DMA memory\n");
+		xt_usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (cfg.calibrate && (xt_calibrate() != EXIT_SUCCESS)) {
+		printf("torture: FAIL\n");
+		exit(EXIT_FAILURE);
+	}
+
+	entries = (size_t) cfg.procs * cfg.threads * cfg.iterations;
+	stats = mmap(NULL, sizeof(struct xt_stats) + 2 * entries,
+		     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (stats == MAP_FAILED) {
+		perror("Error mmapping the shared tally");
+		exit(EXIT_FAILURE);
+	}
+	sent = (uint8_t *) (stats + 1);
+	tally = sent + entries;
+
+	start = xt_now_ms();
+
+	for (i = 0; i < cfg.procs; i++) {
+		pid = fork();
+		if (pid == 0) {
+			exit(xt_process(i));
+		} else if (pid < 0) {
+			perror("Error forking worker process");
+			cfg.procs = i;
+			break;
+		}
+	}
+
+	while (wait(&status) > 0) {
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			__sync_fetch_and_add(&stats->errors, 1);
+		}
+	}
+
+	elapsed = xt_now_ms() - start;
+
+	for (i = 0; i < entries; i++) {
+		if (sent[i] && !tally[i]) {
+			lost++;
+		}
+	}
+
+	printf("torture: %d processes x %d threads, %d iterations, "
+	       "up to %d words\n", cfg.procs, cfg.threads, cfg.iterations,
+	       cfg.max_words);
+	printf("  sent %llu, received %llu, lost %llu, duplicated %llu\n",
+	       (unsigned long long)stats->sent,
+	       (unsigned long long)stats->received,
+	       (unsigned long long)lost,
+	       (unsigned long long)stats->duplicated);
+	printf("  corrupt %llu, torn %llu, errors %llu, timeouts %llu, "
+	       "stops %llu\n", (unsigned long long)stats->corrupt,
+	       (unsigned long long)stats->torn,
+	       (unsigned long long)stats->errors,
+	       (unsigned long long)stats->timeouts,
+	       (unsigned long long)stats->stops);
+	printf("  throughput %.1f MB/s, %.0f packets/s\n",
+	       elapsed ? stats->bytes / (elapsed * 1000.0) : 0.0,
+	       elapsed ? stats->received * 1000.0 / elapsed : 0.0);
+
+	// stops legitimately tear and drop packets
+	if (stats->duplicated || stats->corrupt ||
+	    (!cfg.stop_percent && (lost || stats->torn || stats->errors))) {
+		verdict = "FAIL";
+	} else {
+		verdict = "PASS";
+	}
+	printf("torture: %s\n", verdict);
+
+	return (verdict[0] == 'P') ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,799 @@
+/*
+ * Software stand-in for the Xilinx AXI DMA engine
+ *
+ * Registers a dmaengine device with one tx (MEM_TO_DEV) and one rx
+ * (DEV_TO_MEM) slave channel per loopback device. The private data of the
+ * channels is what xdma_probe() filters for, so the wrapper driver binds to
+ * them as to a real engine, which lets it be loaded, tested and benchmarked
+ * on any Linux machine.
+ *
+ * Data sent on the tx channel comes back on the rx channel of the same
+ * device, like an FPGA design with a stream loopback: a tx descriptor is
+ * one packet, it ends the rx descriptor it is copied into. Cyclic tx
+ * descriptors are supported, each period is a packet. With 'cdma' set
+ * every device also has a memory to memory channel like an AXI CDMA.
+ *
+ * The CPU copies the data and delays completions to emulate a per
+ * descriptor latency and a bandwidth limit, both can be changed at run time
+ * through /sys/module/xdma_loopback/parameters/.
+ *
+ * The DMA addresses handed to the channels are used as physical addresses,
+ * so the module only works without an IOMMU in front of it.
+ *
+ * Load this module before xdma.ko:
+ *	insmod xdma-loopback.ko devices=2 latency_us=20 bandwidth=400
+ */
+#include <linux/dmaengine.h>
+#include "xdma.h"
+#include "xdma-xilinx.h"
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/device.h>
+#include <linux/platform_device.h>
+#include <linux/dma-mapping.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/interrupt.h>
+#include <linux/workqueue.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/ktime.h>
+#include <linux/delay.h>
+#include <linux/sched.h>
+
+#define XDMA_LB_NAME	"xdma-loopback"
+
+static unsigned int devices = 1;
+module_param(devices, uint, S_IRUGO);
+MODULE_PARM_DESC(devices, "Number of loopback devices (tx/rx pairs)");
+
+static bool cdma = true;
+module_param(cdma, bool, S_IRUGO);
+MODULE_PARM_DESC(cdma, "Add a memory to memory (CDMA) channel per device");
+
+static unsigned int latency_us;
+module_param(latency_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(latency_us, "Completion latency of every descriptor [us]");
+
+static unsigned int bandwidth;
+module_param(bandwidth, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(bandwidth, "Bandwidth of each device [MB/s], 0 unlimited");
+
+struct xdma_lb_seg {
+	dma_addr_t addr;
+	size_t len;
+};
+
+struct xdma_lb_desc {
+	struct dma_async_tx_descriptor tx;
+	struct list_head node;
+
+	size_t len;
+	size_t done;		/* bytes copied so far */
+	bool eop;		/* rx: ended by the end of a tx packet */
+	bool cyclic;		/* tx: a segment per period, never ends */
+	unsigned int periods;	/* cyclic: played, callbacks not yet run */
+
+	/* memcpy: segs[0] is the source, segs[1] the destination */
+
+	unsigned int seg;	/* current segment and offset in it */
+	size_t seg_off;
+	unsigned int nents;
+	struct xdma_lb_seg segs[0];
+};
+
+struct xdma_lb_device;
+
+/* Residues of recently completed descriptors, so tx_status can report the
+ * length of a packet that ended early after the fact.
+ */
+#define XDMA_LB_HISTORY	16	// power of two
+
+struct xdma_lb_residue {
+	dma_cookie_t cookie;
+	u32 residue;
+};
+
+struct xdma_lb_chan {
+	struct dma_chan chan;
+	struct xdma_lb_device *lb;
+	enum dma_transfer_direction dir;
+	int match;		/* private data compared by xdma_filter() */
+
+	struct list_head submitted;
+	struct list_head issued;	/* in the order they are worked on */
+	struct list_head completed;	/* waiting for the callback */
+	struct xdma_lb_residue history[XDMA_LB_HISTORY];
+};
+
+/* A tx/rx channel pair and a memory to memory channel, the lock protects
+ * the lists and cookies of all three.
+ */
+struct xdma_lb_device {
+	struct xdma_lb_chan tx;
+	struct xdma_lb_chan rx;
+	struct xdma_lb_chan mem;	/* only registered with 'cdma' */
+
+	spinlock_t lock;
+	struct work_struct work;	/* copies the data */
+	struct tasklet_struct tasklet;	/* runs the callbacks */
+	ktime_t busy_until;	/* end of the emulated transfer time */
+};
+
+struct xdma_lb {
+	struct dma_device dma;
+	struct xdma_lb_device *devs;
+};
+
+static struct platform_device *xdma_lb_pdev;
+
+static struct xdma_lb_chan *to_xdma_lb_chan(struct dma_chan *chan)
+{
+	return container_of(chan, struct xdma_lb_chan, chan);
+}
+
+static struct xdma_lb_desc *to_xdma_lb_desc(struct dma_async_tx_descriptor *tx)
+{
+	return container_of(tx, struct xdma_lb_desc, tx);
+}
+
+static struct xdma_lb_desc *xdma_lb_head(struct xdma_lb_chan *lbc)
+{
+	return list_first_entry_or_null(&lbc->issued, struct xdma_lb_desc,
+					node);
+}
+
+static dma_cookie_t xdma_lb_tx_submit(struct dma_async_tx_descriptor *tx)
+{
+	struct xdma_lb_chan *lbc = to_xdma_lb_chan(tx->chan);
+	struct xdma_lb_desc *desc = to_xdma_lb_desc(tx);
+	dma_cookie_t cookie;
+
+	spin_lock_bh(&lbc->lb->lock);
+
+	cookie = lbc->chan.cookie + 1;
+	if (cookie < DMA_MIN_COOKIE)
+		cookie = DMA_MIN_COOKIE;
+	lbc->chan.cookie = cookie;
+	tx->cookie = cookie;
+
+	list_add_tail(&desc->node, &lbc->submitted);
+
+	spin_unlock_bh(&lbc->lb->lock);
+
+	return cookie;
+}
+
+/* May be called in atomic context, like the prep of the real engine. */
+static struct dma_async_tx_descriptor *xdma_lb_prep_slave_sg(struct dma_chan
+							      *chan,
+							      struct scatterlist
+							      *sgl,
+							      unsigned int
+							      sg_len,
+							      enum
+							      dma_transfer_direction
+							      dir,
+							      unsigned long
+							      flags,
+							      void *context)
+{
+	struct xdma_lb_chan *lbc = to_xdma_lb_chan(chan);
+	struct xdma_lb_desc *desc;
+	struct scatterlist *sg;
+	int i;
+
+	if ((dir != lbc->dir) || (sg_len == 0))
+		return NULL;
+
+	desc = kzalloc(sizeof(struct xdma_lb_desc) +
+		       sg_len * sizeof(struct xdma_lb_seg), GFP_NOWAIT);
+	if (!desc)
+		return NULL;
+
+	for_each_sg(sgl, sg, sg_len, i) {
+		desc->segs[i].addr = sg_dma_address(sg);
+		desc->segs[i].len = sg_dma_len(sg);
+		desc->len += sg_dma_len(sg);
+	}
+	desc->nents = sg_len;
+
+	if (!desc->len) {
+		kfree(desc);
+		return NULL;
+	}
+
+	dma_async_tx_descriptor_init(&desc->tx, chan);
+	desc->tx.tx_submit = xdma_lb_tx_submit;
+	desc->tx.flags = flags;
+	INIT_LIST_HEAD(&desc->node);
+
+	return &desc->tx;
+}
+
+static struct dma_async_tx_descriptor *xdma_lb_prep_memcpy(struct dma_chan
+							    *chan,
+							    dma_addr_t dst,
+							    dma_addr_t src,
+							    size_t len,
+							    unsigned long
+							    flags)
+{
+	struct xdma_lb_desc *desc;
+
+	if (len == 0)
+		return NULL;
+
+	desc = kzalloc(sizeof(struct xdma_lb_desc) +
+		       2 * sizeof(struct xdma_lb_seg), GFP_NOWAIT);
+	if (!desc)
+		return NULL;
+
+	desc->segs[0].addr = src;
+	desc->segs[0].len = len;
+	desc->segs[1].addr = dst;
+	desc->segs[1].len = len;
+	desc->nents = 2;
+	desc->len = len;
+
+	dma_async_tx_descriptor_init(&desc->tx, chan);
+	desc->tx.tx_submit = xdma_lb_tx_submit;
+	desc->tx.flags = flags;
+	INIT_LIST_HEAD(&desc->node);
+
+	return &desc->tx;
+}
+
+/* A cyclic descriptor has a segment per period and starts over after the
+ * last one, so it never completes.
+ */
+static struct dma_async_tx_descriptor *xdma_lb_prep_cyclic(struct dma_chan
+							    *chan,
+							    dma_addr_t buf,
+							    size_t buf_len,
+							    size_t period_len,
+							    enum
+							    dma_transfer_direction
+							    dir,
+							    unsigned long
+							    flags,
+							    void *context)
+{
+	struct xdma_lb_chan *lbc = to_xdma_lb_chan(chan);
+	struct xdma_lb_desc *desc;
+	unsigned int i, n;
+
+	if ((dir != lbc->dir) || (dir != DMA_MEM_TO_DEV) || !period_len ||
+	    !buf_len || (buf_len % period_len))
+		return NULL;
+
+	n = buf_len / period_len;
+	desc = kzalloc(sizeof(struct xdma_lb_desc) +
+		       n * sizeof(struct xdma_lb_seg), GFP_NOWAIT);
+	if (!desc)
+		return NULL;
+
+	for (i = 0; i < n; i++) {
+		desc->segs[i].addr = buf + i * period_len;
+		desc->segs[i].len = period_len;
+	}
+	desc->nents = n;
+	desc->len = buf_len;
+	desc->cyclic = true;
+
+	dma_async_tx_descriptor_init(&desc->tx, chan);
+	desc->tx.tx_submit = xdma_lb_tx_submit;
+	desc->tx.flags = flags;
+	INIT_LIST_HEAD(&desc->node);
+
+	return &desc->tx;
+}
+
+static void xdma_lb_free_list(struct list_head *list)
+{
+	struct xdma_lb_desc *desc, *tmp;
+
+	list_for_each_entry_safe(desc, tmp, list, node) {
+		list_del(&desc->node);
+		kfree(desc);
+	}
+}
+
+/* Drop all descriptors of the channel without calling their callbacks. */
+static void xdma_lb_terminate(struct xdma_lb_chan *lbc)
+{
+	LIST_HEAD(dead);
+
+	spin_lock_bh(&lbc->lb->lock);
+	list_splice_tail_init(&lbc->submitted, &dead);
+	list_splice_tail_init(&lbc->issued, &dead);
+	list_splice_tail_init(&lbc->completed, &dead);
+	spin_unlock_bh(&lbc->lb->lock);
+
+	xdma_lb_free_list(&dead);
+}
+
+static int xdma_lb_control(struct dma_chan *chan, enum dma_ctrl_cmd cmd,
+			   unsigned long arg)
+{
+	struct xdma_lb_chan *lbc = to_xdma_lb_chan(chan);
+	struct xilinx_dma_config *cfg;
+
+	switch (cmd) {
+	case DMA_TERMINATE_ALL:
+		xdma_lb_terminate(lbc);
+		return 0;
+	case DMA_SLAVE_CONFIG:
+		// interrupt coalescing has no meaning here, only honour reset
+		cfg = (struct xilinx_dma_config *)arg;
+		if (cfg->reset)
+			xdma_lb_terminate(lbc);
+		return 0;
+	default:
+		return -ENXIO;
+	}
+}
+
+static enum dma_status xdma_lb_tx_status(struct dma_chan *chan,
+					 dma_cookie_t cookie,
+					 struct dma_tx_state *txstate)
+{
+	struct xdma_lb_chan *lbc = to_xdma_lb_chan(chan);
+	struct xdma_lb_desc *desc;
+	enum dma_status status;
+	u32 residue = 0;
+
+	spin_lock_bh(&lbc->lb->lock);
+
+	status = dma_async_is_complete(cookie, chan->completed_cookie,
+				       chan->cookie);
+
+	desc = xdma_lb_head(lbc);
+	if ((status != DMA_COMPLETE) && desc && (desc->tx.cookie == cookie))
+		residue = desc->len - desc->done;
+	else if ((status == DMA_COMPLETE) && (cookie > 0) &&
+		 (lbc->history[cookie % XDMA_LB_HISTORY].cookie == cookie))
+		residue = lbc->history[cookie % XDMA_LB_HISTORY].residue;
+
+	dma_set_tx_state(txstate, chan->completed_cookie, chan->cookie,
+			 residue);
+
+	spin_unlock_bh(&lbc->lb->lock);
+
+	return status;
+}
+
+static void xdma_lb_issue_pending(struct dma_chan *chan)
+{
+	struct xdma_lb_chan *lbc = to_xdma_lb_chan(chan);
+
+	spin_lock_bh(&lbc->lb->lock);
+	list_splice_tail_init(&lbc->submitted, &lbc->issued);
+	spin_unlock_bh(&lbc->lb->lock);
+
+	schedule_work(&lbc->lb->work);
+}
+
+static int xdma_lb_alloc_chan_resources(struct dma_chan *chan)
+{
+	struct xdma_lb_chan *lbc = to_xdma_lb_chan(chan);
+
+	chan->cookie = DMA_MIN_COOKIE;
+	chan->completed_cookie = DMA_MIN_COOKIE;
+	memset(lbc->history, 0, sizeof(lbc->history));
+
+	return 1;
+}
+
+static void xdma_lb_free_chan_resources(struct dma_chan *chan)
+{
+	xdma_lb_terminate(to_xdma_lb_chan(chan));
+}
+
+/* Address of the current position of 'desc' and the bytes left in its
+ * segment.
+ */
+static dma_addr_t xdma_lb_pos(struct xdma_lb_desc *desc, size_t *len)
+{
+	struct xdma_lb_seg *seg = &desc->segs[desc->seg];
+
+	*len = seg->len - desc->seg_off;
+	return seg->addr + desc->seg_off;
+}
+
+static void xdma_lb_advance(struct xdma_lb_desc *desc, size_t n)
+{
+	desc->done += n;
+	desc->seg_off += n;
+
+	// also skips empty segments
+	while ((desc->seg < desc->nents) &&
+	       (desc->seg_off == desc->segs[desc->seg].len)) {
+		desc->seg++;
+		desc->seg_off = 0;
+	}
+}
+
+/* Copy 'n' bytes that cross no page boundary. */
+static void xdma_lb_copy_page(dma_addr_t dst, dma_addr_t src, size_t n)
+{
+	void *src_va, *dst_va;
+
+	src_va = kmap_atomic(pfn_to_page(src >> PAGE_SHIFT));
+	dst_va = kmap_atomic(pfn_to_page(dst >> PAGE_SHIFT));
+	memcpy(dst_va + offset_in_page(dst), src_va + offset_in_page(src), n);
+	kunmap_atomic(dst_va);
+	kunmap_atomic(src_va);
+}
+
+/* Copy the next piece, at most up to a page boundary, from the head tx to
+ * the head rx descriptor. Called with the lock held, returns the number of
+ * bytes copied and if a descriptor filled up.
+ *
+ * A cyclic tx descriptor plays into a sink that is always ready, like a
+ * DAC. Its data only goes to the rx channel while that has a descriptor.
+ */
+static size_t xdma_lb_copy(struct xdma_lb_device *lb, bool *end)
+{
+	struct xdma_lb_desc *tx = xdma_lb_head(&lb->tx);
+	struct xdma_lb_desc *rx = xdma_lb_head(&lb->rx);
+	dma_addr_t src, dst;
+	size_t src_len, dst_len, n;
+	unsigned int seg;
+
+	if (!tx || (tx->done == tx->len))
+		return 0;
+
+	if (!rx || (rx->done == rx->len) || rx->eop) {
+		if (!tx->cyclic)
+			return 0;
+		rx = NULL;
+	}
+
+	xdma_lb_advance(tx, 0);
+	seg = tx->seg;
+
+	src = xdma_lb_pos(tx, &src_len);
+	n = min_t(size_t, src_len, PAGE_SIZE - offset_in_page(src));
+
+	if (rx) {
+		xdma_lb_advance(rx, 0);
+		dst = xdma_lb_pos(rx, &dst_len);
+		n = min(n, dst_len);
+		n = min_t(size_t, n, PAGE_SIZE - offset_in_page(dst));
+
+		xdma_lb_copy_page(dst, src, n);
+		xdma_lb_advance(rx, n);
+	}
+
+	xdma_lb_advance(tx, n);
+
+	if (tx->cyclic) {
+		// every period is a packet, after the last one it starts over
+		*end = (tx->seg != seg);
+		if (*end) {
+			tx->periods++;
+			if (rx)
+				rx->eop = true;
+			if (tx->done == tx->len) {
+				tx->done = 0;
+				tx->seg = 0;
+				tx->seg_off = 0;
+			}
+		} else if (rx) {
+			*end = (rx->done == rx->len);
+		}
+		return n;
+	}
+
+	// the end of the tx packet ends the rx descriptor
+	if (tx->done == tx->len)
+		rx->eop = true;
+
+	*end = (tx->done == tx->len) || (rx->done == rx->len);
+	return n;
+}
+
+/* Copy the next piece of the head memcpy descriptor, like xdma_lb_copy(). */
+static size_t xdma_lb_memcpy(struct xdma_lb_device *lb, bool *end)
+{
+	struct xdma_lb_desc *desc = xdma_lb_head(&lb->mem);
+	dma_addr_t src, dst;
+	size_t n;
+
+	if (!desc || (desc->done == desc->len))
+		return 0;
+
+	src = desc->segs[0].addr + desc->done;
+	dst = desc->segs[1].addr + desc->done;
+
+	n = desc->len - desc->done;
+	n = min_t(size_t, n, PAGE_SIZE - offset_in_page(src));
+	n = min_t(size_t, n, PAGE_SIZE - offset_in_page(dst));
+
+	xdma_lb_copy_page(dst, src, n);
+	desc->done += n;
+
+	*end = (desc->done == desc->len);
+	return n;
+}
+
+static void xdma_lb_complete(struct xdma_lb_chan *lbc,
+			     struct xdma_lb_desc *desc)
+{
+	struct xdma_lb_residue *h;
+
+	h = &lbc->history[desc->tx.cookie % XDMA_LB_HISTORY];
+	h->cookie = desc->tx.cookie;
+	h->residue = desc->len - desc->done;
+
+	lbc->chan.completed_cookie = desc->tx.cookie;
+	list_move_tail(&desc->node, &lbc->completed);
+}
+
+/* Complete the head descriptors that are done, with the lock held. */
+static void xdma_lb_retire(struct xdma_lb_device *lb)
+{
+	struct xdma_lb_desc *tx = xdma_lb_head(&lb->tx);
+	struct xdma_lb_desc *rx = xdma_lb_head(&lb->rx);
+	struct xdma_lb_desc *mem = xdma_lb_head(&lb->mem);
+
+	if (tx && (tx->done == tx->len))
+		xdma_lb_complete(&lb->tx, tx);
+
+	if (mem && (mem->done == mem->len))
+		xdma_lb_complete(&lb->mem, mem);
+
+	if (rx && ((rx->done == rx->len) || rx->eop))
+		xdma_lb_complete(&lb->rx, rx);
+
+	tasklet_schedule(&lb->tasklet);
+}
+
+/* Sleep for the time the engine would have needed for 'n' more bytes, plus
+ * the latency if a descriptor ended. Short waits are accumulated so the
+ * worker only sleeps once it is well ahead.
+ */
+static void xdma_lb_pace(struct xdma_lb_device *lb, size_t n, bool end)
+{
+	const unsigned int bw = ACCESS_ONCE(bandwidth);
+	ktime_t now = ktime_get();
+	u64 ns = 0;
+	s64 ahead;
+
+	if (bw)
+		ns += div_u64((u64) n * 1000, bw);	// 1 MB/s is 1000 ns/B
+	if (end)
+		ns += (u64) ACCESS_ONCE(latency_us) * 1000;
+
+	if (ktime_compare(lb->busy_until, now) < 0)
+		lb->busy_until = now;
+	lb->busy_until = ktime_add_ns(lb->busy_until, ns);
+
+	ahead = ktime_us_delta(lb->busy_until, now);
+	if ((ahead > 100) || (end && (ahead > 0)))
+		usleep_range(ahead, ahead + 10);
+}
+
+static void xdma_lb_work(struct work_struct *work)
+{
+	struct xdma_lb_device *lb = container_of(work, struct xdma_lb_device,
+						 work);
+	bool end, mem_end;
+	size_t n, m;
+
+	// the stream and the memcpy take turns at the emulated bandwidth
+	do {
+		end = false;
+		mem_end = false;
+
+		spin_lock_bh(&lb->lock);
+		n = xdma_lb_copy(lb, &end);
+		m = xdma_lb_memcpy(lb, &mem_end);
+		spin_unlock_bh(&lb->lock);
+
+		if (n || m)
+			xdma_lb_pace(lb, n + m, end || mem_end);
+
+		if (end || mem_end) {
+			spin_lock_bh(&lb->lock);
+			xdma_lb_retire(lb);
+			spin_unlock_bh(&lb->lock);
+		}
+
+		// a cyclic descriptor keeps the worker busy until terminated
+		cond_resched();
+	} while (n || m);
+}
+
+/* Run the callbacks in tasklet context, as the Xilinx driver does. */
+static void xdma_lb_tasklet(unsigned long data)
+{
+	struct xdma_lb_device *lb = (struct xdma_lb_device *)data;
+	struct xdma_lb_desc *desc, *tmp;
+	dma_async_tx_callback callback = NULL;
+	void *param = NULL;
+	unsigned int periods = 0;
+	LIST_HEAD(done);
+
+	spin_lock_bh(&lb->lock);
+	list_splice_tail_init(&lb->tx.completed, &done);
+	list_splice_tail_init(&lb->rx.completed, &done);
+	list_splice_tail_init(&lb->mem.completed, &done);
+
+	// the descriptor may be terminated once the lock is dropped
+	desc = xdma_lb_head(&lb->tx);
+	if (desc && desc->cyclic) {
+		periods = desc->periods;
+		desc->periods = 0;
+		callback = desc->tx.callback;
+		param = desc->tx.callback_param;
+	}
+	spin_unlock_bh(&lb->lock);
+
+	while (callback && periods--)
+		callback(param);
+
+	list_for_each_entry_safe(desc, tmp, &done, node) {
+		list_del(&desc->node);
+		if (desc->tx.callback)
+			desc->tx.callback(desc->tx.callback_param);
+		kfree(desc);
+	}
+}
+
+static void xdma_lb_init_chan(struct xdma_lb *xlb, struct xdma_lb_device *lb,
+			      struct xdma_lb_chan *lbc,
+			      enum dma_transfer_direction dir, int id)
+{
+	lbc->lb = lb;
+	lbc->dir = dir;
+	lbc->match = (dir & 0xFF) | (id << XILINX_DMA_DEVICE_ID_SHIFT) |
+	    ((dir == DMA_MEM_TO_MEM) ? XILINX_DMA_IP_CDMA : XILINX_DMA_IP_DMA);
+
+	INIT_LIST_HEAD(&lbc->submitted);
+	INIT_LIST_HEAD(&lbc->issued);
+	INIT_LIST_HEAD(&lbc->completed);
+
+	lbc->chan.device = &xlb->dma;
+	lbc->chan.private = &lbc->match;
+	list_add_tail(&lbc->chan.device_node, &xlb->dma.channels);
+}
+
+static int xdma_lb_probe(struct platform_device *pdev)
+{
+	struct xdma_lb *xlb;
+	struct dma_device *dma;
+	int ret;
+	int i;
+
+	ret = dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(32));
+	if (ret)
+		return ret;
+
+	xlb = devm_kzalloc(&pdev->dev, sizeof(struct xdma_lb), GFP_KERNEL);
+	if (!xlb)
+		return -ENOMEM;
+
+	xlb->devs = devm_kzalloc(&pdev->dev,
+				 devices * sizeof(struct xdma_lb_device),
+				 GFP_KERNEL);
+	if (!xlb->devs)
+		return -ENOMEM;
+
+	dma = &xlb->dma;
+	dma->dev = &pdev->dev;
+	INIT_LIST_HEAD(&dma->channels);
+	dma_cap_set(DMA_SLAVE, dma->cap_mask);
+	dma_cap_set(DMA_PRIVATE, dma->cap_mask);
+	dma_cap_set(DMA_CYCLIC, dma->cap_mask);
+	if (cdma)
+		dma_cap_set(DMA_MEMCPY, dma->cap_mask);
+	dma->device_alloc_chan_resources = xdma_lb_alloc_chan_resources;
+	dma->device_free_chan_resources = xdma_lb_free_chan_resources;
+	dma->device_prep_slave_sg = xdma_lb_prep_slave_sg;
+	dma->device_prep_dma_memcpy = xdma_lb_prep_memcpy;
+	dma->device_prep_dma_cyclic = xdma_lb_prep_cyclic;
+	dma->device_control = xdma_lb_control;
+	dma->device_tx_status = xdma_lb_tx_status;
+	dma->device_issue_pending = xdma_lb_issue_pending;
+
+	for (i = 0; i < devices; i++) {
+		struct xdma_lb_device *lb = &xlb->devs[i];
+
+		spin_lock_init(&lb->lock);
+		INIT_WORK(&lb->work, xdma_lb_work);
+		tasklet_init(&lb->tasklet, xdma_lb_tasklet, (unsigned long)lb);
+		lb->busy_until = ktime_get();
+
+		xdma_lb_init_chan(xlb, lb, &lb->tx, DMA_MEM_TO_DEV, i);
+		xdma_lb_init_chan(xlb, lb, &lb->rx, DMA_DEV_TO_MEM, i);
+
+		// without 'cdma' the channel is not registered, its lists stay
+		// empty
+		xdma_lb_init_chan(xlb, lb, &lb->mem, DMA_MEM_TO_MEM, i);
+		if (!cdma)
+			list_del(&lb->mem.chan.device_node);
+	}
+
+	ret = dma_async_device_register(dma);
+	if (ret) {
+		printk(KERN_ERR "<%s> Error: registering dma device failed\n",
+		       XDMA_LB_NAME);
+		return ret;
+	}
+
+	platform_set_drvdata(pdev, xlb);
+
+	printk(KERN_DEBUG "<%s> probe: %u loopback devices\n", XDMA_LB_NAME,
+	       devices);
+
+	return 0;
+}
+
+static int xdma_lb_remove(struct platform_device *pdev)
+{
+	struct xdma_lb *xlb = platform_get_drvdata(pdev);
+	int i;
+
+	// channels can not be in use, xdma.ko holds a reference on the module
+	dma_async_device_unregister(&xlb->dma);
+
+	for (i = 0; i < devices; i++) {
+		cancel_work_sync(&xlb->devs[i].work);
+		tasklet_kill(&xlb->devs[i].tasklet);
+	}
+
+	return 0;
+}
+
+static struct platform_driver xdma_lb_driver = {
+	.probe = xdma_lb_probe,
+	.remove = xdma_lb_remove,
+	.driver = {
+		   .name = XDMA_LB_NAME,
+		   .owner = THIS_MODULE,
+		   },
+};
+
+static int __init xdma_lb_init(void)
+{
+	int ret;
+
+	if ((devices == 0) || (devices > MAX_DEVICES))
+		return -EINVAL;
+
+	ret = platform_driver_register(&xdma_lb_driver);
+	if (ret)
+		return ret;
+
+	xdma_lb_pdev = platform_device_register_simple(XDMA_LB_NAME, -1, NULL,
+						       0);
+	if (IS_ERR(xdma_lb_pdev)) {
+		platform_driver_unregister(&xdma_lb_driver);
+		return PTR_ERR(xdma_lb_pdev);
+	}
+
+	// the device is probed synchronously, fail the load if that did
+	if (!platform_get_drvdata(xdma_lb_pdev)) {
+		platform_device_unregister(xdma_lb_pdev);
+		platform_driver_unregister(&xdma_lb_driver);
+		return -ENODEV;
+	}
+
+	return 0;
+}
+
+static void __exit xdma_lb_exit(void)
+{
+	platform_device_unregister(xdma_lb_pdev);
+	platform_driver_unregister(&xdma_lb_driver);
+}
+
+module_init(xdma_lb_init);
+module_exit(xdma_lb_exit);
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Loopback DMA engine for testing the xdma driver");
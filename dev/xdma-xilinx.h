@@ -0,0 +1,31 @@
+#ifndef XDMA_XILINX_H
+#define XDMA_XILINX_H
+
+/* Definitions shared with the Xilinx DMA engine drivers. Kernels without
+ * those drivers (a PC running the loopback module) lack their header, the
+ * Makefile then defines XDMA_NO_XILINX_DMA_H and the copy below is used.
+ */
+#ifndef XDMA_NO_XILINX_DMA_H
+#include <linux/amba/xilinx_dma.h>
+#else
+#include <linux/dmaengine.h>
+
+/* DMA IP masks */
+#define XILINX_DMA_IP_DMA	0x00100000	/* A DMA IP */
+#define XILINX_DMA_IP_CDMA	0x00200000	/* A Central DMA IP */
+#define XILINX_DMA_IP_VDMA	0x00400000	/* A Video DMA IP */
+#define XILINX_DMA_IP_MASK	0x00700000	/* DMA IP MASK */
+
+/* Device Id in the private structure */
+#define XILINX_DMA_DEVICE_ID_SHIFT	28
+
+/* Device configuration structure */
+struct xilinx_dma_config {
+	enum dma_transfer_direction direction;
+	int coalesc;
+	int delay;
+	int reset;
+};
+#endif
+
+#endif				/* XDMA_XILINX_H */
@@ -18,74 +18,445 @@
 #include <xen/page.h>
 
 #include <linux/slab.h>
-#include <linux/amba/xilinx_dma.h>
+#include "xdma-xilinx.h"
 #include <linux/platform_device.h>
 
-static dev_t dev_num;		// Global variable for the device number
-static struct cdev c_dev;	// Global variable for the character device structure
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/scatterlist.h>
+#include <linux/uio.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/compat.h>
+#include <linux/list.h>
+#include <linux/kref.h>
+#include <linux/spinlock.h>
+#include <linux/of.h>
+#include <linux/dma-buf.h>
+#include <linux/workqueue.h>
+#include <linux/pm_runtime.h>
+#include <linux/timer.h>
+#include <linux/ktime.h>
+#include <linux/atomic.h>
+
+/* Tracing of every file operation and ioctl, built in with
+ * 'make XDMA_DEBUG=1'. It is left out by default as it costs every
+ * transfer a trip through the kernel log.
+ */
+#ifdef XDMA_DEBUG
+#define xdma_dbg(fmt, ...) \
+	printk(KERN_DEBUG "<%s> " fmt, MODULE_NAME, ##__VA_ARGS__)
+#else
+#define xdma_dbg(fmt, ...)	do { } while (0)
+#endif
+
+/* Largest scatter-gather chunk used by read()/write(), kept well below the
+ * 23 bit buffer length register of the AXI DMA engine.
+ */
+#define XDMA_STREAM_PAGES	((4 * 1024 * 1024) >> PAGE_SHIFT)
+
+/* Scheduler limits, a transfer of a higher priority class waits for at most
+ * XDMA_SCHED_DEPTH descriptors (per channel), of up to 'max_chunk' bytes for
+ * clients that set one. Memory to memory copies are split at
+ * XDMA_SCHED_CHUNK otherwise. Each round of the deficit round robin grants
+ * XDMA_SCHED_QUANTUM bytes per unit of client weight.
+ */
+#define XDMA_SCHED_CHUNK	(256 * 1024)
+#define XDMA_SCHED_MIN_CHUNK	(4 * 1024)
+#define XDMA_SCHED_DEPTH	2
+#define XDMA_SCHED_QUANTUM	(64 * 1024)
+#define XDMA_SCHED_MAX_WEIGHT	64
+#define XDMA_SLOT_SEGS		16	// segments of a split descriptor
+
+/* Transfers a client may have prepared and not yet ended per channel, the
+ * ioctls that prepare more fail with -EAGAIN.
+ */
+#define XDMA_DEF_CREDITS	64
+#define XDMA_MAX_CREDITS	4096
+
+/* A stalled channel is reset when a transfer on it times out. Transfers
+ * marked XDMA_BUF_RETRY are submitted up to XDMA_SCHED_RETRIES more times.
+ */
+#define XDMA_SCHED_TIMEOUT	3000	// ms
+#define XDMA_SCHED_RETRIES	2
+
+/* A channel may bank XDMA_RATE_BURST ms of unused budget under a
+ * throughput cap, see xdma_rate_allow().
+ */
+#define XDMA_RATE_BURST		10	// ms
+#define XDMA_MAX_RATE		(16ULL << 30)	// bytes/s
+
+static unsigned int idle_ms = 1000;
+module_param(idle_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(idle_ms, "Suspend channels unused for this long [ms], 0 never");
+
+/* Stream geometry of engines whose device tree node does not give it. */
+#define XDMA_DEF_BUS_BYTES	4
+#define XDMA_DEF_BURST		16
+
+static dev_t dev_num;		// Global variable for the first device number
 static struct class *cl;	// Global variable for the device class
 
-char *xdma_addr;
-dma_addr_t xdma_handle;
+#define XDMA_MAX_CHANS	(MAX_DEVICES * 3)	// tx, rx and memory to memory
 
-struct xdma_dev *xdma_dev_info[MAX_DEVICES + 1];
-u32 num_devices;
+struct xdma_device;
+struct xdma_chan;
+struct xdma_client;
+struct xdma_xfer;
+struct xdma_cycle;
 
-static int xdma_open(struct inode *i, struct file *f)
+/* A descriptor on the engine. */
+struct xdma_slot {
+	struct xdma_chan *xchan;
+	struct xdma_xfer *xfer;	/* NULL if the slot is free */
+	size_t len;
+	dma_cookie_t cookie;
+	struct scatterlist sgl[XDMA_SLOT_SEGS];
+};
+
+/* Channels live in a table indexed by the handle userspace passes in, so a
+ * lookup is a bounds check and one cache line.
+ */
+struct xdma_chan {
+	struct dma_chan *chan;
+	struct xdma_device *xdev;	/* owning node */
+	struct mutex lock;	/* serializes read()/write() data */
+	u32 engine;		/* enum xdma_engine */
+	bool slave;		/* takes slave scatter-gather descriptors */
+
+	/* scheduler state, protected by 'sched_lock' */
+	spinlock_t sched_lock;
+	struct list_head active[XDMA_NUM_PRIOS];	/* queues with work */
+	struct xdma_slot slots[XDMA_SCHED_DEPTH];	/* in issue order */
+	unsigned int head;	/* oldest slot on the engine */
+	unsigned int inflight;	/* slots on the engine */
+	unsigned int stopping;	/* terminates in progress */
+	u64 bytes;		/* moved by the engine */
+	struct xdma_cycle *cyclic;	/* owns the engine while set */
+	wait_queue_head_t cyclic_wait;	/* woken every period */
+
+	/* throughput cap, protected by 'sched_lock' */
+	u64 rate;		/* bytes/s, 0 for none */
+	s64 budget;		/* bytes that may be submitted, < 0 is debt */
+	ktime_t budget_stamp;
+	struct timer_list rate_timer;	/* kicks once the debt is paid */
+
+	struct mutex reset_lock;	/* protects 'config' and 'resets' */
+	struct xilinx_dma_config config;	/* reapplied by resets */
+	bool configured;	/* engine holds 'config' */
+	unsigned int resets;
+
+	/* power, 'users' counts transfers and ioctls that need the engine */
+	atomic_t users;
+	struct mutex pm_lock;	/* protects the fields below */
+	struct delayed_work idle_work;
+	bool awake;		/* holds a runtime PM reference */
+	ktime_t awake_since;
+	u64 awake_ns;		/* of earlier wake periods */
+	u64 suspends;
+
+	u32 bus_bytes;		/* stream data width */
+	u32 burst;		/* beats per burst */
+} ____cacheline_aligned;
+
+/* Each probed tx/rx channel pair gets its own character device node
+ * (/dev/xdmaN) with its own DMA memory area, so users of different engines
+ * share no state in the driver.
+ */
+struct xdma_device {
+	struct cdev cdev;
+	u32 device_id;
+
+	struct xdma_chan *tx;	/* NULL if the engine has no tx channel */
+	struct xdma_chan *rx;	/* NULL if the engine has no rx channel */
+	struct xdma_chan *mem;	/* NULL if there is no CDMA for the node */
+	u32 engine;		/* enum xdma_engine of 'tx' and 'rx' */
+
+	struct mutex mem_lock;	/* protects the allocation of 'addr' */
+	char *addr;
+	dma_addr_t handle;
+};
+
+/* Started transfers of one client on one channel. */
+struct xdma_queue {
+	struct list_head node;	/* on an active list of the channel */
+	struct list_head xfers;	/* in start order */
+	size_t deficit;		/* bytes the queue may still submit */
+	struct xdma_client *client;
+	unsigned int pending;	/* transfers listed, under the client lock */
+};
+
+/* Every open file is a client of the scheduler. */
+struct xdma_client {
+	struct kref ref;
+	struct xdma_device *xdev;
+
+	u32 prio;		/* enum xdma_prio */
+	u32 weight;
+	u32 max_chunk;
+	u32 credits;		/* pending transfers allowed per channel */
+	wait_queue_head_t space;	/* woken when a transfer ends */
+
+	struct xdma_queue queues[XDMA_MAX_CHANS];	/* by channel handle */
+
+	spinlock_t lock;	/* protects 'xfers', 'next_cookie' and 'ring' */
+	struct list_head xfers;	/* prepared and started transfers */
+	s32 next_cookie;
+	struct xdma_ring *ring;	/* completion ring, once mapped */
+};
+
+/* A transfer is what userspace prepares, starts and waits for, its cookie
+ * is only meaningful to the client that prepared it.
+ */
+struct xdma_xfer {
+	struct kref ref;
+	struct xdma_client *client;
+	struct xdma_chan *xchan;
+	s32 cookie;
+	enum dma_transfer_direction dir;
+	bool started;		/* protected by the client lock */
+	bool retry;		/* XDMA_BUF_RETRY */
+	bool record;		/* posts a completion record */
+
+	/* chained transfers, protected by the client lock */
+	bool chained;		/* started by the end of an earlier one */
+	struct list_head chain;	/* transfers this one starts */
+	struct list_head cnode;	/* on the chain of the earlier one */
+
+	struct list_head node;	/* on the client list */
+	struct list_head qnode;	/* on the client queue */
+	struct list_head dnode;	/* on a list of retired transfers */
+
+	struct scatterlist *sgl;	/* DMA mapped segments */
+	unsigned int nents;
+	struct scatterlist sg;	/* 'sgl' of single buffer transfers */
+	struct scatterlist *own_sgl;	/* freed with the transfer */
+	size_t len;
+	dma_addr_t src;		/* DMA_MEM_TO_MEM source, 'sgl' is the dest */
+	struct dma_interleaved_template *xt;	/* frame, freed with it */
+	bool whole;		/* one descriptor, never split */
+
+	/* imported dma-buf, detached from process context on release */
+	struct dma_buf_attachment *attach;
+	struct sg_table *sgt;
+	struct work_struct detach_work;
+
+	/* protected by the scheduler lock of the channel */
+	struct scatterlist *pos;	/* next segment to submit */
+	size_t pos_off;
+	size_t queued;		/* bytes submitted to the engine */
+	size_t done;		/* bytes the engine actually moved */
+	unsigned int inflight;	/* descriptors on the engine */
+	unsigned int retries;	/* resubmissions left */
+	bool retired;
+	int status;
+
+	struct completion cmp;
+};
+
+static struct xdma_device *xdma_devices[MAX_DEVICES];
+static u32 num_devices;
+
+static struct xdma_chan xdma_chans[XDMA_MAX_CHANS];
+static u32 num_chans;
+
+static struct device *xdma_dma_dev(struct xdma_device *xdev)
 {
-	printk(KERN_DEBUG "<%s> file: open()\n", MODULE_NAME);
-	return 0;
+	struct xdma_chan *xchan = xdev->tx ? xdev->tx :
+	    (xdev->rx ? xdev->rx : xdev->mem);
+
+	return xchan->chan->device->dev;
 }
 
-static int xdma_close(struct inode *i, struct file *f)
+static u32 xdma_chan_handle(struct xdma_chan *xchan)
 {
-	printk(KERN_DEBUG "<%s> file: close()\n", MODULE_NAME);
-	return 0;
+	return xchan ? (u32) (xchan - xdma_chans) : XDMA_NO_CHAN;
+}
+
+/* The DMA memory area is only allocated once the node is first opened, so
+ * unused engines do not tie up contiguous memory.
+ */
+static int xdma_alloc_memory(struct xdma_device *xdev)
+{
+	int ret = 0;
+
+	mutex_lock(&xdev->mem_lock);
+	if (!xdev->addr) {
+		xdev->addr = dma_zalloc_coherent(xdma_dma_dev(xdev), DMA_LENGTH,
+						 &xdev->handle, GFP_KERNEL);
+		if (!xdev->addr) {
+			printk(KERN_ERR
+			       "<%s> Error: allocating dma memory failed\n",
+			       MODULE_NAME);
+			ret = -ENOMEM;
+		}
+	}
+	mutex_unlock(&xdev->mem_lock);
+
+	return ret;
+}
+
+static void xdma_queue_init(struct xdma_queue *q, struct xdma_client *client)
+{
+	INIT_LIST_HEAD(&q->node);
+	INIT_LIST_HEAD(&q->xfers);
+	q->deficit = 0;
+	q->client = client;
+}
+
+static struct xdma_client *xdma_client_alloc(struct xdma_device *xdev)
+{
+	struct xdma_client *client;
+	int i;
+
+	client = kzalloc(sizeof(struct xdma_client), GFP_KERNEL);
+	if (!client)
+		return NULL;
+
+	kref_init(&client->ref);
+	client->xdev = xdev;
+	client->prio = XDMA_PRIO_NORMAL;
+	client->weight = 1;
+	client->max_chunk = 0;	// never split packets
+	client->credits = XDMA_DEF_CREDITS;
+	init_waitqueue_head(&client->space);
+	for (i = 0; i < XDMA_MAX_CHANS; i++)
+		xdma_queue_init(&client->queues[i], client);
+	spin_lock_init(&client->lock);
+	INIT_LIST_HEAD(&client->xfers);
+	client->next_cookie = 1;
+
+	return client;
+}
+
+#define XDMA_RING_ORDER	get_order(sizeof(struct xdma_ring))
+
+static void xdma_client_release(struct kref *ref)
+{
+	struct xdma_client *client = container_of(ref, struct xdma_client, ref);
+
+	if (client->ring)
+		free_pages((unsigned long)client->ring, XDMA_RING_ORDER);
+	kfree(client);
+}
+
+static void xdma_client_stop(struct xdma_client *client,
+			     struct xdma_chan *xchan, bool terminate);
+static void xdma_sched_flush(struct xdma_chan *xchan, int err, bool reset);
+static int xdma_stop_cyclic(struct xdma_client *client,
+			    struct xdma_chan *xchan);
+
+static int xdma_open(struct inode *i, struct file *f)
+{
+	struct xdma_device *xdev;
+	struct xdma_client *client;
+	int ret;
+
+	xdma_dbg("file: open()\n");
+
+	xdev = container_of(i->i_cdev, struct xdma_device, cdev);
+
+	ret = xdma_alloc_memory(xdev);
+	if (ret)
+		return ret;
+
+	client = xdma_client_alloc(xdev);
+	if (!client)
+		return -ENOMEM;
+
+	f->private_data = client;
+
+	// read() and write() are DMA streams, there is no file position
+	return nonseekable_open(i, f);
 }
 
-static ssize_t xdma_read(struct file *f, char __user * buf, size_t
-			 len, loff_t * off)
+/* Prepared and queued transfers of the file are dropped, descriptors that
+ * are already on the engine are left to complete. Chains may have put
+ * transfers on the channels of other devices too.
+ */
+static int xdma_close(struct inode *i, struct file *f)
 {
-	printk(KERN_DEBUG "<%s> file: read()\n", MODULE_NAME);
+	struct xdma_client *client = f->private_data;
+	u32 n;
+
+	xdma_dbg("file: close()\n");
+
+	for (n = 0; n < num_chans; n++)
+		xdma_client_stop(client, &xdma_chans[n], false);
+
+	if (client->xdev->tx)
+		xdma_stop_cyclic(client, client->xdev->tx);
 
-	return simple_read_from_buffer(buf, len, off, xdma_addr, DMA_LENGTH);
+	kref_put(&client->ref, xdma_client_release);
+	return 0;
 }
 
-static ssize_t xdma_write(struct file *f, const char __user * buf,
-			  size_t len, loff_t * off)
+/* The ring is allocated when it is first mapped, the mapping holds the file
+ * and so the client.
+ */
+static int xdma_mmap_ring(struct xdma_client *client,
+			  struct vm_area_struct *vma)
 {
-	printk(KERN_DEBUG "<%s> file: write()\n", MODULE_NAME);
-	if (len > (DMA_LENGTH - 1))
+	struct xdma_ring *ring;
+
+	if ((vma->vm_pgoff != (XDMA_MMAP_RING >> PAGE_SHIFT)) ||
+	    (vma->vm_end - vma->vm_start >
+	     (PAGE_SIZE << XDMA_RING_ORDER)))
 		return -EINVAL;
 
-	if (copy_from_user(xdma_addr, buf, len))
-		return -EFAULT;
+	ring = (struct xdma_ring *)__get_free_pages(GFP_KERNEL | __GFP_ZERO,
+						    XDMA_RING_ORDER);
+	if (!ring)
+		return -ENOMEM;
+
+	spin_lock_bh(&client->lock);
+	if (!client->ring) {
+		client->ring = ring;
+		ring = NULL;
+	}
+	spin_unlock_bh(&client->lock);
+
+	if (ring)
+		free_pages((unsigned long)ring, XDMA_RING_ORDER);
 
-	xdma_addr[len] = '\0';
-	return len;
+	return remap_pfn_range(vma, vma->vm_start, virt_to_pfn(client->ring),
+			       vma->vm_end - vma->vm_start, vma->vm_page_prot);
 }
 
 static int xdma_mmap(struct file *filp, struct vm_area_struct *vma)
 {
+	struct xdma_client *client = filp->private_data;
+	struct xdma_device *xdev = client->xdev;
 	int result;
 	unsigned long requested_size;
+	unsigned long offset;
 	requested_size = vma->vm_end - vma->vm_start;
+	offset = vma->vm_pgoff << PAGE_SHIFT;
+
+	xdma_dbg("file: mmap()\n");
+	xdma_dbg("file: memory size reserved: %d, mmap size requested: %lu\n",
+		 DMA_LENGTH, requested_size);
 
-	printk(KERN_DEBUG "<%s> file: mmap()\n", MODULE_NAME);
-	printk(KERN_DEBUG
-	       "<%s> file: memory size reserved: %d, mmap size requested: %lu\n",
-	       MODULE_NAME, DMA_LENGTH, requested_size);
+	if (offset >= XDMA_MMAP_RING)
+		return xdma_mmap_ring(client, vma);
 
-	if (requested_size > DMA_LENGTH) {
-		printk(KERN_ERR "<%s> Error: %d reserved != %lu requested)\n",
-		       MODULE_NAME, DMA_LENGTH, requested_size);
+	if (offset >= XDMA_MMAP_WRITECOMBINE) {
+		offset -= XDMA_MMAP_WRITECOMBINE;
+		vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+	} else {
+		vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+	}
+
+	if ((offset >= DMA_LENGTH) || (requested_size > DMA_LENGTH - offset)) {
+		printk(KERN_ERR
+		       "<%s> Error: %d reserved != %lu requested at offset %lu)\n",
+		       MODULE_NAME, DMA_LENGTH, requested_size, offset);
 
 		return -EAGAIN;
 	}
 
-	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
 	result = remap_pfn_range(vma, vma->vm_start,
-				 virt_to_pfn(xdma_addr),
+				 virt_to_pfn(xdev->addr + offset),
 				 requested_size, vma->vm_page_prot);
 
 	if (result) {
@@ -99,15 +470,93 @@ static int xdma_mmap(struct file *filp, struct vm_area_struct *vma)
 	return 0;
 }
 
-static void xdma_get_dev_info(u32 device_id, struct xdma_dev *dev)
+/* Whether a channel has the configuration it was given at probe time.
+ */
+static bool xdma_chan_default(struct xdma_chan *xchan)
 {
-	int i;
+	bool ret;
 
-	for (i = 0; i < MAX_DEVICES; i++) {
-		if (xdma_dev_info[i]->device_id == device_id)
-			break;
+	if (!xchan)
+		return false;
+
+	mutex_lock(&xchan->reset_lock);
+	ret = xchan->configured &&
+	    (xchan->config.coalesc == XDMA_DEF_COALESC) &&
+	    (xchan->config.delay == XDMA_DEF_DELAY);
+	mutex_unlock(&xchan->reset_lock);
+
+	return ret;
+}
+
+static void xdma_get_dev_info(struct xdma_device *xdev, struct xdma_dev *dev)
+{
+	memset(dev, 0, sizeof(struct xdma_dev));
+
+	dev->device_id = xdev->device_id;
+	dev->tx_chan = xdma_chan_handle(xdev->tx);
+	dev->rx_chan = xdma_chan_handle(xdev->rx);
+	dev->mem_chan = xdma_chan_handle(xdev->mem);
+	dev->engine = xdev->engine;
+
+	if (xdev->tx) {
+		dev->bus_bytes = xdev->tx->bus_bytes;
+		dev->burst = xdev->tx->burst;
 	}
-	memcpy(dev, xdma_dev_info[i], sizeof(struct xdma_dev));
+
+	if (xdev->rx) {
+		dev->bus_bytes = max(dev->bus_bytes, xdev->rx->bus_bytes);
+		dev->burst = max(dev->burst, xdev->rx->burst);
+	}
+
+	if (xdma_chan_default(xdev->tx))
+		dev->flags |= XDMA_DEV_TX_DEFAULT;
+	if (xdma_chan_default(xdev->rx))
+		dev->flags |= XDMA_DEV_RX_DEFAULT;
+}
+
+static void xdma_get_info(struct xdma_info *info)
+{
+	u32 i;
+
+	memset(info, 0, sizeof(struct xdma_info));
+
+	info->abi_version = XDMA_ABI_VERSION;
+	info->num_devices = num_devices;
+	for (i = 0; i < num_devices; i++)
+		xdma_get_dev_info(xdma_devices[i], &info->devs[i]);
+}
+
+static struct xdma_chan *xdma_get_chan(u32 chan)
+{
+	if ((chan >= num_chans) || !xdma_chans[chan].chan)
+		return NULL;
+
+	return &xdma_chans[chan];
+}
+
+/* Only accept handles of channels that belong to this node.
+ */
+static struct xdma_chan *xdma_lookup_chan(struct xdma_device *xdev, u32 chan)
+{
+	struct xdma_chan *xchan = xdma_get_chan(chan);
+
+	if (!xchan || (xchan->xdev != xdev))
+		return NULL;
+
+	return xchan;
+}
+
+/* Like xdma_lookup_chan(), for the transfers that take slave scatter-gather
+ * descriptors: buffers, segment lists, dma-bufs and the stream interface.
+ */
+static struct xdma_chan *xdma_lookup_slave(struct xdma_device *xdev, u32 chan)
+{
+	struct xdma_chan *xchan = xdma_lookup_chan(xdev, chan);
+
+	if (!xchan || !xchan->slave)
+		return NULL;
+
+	return xchan;
 }
 
 static enum dma_transfer_direction xdma_to_dma_direction(enum xdma_direction
@@ -130,124 +579,2687 @@ static enum dma_transfer_direction xdma_to_dma_direction(enum xdma_direction
 	return dma_dir;
 }
 
-static void xdma_sync_callback(void *completion)
+/* Memory to memory engines need not implement device_control. */
+static int xdma_chan_control(struct dma_chan *chan, enum dma_ctrl_cmd cmd,
+			     unsigned long arg)
 {
-	complete(completion);
+	if (!chan->device->device_control)
+		return -ENXIO;
+
+	return chan->device->device_control(chan, cmd, arg);
 }
 
-static void xdma_device_control(struct xdma_chan_cfg *chan_cfg)
+static void xdma_stop_transfer(struct dma_chan *chan)
 {
-	struct dma_chan *chan;
-	struct dma_device *chan_dev;
+	if (chan)
+		xdma_chan_control(chan, DMA_TERMINATE_ALL, (unsigned long)NULL);
+}
+
+/* Power
+ *
+ * An awake channel holds a runtime PM reference on its engine, the engine
+ * driver may gate its clocks once all channels dropped theirs. Transfers
+ * and the ioctls that touch the engine wake the channel, and it suspends
+ * once it had no users for 'idle_ms'.
+ */
+static struct device *xdma_chan_dev(struct xdma_chan *xchan)
+{
+	return xchan->chan->device->dev;
+}
+
+/* Take a runtime PM reference and reapply the configuration, in case the
+ * engine lost it while suspended. Called with the PM lock held.
+ */
+static void xdma_chan_resume(struct xdma_chan *xchan)
+{
+	pm_runtime_get_sync(xdma_chan_dev(xchan));
+	xchan->awake = true;
+	xchan->awake_since = ktime_get();
+
+	mutex_lock(&xchan->reset_lock);
+	if (xchan->configured)
+		xchan->configured = !xdma_chan_control(xchan->chan,
+						       DMA_SLAVE_CONFIG,
+						       (unsigned long)
+						       &xchan->config);
+	mutex_unlock(&xchan->reset_lock);
+}
+
+/* Halt the engine and drop the runtime PM reference. Called with the PM
+ * lock held.
+ */
+static void xdma_chan_suspend(struct xdma_chan *xchan)
+{
+	xdma_stop_transfer(xchan->chan);
+
+	xchan->awake = false;
+	xchan->awake_ns += ktime_to_ns(ktime_sub(ktime_get(),
+						 xchan->awake_since));
+	xchan->suspends++;
+	pm_runtime_put(xdma_chan_dev(xchan));
+}
+
+static void xdma_chan_idle(struct work_struct *work)
+{
+	struct xdma_chan *xchan = container_of(to_delayed_work(work),
+					       struct xdma_chan, idle_work);
+
+	mutex_lock(&xchan->pm_lock);
+	if (xchan->awake && !atomic_read(&xchan->users)) {
+		// pairs with the barrier in xdma_pm_get(), so either a new
+		// user sees the channel asleep or it is seen here
+		xchan->awake = false;
+		smp_mb();
+		if (atomic_read(&xchan->users))
+			xchan->awake = true;
+		else
+			xdma_chan_suspend(xchan);
+	}
+	mutex_unlock(&xchan->pm_lock);
+}
+
+/* Count a user of the channel and wake it up, may sleep. */
+static void xdma_pm_get(struct xdma_chan *xchan)
+{
+	atomic_inc(&xchan->users);
+	smp_mb();
+	if (ACCESS_ONCE(xchan->awake))
+		return;
+
+	mutex_lock(&xchan->pm_lock);
+	if (!xchan->awake)
+		xdma_chan_resume(xchan);
+	mutex_unlock(&xchan->pm_lock);
+}
+
+/* Drop a user, the last one starts the idle timeout. Any context. */
+static void xdma_pm_put(struct xdma_chan *xchan)
+{
+	unsigned int ms = ACCESS_ONCE(idle_ms);
+
+	if (atomic_dec_and_test(&xchan->users) && ms)
+		mod_delayed_work(system_wq, &xchan->idle_work,
+				 msecs_to_jiffies(ms));
+}
+
+/* Configure the channel, the configuration is kept so a reset can restore
+ * it. A reset goes through the scheduler, which aborts the descriptors on
+ * the engine first.
+ */
+static int xdma_device_control(struct xdma_device *xdev,
+			       struct xdma_chan_cfg *chan_cfg)
+{
+	struct xdma_chan *xchan;
 	struct xilinx_dma_config config;
+	int ret = 0;
+
+	xchan = xdma_lookup_chan(xdev, chan_cfg->chan);
+	if (!xchan)
+		return -EINVAL;
 
-	config.direction = xdma_to_dma_direction(chan_cfg->dir);
+	if (xchan == xdev->mem)
+		config.direction = DMA_MEM_TO_MEM;
+	else
+		config.direction = xdma_to_dma_direction(chan_cfg->dir);
 	config.coalesc = chan_cfg->coalesc;
 	config.delay = chan_cfg->delay;
-	config.reset = chan_cfg->reset;
+	config.reset = 0;
 
-	chan = (struct dma_chan *)chan_cfg->chan;
+	xdma_pm_get(xchan);
+	mutex_lock(&xchan->reset_lock);
+	if (!chan_cfg->reset && xchan->configured &&
+	    (xchan->config.direction == config.direction) &&
+	    (xchan->config.coalesc == config.coalesc) &&
+	    (xchan->config.delay == config.delay)) {
+		// already set up like this, leave the engine alone
+		goto out;
+	}
 
-	if (chan) {
-		chan_dev = chan->device;
-		chan_dev->device_control(chan, DMA_SLAVE_CONFIG,
-					 (unsigned long)&config);
+	xchan->config = config;
+	if (chan_cfg->reset) {
+		xdma_sched_flush(xchan, -ECANCELED, true);
+	} else {
+		ret = xdma_chan_control(xchan->chan, DMA_SLAVE_CONFIG,
+					(unsigned long)&config);
+		xchan->configured = (ret == 0);
 	}
+ out:
+	mutex_unlock(&xchan->reset_lock);
+	xdma_pm_put(xchan);
+
+	return ret;
 }
 
-static int xdma_prep_buffer(struct xdma_buf_info *buf_info)
+/* Scheduler
+ *
+ * All transfers, from the ioctls as well as from read()/write(), are queued
+ * per client and channel and fed to the engine by the scheduler of the
+ * channel, so no client can monopolise a shared engine. Queues are served
+ * by strict priority between the classes of enum xdma_prio and by deficit
+ * round robin over bytes, weighted by the client weight, within a class.
+ *
+ * Only XDMA_SCHED_DEPTH descriptors are on the engine at a time, so other
+ * queues get their turn at every descriptor boundary. The engine ends an
+ * AXI stream packet with each descriptor, so a transfer is one descriptor
+ * unless its client asked for MEM_TO_DEV splitting with 'max_chunk'.
+ * DEV_TO_MEM transfers are always a single descriptor, the engine ends it
+ * with the packet.
+ *
+ * Locking: the client lock may be held when taking the scheduler lock, not
+ * the other way around. Retired transfers are collected on a list and
+ * finished after the scheduler lock is dropped.
+ */
+static struct xdma_queue *xdma_client_queue(struct xdma_client *client,
+					    struct xdma_chan *xchan)
 {
-	int ret = 0;
-	struct dma_chan *chan;
-	dma_addr_t buf;
-	size_t len;
-	enum dma_transfer_direction dir;
-	enum dma_ctrl_flags flags;
-	struct dma_async_tx_descriptor *chan_desc;
-	struct completion *cmp;
-	dma_cookie_t cookie;
+	return &client->queues[xdma_chan_handle(xchan)];
+}
 
-	chan = (struct dma_chan *)buf_info->chan;
-	cmp = (struct completion *)buf_info->completion;
-	buf = xdma_handle + buf_info->buf_offset;
-	len = buf_info->buf_size;
-	dir = xdma_to_dma_direction(buf_info->dir);
+static struct xdma_xfer *xdma_xfer_alloc(struct xdma_client *client,
+					 struct xdma_chan *xchan,
+					 enum dma_transfer_direction dir)
+{
+	struct xdma_xfer *xfer;
 
-	flags = DMA_CTRL_ACK | DMA_PREP_INTERRUPT;
+	xfer = kzalloc(sizeof(struct xdma_xfer), GFP_KERNEL);
+	if (!xfer)
+		return NULL;
 
-	chan_desc = dmaengine_prep_slave_single(chan, buf, len, dir, flags);
+	xdma_pm_get(xchan);	// dropped when the transfer is freed
+	kref_init(&xfer->ref);	// owned by the client list
+	kref_get(&client->ref);
+	xfer->client = client;
+	xfer->xchan = xchan;
+	xfer->dir = dir;
+	// decided once, a later XDMA_SET_QOS doesn't reframe started packets
+	xfer->whole = (dir == DMA_MEM_TO_DEV) && !client->max_chunk;
+	INIT_LIST_HEAD(&xfer->node);
+	INIT_LIST_HEAD(&xfer->qnode);
+	INIT_LIST_HEAD(&xfer->dnode);
+	INIT_LIST_HEAD(&xfer->chain);
+	INIT_LIST_HEAD(&xfer->cnode);
+	init_completion(&xfer->cmp);
 
-	if (!chan_desc) {
-		printk(KERN_ERR
-		       "<%s> Error: dmaengine_prep_slave_single error\n",
-		       MODULE_NAME);
-		ret = -1;
-		buf_info->cookie = -EBUSY;
-	} else {
-		chan_desc->callback = xdma_sync_callback;
-		chan_desc->callback_param = cmp;
+	return xfer;
+}
+
+static enum dma_data_direction xdma_to_data_direction(enum
+						      dma_transfer_direction
+						      dir)
+{
+	return (dir == DMA_MEM_TO_DEV) ? DMA_TO_DEVICE : DMA_FROM_DEVICE;
+}
+
+static void xdma_xfer_detach(struct work_struct *work)
+{
+	struct xdma_xfer *xfer = container_of(work, struct xdma_xfer,
+					      detach_work);
+	struct dma_buf *dmabuf = xfer->attach->dmabuf;
+
+	dma_buf_unmap_attachment(xfer->attach, xfer->sgt,
+				 xdma_to_data_direction(xfer->dir));
+	dma_buf_detach(dmabuf, xfer->attach);
+	dma_buf_put(dmabuf);
+
+	kfree(xfer->own_sgl);
+	kfree(xfer->xt);
+	kfree(xfer);
+}
+
+static void xdma_xfer_release(struct kref *ref)
+{
+	struct xdma_xfer *xfer = container_of(ref, struct xdma_xfer, ref);
+
+	xdma_pm_put(xfer->xchan);
+	kref_put(&xfer->client->ref, xdma_client_release);
+
+	// the last reference may go in the completion callback, but
+	// detaching a dma-buf can sleep
+	if (xfer->attach) {
+		INIT_WORK(&xfer->detach_work, xdma_xfer_detach);
+		schedule_work(&xfer->detach_work);
+		return;
+	}
+
+	kfree(xfer->own_sgl);
+	kfree(xfer->xt);
+	kfree(xfer);
+}
+
+static void xdma_xfer_put(struct xdma_xfer *xfer)
+{
+	kref_put(&xfer->ref, xdma_xfer_release);
+}
+
+/* Give a transfer with its segments set up a cookie and add it to the
+ * client list, called with the client lock held.
+ */
+static void xdma_client_add(struct xdma_client *client, struct xdma_xfer *xfer)
+{
+	xfer->pos = xfer->sgl;
+	xfer->cookie = client->next_cookie;
+	client->next_cookie = (client->next_cookie == INT_MAX) ?
+	    1 : client->next_cookie + 1;
+
+	list_add_tail(&xfer->node, &client->xfers);
+	xdma_client_queue(client, xfer->xchan)->pending++;
+}
+
+/* Take a transfer off the client list, with the client lock held. Returns
+ * false if it was not on the list.
+ */
+static bool xdma_client_del(struct xdma_client *client, struct xdma_xfer *xfer)
+{
+	if (list_empty(&xfer->node))
+		return false;
+
+	list_del_init(&xfer->node);
+	xdma_client_queue(client, xfer->xchan)->pending--;
+	wake_up_interruptible(&client->space);
+
+	return true;
+}
+
+/* Whether the client may prepare 'n' more transfers on the channel. */
+static bool xdma_client_space(struct xdma_client *client,
+			      struct xdma_chan *xchan, unsigned int n)
+{
+	return ACCESS_ONCE(xdma_client_queue(client, xchan)->pending) + n <=
+	    ACCESS_ONCE(client->credits);
+}
+
+/* Post the completion record of an ended transfer, with the client lock
+ * held. The lock makes the callbacks of all channels a single producer.
+ */
+static void xdma_ring_write(struct xdma_ring *ring, s32 cookie, int status,
+			    u64 bytes)
+{
+	struct xdma_ring_entry *entry;
+	u32 head = ring->head;
+
+	if (head - ACCESS_ONCE(ring->tail) >= XDMA_RING_ENTRIES) {
+		ring->dropped++;
+		return;
+	}
+
+	// do not overwrite the entry before the consumer is done with it
+	smp_mb();
+
+	entry = &ring->entries[head & (XDMA_RING_ENTRIES - 1)];
+	entry->cookie = cookie;
+	entry->status = status;
+	entry->bytes = bytes;
+	entry->timestamp = ktime_to_ns(ktime_get());
+
+	smp_wmb();
+	ACCESS_ONCE(ring->head) = head + 1;
+}
+
+static void xdma_ring_post(struct xdma_ring *ring, struct xdma_xfer *xfer)
+{
+	xdma_ring_write(ring, xfer->cookie, xfer->status, xfer->done);
+}
+
+/* Drop 'xfer' from the client list, and the reference of the list. A
+ * transfer userspace holds a cookie of is posted to the completion ring.
+ */
+static void xdma_client_forget(struct xdma_xfer *xfer)
+{
+	struct xdma_client *client = xfer->client;
+	bool listed;
+
+	spin_lock_bh(&client->lock);
+	listed = xdma_client_del(client, xfer);
+	if (client->ring && xfer->record)
+		xdma_ring_post(client->ring, xfer);
+	spin_unlock_bh(&client->lock);
+
+	if (listed)
+		xdma_xfer_put(xfer);
+}
+
+static size_t xdma_xfer_chunk(struct xdma_xfer *xfer)
+{
+	size_t left = xfer->len - xfer->queued;
+
+	if ((xfer->dir == DMA_DEV_TO_MEM) || xfer->xt || xfer->whole)
+		return left;
+
+	// copies have no packets to keep whole
+	return min_t(size_t, left, xfer->client->max_chunk ?
+		     xfer->client->max_chunk : XDMA_SCHED_CHUNK);
+}
+
+static void xdma_queue_activate(struct xdma_chan *xchan, struct xdma_queue *q)
+{
+	if (list_empty(&q->node) && !list_empty(&q->xfers))
+		list_add_tail(&q->node, &xchan->active[q->client->prio]);
+}
+
+/* Take 'xfer' off its queue, an idle queue also loses its deficit. */
+static void xdma_queue_remove(struct xdma_chan *xchan, struct xdma_xfer *xfer)
+{
+	struct xdma_queue *q = xdma_client_queue(xfer->client, xchan);
+
+	list_del_init(&xfer->qnode);
+	if (list_empty(&q->xfers)) {
+		list_del_init(&q->node);
+		q->deficit = 0;
+	}
+}
+
+static void xdma_sched_retire(struct xdma_xfer *xfer, struct list_head *done)
+{
+	xfer->retired = true;
+	list_add_tail(&xfer->dnode, done);
+}
+
+/* End 'xfer' with 'err' once none of its descriptors is on the engine. */
+static void xdma_sched_fail(struct xdma_chan *xchan, struct xdma_xfer *xfer,
+			    int err, struct list_head *done)
+{
+	if (!xfer->status)
+		xfer->status = err;
+
+	if (!list_empty(&xfer->qnode))
+		xdma_queue_remove(xchan, xfer);
+
+	if (!xfer->inflight)
+		xdma_sched_retire(xfer, done);
+}
+
+/* Release the oldest slot on the engine. 'residue' is what the engine
+ * reported as not transferred, a DEV_TO_MEM packet may end before the
+ * buffer is full.
+ */
+static void xdma_sched_complete(struct xdma_chan *xchan, int err,
+				size_t residue, struct list_head *done)
+{
+	struct xdma_slot *slot = &xchan->slots[xchan->head];
+	struct xdma_xfer *xfer = slot->xfer;
+	size_t moved;
+
+	slot->xfer = NULL;
+	xchan->head = (xchan->head + 1) % XDMA_SCHED_DEPTH;
+	xchan->inflight--;
+	xfer->inflight--;
+
+	if (!err) {
+		moved = slot->len - min(residue, slot->len);
+		xfer->done += moved;
+		xchan->bytes += moved;
+	}
+
+	if (err || xfer->status)
+		xdma_sched_fail(xchan, xfer, err, done);
+	else if (!xfer->inflight && (xfer->queued == xfer->len))
+		xdma_sched_retire(xfer, done);
+}
+
+/* Release the oldest slot after its descriptor was terminated. A transfer
+ * that may be retried starts over at the front of its queue once none of
+ * its descriptors is left on the engine.
+ */
+static void xdma_sched_abort(struct xdma_chan *xchan, int err,
+			     struct list_head *done)
+{
+	struct xdma_slot *slot = &xchan->slots[xchan->head];
+	struct xdma_xfer *xfer = slot->xfer;
+	struct xdma_queue *q;
+
+	if (xfer->status || !xfer->retries) {
+		xdma_sched_complete(xchan, err, 0, done);
+		return;
+	}
+
+	slot->xfer = NULL;
+	xchan->head = (xchan->head + 1) % XDMA_SCHED_DEPTH;
+	xchan->inflight--;
+	xfer->inflight--;
+
+	if (xfer->inflight)
+		return;
+
+	xfer->retries--;
+	xfer->pos = xfer->sgl;
+	xfer->pos_off = 0;
+	xfer->queued = 0;
+	xfer->done = 0;
+
+	q = xdma_client_queue(xfer->client, xchan);
+	list_del(&xfer->qnode);
+	list_add(&xfer->qnode, &q->xfers);
+	xdma_queue_activate(xchan, q);
+}
+
+/* Select the queue to submit from, NULL if there is no work. */
+static struct xdma_queue *xdma_sched_pick(struct xdma_chan *xchan)
+{
+	struct xdma_queue *q;
+	struct xdma_xfer *xfer;
+	int prio;
+
+	for (prio = 0; prio < XDMA_NUM_PRIOS; prio++) {
+		while (!list_empty(&xchan->active[prio])) {
+			q = list_first_entry(&xchan->active[prio],
+					     struct xdma_queue, node);
+			xfer = list_first_entry(&q->xfers, struct xdma_xfer,
+						qnode);
+			if (xdma_xfer_chunk(xfer) <= q->deficit)
+				return q;
+
+			// share used up, top it up for the next round
+			q->deficit += q->client->weight * XDMA_SCHED_QUANTUM;
+			list_move_tail(&q->node, &xchan->active[prio]);
+		}
+	}
+
+	return NULL;
+}
+
+static void xdma_sched_callback(void *param);
+
+/* Describe the next MEM_TO_DEV descriptor of 'xfer' in the segments of
+ * 'slot', at most 'max_chunk' bytes. Returns the number of segments.
+ */
+static unsigned int xdma_slot_fill(struct xdma_slot *slot,
+				   struct xdma_xfer *xfer, size_t *chunk)
+{
+	struct scatterlist *sgl = slot->sgl;
+	unsigned int nents = 0;
+	size_t max = xdma_xfer_chunk(xfer);
+
+	*chunk = 0;
+	sg_init_table(sgl, XDMA_SLOT_SEGS);
+
+	while (xfer->pos && (nents < XDMA_SLOT_SEGS) && (*chunk < max)) {
+		size_t n = min_t(size_t, max - *chunk,
+				 sg_dma_len(xfer->pos) - xfer->pos_off);
+
+		if (n) {
+			sg_dma_address(&sgl[nents]) =
+			    sg_dma_address(xfer->pos) + xfer->pos_off;
+			sg_dma_len(&sgl[nents]) = n;
+			nents++;
+			*chunk += n;
+			xfer->pos_off += n;
+		}
+
+		if (xfer->pos_off == sg_dma_len(xfer->pos)) {
+			xfer->pos = sg_next(xfer->pos);
+			xfer->pos_off = 0;
+		}
+	}
+
+	if (nents)
+		sg_mark_end(&sgl[nents - 1]);
+
+	return nents;
+}
+
+/* Submit the next descriptor of 'xfer' into the next free slot. */
+static int xdma_sched_submit(struct xdma_chan *xchan, struct xdma_xfer *xfer,
+			     size_t *len)
+{
+	struct xdma_slot *slot;
+	struct dma_chan *chan = xchan->chan;
+	struct dma_async_tx_descriptor *chan_desc;
+	enum dma_ctrl_flags flags;
+	dma_cookie_t cookie;
+	unsigned int nents;
+	size_t chunk;
+
+	slot = &xchan->slots[(xchan->head + xchan->inflight) %
+			     XDMA_SCHED_DEPTH];
+	flags = DMA_CTRL_ACK | DMA_PREP_INTERRUPT;
+
+	if (xfer->xt) {
+		chunk = xfer->len;
+		chan_desc = dmaengine_prep_interleaved_dma(chan, xfer->xt, flags);
+	} else if (xfer->dir == DMA_MEM_TO_MEM) {
+		chunk = xdma_xfer_chunk(xfer);
+		chan_desc = chan->device->device_prep_dma_memcpy(chan,
+				sg_dma_address(xfer->sgl) + xfer->queued,
+				xfer->src + xfer->queued, chunk, flags);
+	} else if ((xfer->dir == DMA_DEV_TO_MEM) || xfer->whole) {
+		chunk = xfer->len;
+		chan_desc = dmaengine_prep_slave_sg(chan, xfer->sgl, xfer->nents,
+						    xfer->dir, flags);
+	} else {
+		nents = xdma_slot_fill(slot, xfer, &chunk);
+		if (!nents)
+			return -EINVAL;
+		chan_desc = dmaengine_prep_slave_sg(chan, slot->sgl, nents,
+						    xfer->dir, flags);
+	}
+
+	if (!chan_desc) {
+		printk(KERN_ERR "<%s> Error: preparing a descriptor failed\n",
+		       MODULE_NAME);
+		return -EBUSY;
+	}
+
+	chan_desc->callback = xdma_sched_callback;
+	chan_desc->callback_param = slot;
+
+	cookie = chan_desc->tx_submit(chan_desc);
+	if (dma_submit_error(cookie)) {
+		printk(KERN_ERR "<%s> Error: tx_submit error\n", MODULE_NAME);
+		return -EIO;
+	}
+
+	slot->xfer = xfer;
+	slot->len = chunk;
+	slot->cookie = cookie;
+	xchan->inflight++;
+	xfer->inflight++;
+	xfer->queued += chunk;
+
+	*len = chunk;
+	return 0;
+}
+
+/* Throughput cap
+ *
+ * A capped channel earns budget at 'rate' bytes per second and submits a
+ * descriptor whenever its budget is not negative. A descriptor may take
+ * more than what is left, the debt is paid off before the next one, so
+ * large DEV_TO_MEM buffers need no splitting. Called with the scheduler
+ * lock held, arms the rate timer if the channel has to wait.
+ */
+static bool xdma_rate_allow(struct xdma_chan *xchan)
+{
+	ktime_t now = ktime_get();
+	u64 ns = ktime_to_ns(ktime_sub(now, xchan->budget_stamp));
+	s64 burst = div_u64(xchan->rate * XDMA_RATE_BURST, MSEC_PER_SEC);
+	u64 debt;
+
+	// at most a second, so 'ns * rate' cannot overflow
+	ns = min_t(u64, ns, NSEC_PER_SEC);
+	xchan->budget += div_u64(ns * xchan->rate, NSEC_PER_SEC);
+	xchan->budget = min(xchan->budget, burst);
+	xchan->budget_stamp = now;
+
+	if (xchan->budget >= 0)
+		return true;
+
+	debt = -xchan->budget;
+	mod_timer(&xchan->rate_timer,
+		  jiffies + div64_u64(debt * HZ, xchan->rate) + 1);
+	return false;
+}
+
+/* Fill the free slots of the channel, called with the scheduler lock held.
+ * Transfers that fail to submit are added to 'done'.
+ */
+static void xdma_sched_dispatch(struct xdma_chan *xchan,
+				struct list_head *done)
+{
+	struct xdma_queue *q;
+	struct xdma_xfer *xfer;
+	bool issue = false;
+	size_t len;
+	int ret;
+
+	while (!xchan->stopping && !xchan->cyclic &&
+	       (xchan->inflight < XDMA_SCHED_DEPTH)) {
+		q = xdma_sched_pick(xchan);
+		if (!q)
+			break;
+
+		if (xchan->rate && !xdma_rate_allow(xchan))
+			break;
+
+		xfer = list_first_entry(&q->xfers, struct xdma_xfer, qnode);
+		ret = xdma_sched_submit(xchan, xfer, &len);
+		if (ret) {
+			xdma_sched_fail(xchan, xfer, ret, done);
+			continue;
+		}
+
+		q->deficit -= len;
+		if (xchan->rate)
+			xchan->budget -= len;
+		if (xfer->queued == xfer->len)
+			xdma_queue_remove(xchan, xfer);
+		issue = true;
+	}
+
+	if (issue)
+		dma_async_issue_pending(xchan->chan);
+}
+
+static void xdma_chain_advance(struct xdma_xfer *xfer);
+
+/* Wake the waiters of retired transfers and drop the scheduler reference. */
+static void xdma_sched_finish(struct list_head *done)
+{
+	struct xdma_xfer *xfer, *tmp;
+
+	list_for_each_entry_safe(xfer, tmp, done, dnode) {
+		list_del_init(&xfer->dnode);
+		xdma_chain_advance(xfer);
+		xdma_client_forget(xfer);
+		complete_all(&xfer->cmp);
+		xdma_xfer_put(xfer);
+	}
+}
+
+static void xdma_sched_callback(void *param)
+{
+	struct xdma_slot *slot = param;
+	struct xdma_chan *xchan = slot->xchan;
+	struct dma_tx_state state;
+	enum dma_status status;
+	LIST_HEAD(done);
+
+	spin_lock_bh(&xchan->sched_lock);
+
+	// descriptors complete in order, skip callbacks racing a terminate
+	if ((slot == &xchan->slots[xchan->head]) && slot->xfer) {
+		state.residue = 0;
+		status = dmaengine_tx_status(xchan->chan, slot->cookie, &state);
+		if (status != DMA_IN_PROGRESS) {
+			xdma_sched_complete(xchan,
+					    (status == DMA_COMPLETE) ? 0 : -EIO,
+					    state.residue, &done);
+			xdma_sched_dispatch(xchan, &done);
+		}
+	}
+
+	spin_unlock_bh(&xchan->sched_lock);
+
+	xdma_sched_finish(&done);
+}
+
+/* Put a started transfer on its queue, with the client lock held. Returns
+ * false if it already ended.
+ */
+static bool xdma_xfer_queue(struct xdma_xfer *xfer)
+{
+	struct xdma_chan *xchan = xfer->xchan;
+	struct xdma_queue *q = xdma_client_queue(xfer->client, xchan);
+	bool queued = false;
+
+	spin_lock(&xchan->sched_lock);
+	if (!xfer->retired) {
+		list_add_tail(&xfer->qnode, &q->xfers);
+		xdma_queue_activate(xchan, q);
+		queued = true;
+	}
+	spin_unlock(&xchan->sched_lock);
+
+	return queued;
+}
+
+/* Hand a prepared transfer to the scheduler, with the client lock held. A
+ * chained transfer is only queued once the transfer before it ends.
+ */
+static void xdma_xfer_start(struct xdma_xfer *xfer)
+{
+	xfer->started = true;
+	kref_get(&xfer->ref);	// dropped when the transfer retires
+
+	if (!xfer->chained)
+		xdma_xfer_queue(xfer);
+}
+
+/* Submit queued work to the engine. */
+static void xdma_sched_kick(struct xdma_chan *xchan)
+{
+	LIST_HEAD(done);
+
+	// make stores through a write-combined mapping visible to the engine
+	wmb();
+
+	spin_lock_bh(&xchan->sched_lock);
+	xdma_sched_dispatch(xchan, &done);
+	spin_unlock_bh(&xchan->sched_lock);
+
+	xdma_sched_finish(&done);
+}
+
+static void xdma_rate_expire(unsigned long data)
+{
+	xdma_sched_kick((struct xdma_chan *)data);
+}
+
+/* Cap the throughput of a channel of the node, for all its users. */
+static int xdma_set_rate(struct xdma_device *xdev, struct xdma_rate *info)
+{
+	struct xdma_chan *xchan;
+
+	xchan = xdma_lookup_chan(xdev, info->chan);
+	if (!xchan || (info->bytes_per_sec > XDMA_MAX_RATE) || info->reserved)
+		return -EINVAL;
+
+	spin_lock_bh(&xchan->sched_lock);
+	xchan->rate = info->bytes_per_sec;
+	xchan->budget = 0;
+	xchan->budget_stamp = ktime_get();
+	spin_unlock_bh(&xchan->sched_lock);
+
+	// a higher cap or none may let queued work through right away
+	xdma_sched_kick(xchan);
+
+	return 0;
+}
+
+static int xdma_get_chan_stats(struct xdma_device *xdev,
+			       struct xdma_chan_stats *stats)
+{
+	struct xdma_chan *xchan;
+
+	xchan = xdma_lookup_chan(xdev, stats->chan);
+	if (!xchan)
+		return -EINVAL;
+
+	mutex_lock(&xchan->pm_lock);
+	stats->awake = xchan->awake;
+	stats->awake_ns = xchan->awake_ns;
+	if (xchan->awake)
+		stats->awake_ns += ktime_to_ns(ktime_sub(ktime_get(),
+							 xchan->awake_since));
+	stats->suspends = xchan->suspends;
+	mutex_unlock(&xchan->pm_lock);
+
+	spin_lock_bh(&xchan->sched_lock);
+	stats->bytes = xchan->bytes;
+	stats->bytes_per_sec = xchan->rate;
+	spin_unlock_bh(&xchan->sched_lock);
+
+	return 0;
+}
+
+/* Kick the channels in the bit mask 'kick' of channel handles. */
+static void xdma_sched_kick_mask(unsigned long kick)
+{
+	u32 n;
+
+	for (n = 0; n < num_chans; n++)
+		if (kick & (1UL << n))
+			xdma_sched_kick(&xdma_chans[n]);
+}
+
+/* Reset the engine and reapply the configuration of the channel, with the
+ * reset lock held.
+ */
+static void xdma_chan_reset(struct xdma_chan *xchan)
+{
+	struct xilinx_dma_config config = xchan->config;
+	int ret;
+
+	config.reset = 1;
+	ret = xdma_chan_control(xchan->chan, DMA_SLAVE_CONFIG,
+				(unsigned long)&config);
+	if (ret)
+		printk(KERN_ERR "<%s> Error: channel reset failed: %d\n",
+		       MODULE_NAME, ret);
+
+	xchan->configured = (ret == 0);
+	xchan->resets++;
+}
+
+/* Terminate the channel, and reset it if asked to with the reset lock held.
+ * Transfers of the descriptors on the engine end with 'err' or, if they may
+ * be retried, are queued again. Queued work is submitted once the channel
+ * is back.
+ */
+static void xdma_sched_flush(struct xdma_chan *xchan, int err, bool reset)
+{
+	LIST_HEAD(done);
+
+	spin_lock_bh(&xchan->sched_lock);
+	xchan->stopping++;
+	spin_unlock_bh(&xchan->sched_lock);
+
+	xdma_stop_transfer(xchan->chan);
+	if (reset)
+		xdma_chan_reset(xchan);
+
+	spin_lock_bh(&xchan->sched_lock);
+	while (xchan->inflight)
+		xdma_sched_abort(xchan, err, &done);
+	xchan->stopping--;
+	xdma_sched_dispatch(xchan, &done);
+	spin_unlock_bh(&xchan->sched_lock);
+
+	xdma_sched_finish(&done);
+}
+
+/* Terminate the engine for a transfer that had it to itself, the caller
+ * raised 'stopping' so nothing else reached the engine meanwhile.
+ */
+static void xdma_sched_terminate(struct xdma_chan *xchan)
+{
+	LIST_HEAD(done);
+
+	xdma_sched_flush(xchan, -ECANCELED, false);
+
+	spin_lock_bh(&xchan->sched_lock);
+	xchan->stopping--;
+	xdma_sched_dispatch(xchan, &done);
+	spin_unlock_bh(&xchan->sched_lock);
+
+	xdma_sched_finish(&done);
+}
+
+/* End a started transfer with 'err'. With 'terminate' its descriptors on the
+ * engine are removed, but only if no other transfer has descriptors there.
+ * Else they drain normally, other clients never lose work to this one.
+ */
+static void xdma_sched_cancel(struct xdma_xfer *xfer, int err, bool terminate)
+{
+	struct xdma_chan *xchan = xfer->xchan;
+	LIST_HEAD(done);
+
+	spin_lock_bh(&xchan->sched_lock);
+	if (xfer->retired || !xfer->inflight ||
+	    (xchan->inflight != xfer->inflight))
+		terminate = false;
+	if (terminate)
+		xchan->stopping++;
+	if (!xfer->retired)
+		xdma_sched_fail(xchan, xfer, err, &done);
+	spin_unlock_bh(&xchan->sched_lock);
+
+	xdma_sched_finish(&done);
+
+	if (terminate)
+		xdma_sched_terminate(xchan);
+}
+
+/* Cancel one transfer of 'client'. What it has on the engine finishes
+ * normally, and the transfer ends with -ECANCELED once that landed. With
+ * XDMA_CANCEL_ENGINE those descriptors are terminated instead, but only if
+ * no other transfer has descriptors on the engine, else -EBUSY.
+ */
+static int xdma_cancel(struct xdma_client *client, struct xdma_cancel *info)
+{
+	struct xdma_xfer *xfer = NULL, *iter;
+	struct xdma_chan *xchan;
+	bool terminate = false;
+	bool started = false;
+	bool ended;
+	LIST_HEAD(done);
+	int ret = 0;
+
+	if (info->flags & ~XDMA_CANCEL_ENGINE)
+		return -EINVAL;
+
+	spin_lock_bh(&client->lock);
+	list_for_each_entry(iter, &client->xfers, node) {
+		if (iter->cookie == info->cookie) {
+			xfer = iter;
+			break;
+		}
+	}
+
+	if (xfer) {
+		started = xfer->started;
+		if (started) {
+			kref_get(&xfer->ref);
+		} else {
+			// never started, it just leaves the client
+			xdma_client_del(client, xfer);
+			xfer->status = -ECANCELED;
+			if (client->ring && xfer->record)
+				xdma_ring_post(client->ring, xfer);
+		}
+	}
+	ended = (info->cookie > 0) && (info->cookie < client->next_cookie);
+	spin_unlock_bh(&client->lock);
+
+	// transfers leave the client list once they ended
+	if (!xfer)
+		return ended ? 0 : -EINVAL;
+
+	if (!started) {
+		xdma_xfer_put(xfer);	// reference of the list
+		return 0;
+	}
+
+	xchan = xfer->xchan;
+
+	spin_lock_bh(&xchan->sched_lock);
+	if (!xfer->retired) {
+		if ((info->flags & XDMA_CANCEL_ENGINE) && xfer->inflight) {
+			if (xchan->inflight != xfer->inflight) {
+				ret = -EBUSY;
+			} else {
+				// nothing else may reach the engine until then
+				xchan->stopping++;
+				terminate = true;
+			}
+		}
+
+		if (!ret)
+			xdma_sched_fail(xchan, xfer, -ECANCELED, &done);
+	}
+	spin_unlock_bh(&xchan->sched_lock);
+
+	xdma_sched_finish(&done);
+
+	if (terminate)
+		xdma_sched_terminate(xchan);
+
+	xdma_xfer_put(xfer);
+
+	return ret;
+}
+
+/* Called for every transfer that ended, before its waiters are woken. The
+ * transfers chained to it are queued, and their channels kicked, straight
+ * from the completion callback. If it failed they end with -EPIPE instead.
+ */
+static void xdma_chain_advance(struct xdma_xfer *xfer)
+{
+	struct xdma_client *client = xfer->client;
+	struct xdma_xfer *next, *tmp;
+	unsigned long kick = 0;
+	LIST_HEAD(failed);
+
+	// chains only shrink once prepared, most transfers have none
+	if (list_empty(&xfer->chain) && list_empty(&xfer->cnode))
+		return;
+
+	spin_lock_bh(&client->lock);
+	list_del_init(&xfer->cnode);	// ended before its turn came
+	list_for_each_entry_safe(next, tmp, &xfer->chain, cnode) {
+		next->chained = false;
+
+		if (xfer->status) {
+			kref_get(&next->ref);
+			list_move_tail(&next->cnode, &failed);
+		} else {
+			list_del_init(&next->cnode);
+			if (xdma_xfer_queue(next))
+				kick |= 1UL << xdma_chan_handle(next->xchan);
+		}
+	}
+	spin_unlock_bh(&client->lock);
+
+	xdma_sched_kick_mask(kick);
+
+	// the list is shared with 'cnode' users, only pop it under the lock
+	for (;;) {
+		spin_lock_bh(&client->lock);
+		next = list_first_entry_or_null(&failed, struct xdma_xfer,
+						cnode);
+		if (next)
+			list_del_init(&next->cnode);
+		spin_unlock_bh(&client->lock);
+
+		if (!next)
+			break;
+
+		xdma_sched_cancel(next, -EPIPE, false);
+		xdma_xfer_put(next);
+	}
+}
+
+/* Reset a channel that stalled, 'gen' is the reset count the caller saw
+ * before it started waiting. Waiters timing out on the same stall only
+ * reset the channel once.
+ */
+static void xdma_sched_recover(struct xdma_chan *xchan, unsigned int gen)
+{
+	mutex_lock(&xchan->reset_lock);
+	if (xchan->resets == gen) {
+		printk(KERN_ERR "<%s> Error: channel stalled, resetting\n",
+		       MODULE_NAME);
+		xdma_sched_flush(xchan, -ETIMEDOUT, true);
+	}
+	mutex_unlock(&xchan->reset_lock);
+}
+
+/* Wait for a cancelled transfer until its descriptors left the engine. They
+ * may be queued behind those of other clients, so the channel is still
+ * reset if it stalls meanwhile.
+ */
+static void xdma_xfer_drain(struct xdma_xfer *xfer)
+{
+	struct xdma_chan *xchan = xfer->xchan;
+	unsigned long tmo = msecs_to_jiffies(XDMA_SCHED_TIMEOUT);
+	unsigned int gen;
+
+	for (;;) {
+		gen = ACCESS_ONCE(xchan->resets);
+		if (wait_for_completion_timeout(&xfer->cmp, tmo))
+			break;
+
+		xdma_sched_recover(xchan, gen);
+	}
+}
+
+/* Wait for a started transfer. If that takes too long the channel is reset,
+ * a transfer that may be retried is then waited for again, others end with
+ * -ETIMEDOUT.
+ */
+static int xdma_xfer_wait(struct xdma_xfer *xfer, bool interruptible)
+{
+	struct xdma_chan *xchan = xfer->xchan;
+	unsigned long tmo = msecs_to_jiffies(XDMA_SCHED_TIMEOUT);
+	unsigned int gen;
+	int tries = 0;
+	long ret;
+
+	for (;;) {
+		gen = ACCESS_ONCE(xchan->resets);
+
+		if (interruptible)
+			ret = wait_for_completion_interruptible_timeout(
+			    &xfer->cmp, tmo);
+		else
+			ret = wait_for_completion_timeout(&xfer->cmp, tmo);
+
+		if (ret > 0)
+			break;
+
+		if (ret < 0) {
+			xdma_sched_cancel(xfer, -ERESTARTSYS, true);
+			xdma_xfer_drain(xfer);
+			break;
+		}
+
+		printk(KERN_ERR "<%s> Error: transfer timed out\n",
+		       MODULE_NAME);
+
+		// a chained transfer never reached its engine, which is fine
+		if (!ACCESS_ONCE(xfer->chained))
+			xdma_sched_recover(xchan, gen);
+
+		if (!xfer->retry || (++tries > XDMA_SCHED_RETRIES)) {
+			xdma_sched_cancel(xfer, -ETIMEDOUT, true);
+			xdma_xfer_drain(xfer);
+			break;
+		}
+	}
+
+	return xfer->status;
+}
+
+/* Drop all transfers of 'client' on the channel. */
+static void xdma_client_stop(struct xdma_client *client,
+			     struct xdma_chan *xchan, bool terminate)
+{
+	struct xdma_xfer *xfer, *iter;
+
+	do {
+		xfer = NULL;
+
+		spin_lock_bh(&client->lock);
+		list_for_each_entry(iter, &client->xfers, node) {
+			if (iter->xchan == xchan) {
+				xfer = iter;
+				xdma_client_del(client, xfer);
+				break;
+			}
+		}
+		spin_unlock_bh(&client->lock);
+
+		if (xfer) {
+			if (xfer->started)
+				xdma_sched_cancel(xfer, -ECANCELED, terminate);
+			xdma_xfer_put(xfer);	// reference of the list
+		}
+	} while (xfer);
+}
+
+static int xdma_set_qos(struct xdma_client *client, struct xdma_qos *qos)
+{
+	struct xdma_chan *xchan;
+	struct xdma_queue *q;
+	u32 n;
+
+	if ((qos->prio >= XDMA_NUM_PRIOS) || (qos->weight == 0) ||
+	    (qos->weight > XDMA_SCHED_MAX_WEIGHT) ||
+	    (qos->max_chunk && (qos->max_chunk < XDMA_SCHED_MIN_CHUNK)))
+		return -EINVAL;
+
+	client->prio = qos->prio;
+	client->weight = qos->weight;
+	client->max_chunk = qos->max_chunk;
+
+	// active queues move to the list of their new class
+	for (n = 0; n < num_chans; n++) {
+		xchan = &xdma_chans[n];
+		q = &client->queues[n];
+
+		spin_lock_bh(&xchan->sched_lock);
+		if (!list_empty(&q->node))
+			list_move_tail(&q->node, &xchan->active[client->prio]);
+		spin_unlock_bh(&xchan->sched_lock);
+	}
+
+	return 0;
+}
+
+/* Wait until the client may prepare a transfer on the channel again. */
+static int xdma_wait_space(struct xdma_client *client, struct xdma_space *sp)
+{
+	struct xdma_chan *xchan;
+	long ret;
+
+	xchan = xdma_get_chan(sp->chan);
+	if (!xchan)
+		return -EINVAL;
+
+	ret = wait_event_interruptible_timeout(client->space,
+					       xdma_client_space(client, xchan,
+								 1),
+					       msecs_to_jiffies(sp->timeout_ms));
+	if (ret < 0)
+		return ret;
+
+	return ret ? 0 : -ETIMEDOUT;
+}
+
+static int xdma_prep_buffer(struct xdma_client *client,
+			    struct xdma_buf_info *buf_info)
+{
+	struct xdma_device *xdev = client->xdev;
+	struct xdma_chan *xchan;
+	struct xdma_xfer *xfer;
+	enum dma_transfer_direction dir;
+
+	xchan = xdma_lookup_slave(xdev, buf_info->chan);
+	if (!xchan)
+		return -EINVAL;
+
+	if ((buf_info->buf_offset > DMA_LENGTH) ||
+	    (buf_info->buf_size == 0) ||
+	    (buf_info->buf_size > DMA_LENGTH - buf_info->buf_offset))
+		return -EINVAL;
+
+	dir = xdma_to_dma_direction(buf_info->dir);
+	if ((dir == DMA_TRANS_NONE) || (buf_info->flags & ~XDMA_BUF_RETRY))
+		return -EINVAL;
+
+	// the descriptors are only prepared once the scheduler submits them
+	xfer = xdma_xfer_alloc(client, xchan, dir);
+	if (!xfer)
+		return -ENOMEM;
+
+	sg_init_table(&xfer->sg, 1);
+	sg_dma_address(&xfer->sg) = xdev->handle + buf_info->buf_offset;
+	sg_dma_len(&xfer->sg) = buf_info->buf_size;
+	xfer->sgl = &xfer->sg;
+	xfer->nents = 1;
+	xfer->len = buf_info->buf_size;
+	xfer->record = true;
+	if (buf_info->flags & XDMA_BUF_RETRY) {
+		xfer->retry = true;
+		xfer->retries = XDMA_SCHED_RETRIES;
+	}
+
+	spin_lock_bh(&client->lock);
+	if (!xdma_client_space(client, xchan, 1)) {
+		spin_unlock_bh(&client->lock);
+		xdma_xfer_put(xfer);
+		return -EAGAIN;
+	}
+	xdma_client_add(client, xfer);
+	buf_info->cookie = xfer->cookie;
+	spin_unlock_bh(&client->lock);
+
+	return 0;
+}
+
+static enum dma_transfer_direction xdma_chan_direction(struct xdma_chan *xchan)
+{
+	return (xchan == xchan->xdev->tx) ? DMA_MEM_TO_DEV : DMA_DEV_TO_MEM;
+}
+
+/* Prepare a gather (MEM_TO_DEV) or scatter (DEV_TO_MEM) transfer over
+ * pieces of the DMA memory, so a header and a payload need not be copied
+ * next to each other first.
+ */
+static int xdma_prep_sg(struct xdma_client *client, struct xdma_sg_info *info)
+{
+	struct xdma_device *xdev = client->xdev;
+	struct xdma_chan *xchan;
+	struct xdma_xfer *xfer;
+	struct scatterlist *sgl;
+	struct xdma_seg *seg;
+	size_t len = 0;
+	u32 i;
+
+	xchan = xdma_lookup_slave(xdev, info->chan);
+	if (!xchan)
+		return -EINVAL;
+
+	if ((info->nsegs == 0) || (info->nsegs > XDMA_MAX_SEGS) ||
+	    (info->flags & ~XDMA_BUF_RETRY))
+		return -EINVAL;
+
+	for (i = 0; i < info->nsegs; i++) {
+		seg = &info->segs[i];
+		if ((seg->offset > DMA_LENGTH) || (seg->size == 0) ||
+		    (seg->size > DMA_LENGTH - seg->offset))
+			return -EINVAL;
+		len += seg->size;
+	}
+
+	xfer = xdma_xfer_alloc(client, xchan, xdma_chan_direction(xchan));
+	if (!xfer)
+		return -ENOMEM;
+
+	sgl = kcalloc(info->nsegs, sizeof(struct scatterlist), GFP_KERNEL);
+	if (!sgl) {
+		xdma_xfer_put(xfer);
+		return -ENOMEM;
+	}
+
+	sg_init_table(sgl, info->nsegs);
+	for (i = 0; i < info->nsegs; i++) {
+		sg_dma_address(&sgl[i]) = xdev->handle + info->segs[i].offset;
+		sg_dma_len(&sgl[i]) = info->segs[i].size;
+	}
+
+	xfer->own_sgl = sgl;
+	xfer->sgl = sgl;
+	xfer->nents = info->nsegs;
+	xfer->len = len;
+	xfer->record = true;
+	if (info->flags & XDMA_BUF_RETRY) {
+		xfer->retry = true;
+		xfer->retries = XDMA_SCHED_RETRIES;
+	}
+
+	spin_lock_bh(&client->lock);
+	if (!xdma_client_space(client, xchan, 1)) {
+		spin_unlock_bh(&client->lock);
+		xdma_xfer_put(xfer);	// also drops the dma-buf, if any
+		return -EAGAIN;
+	}
+	xdma_client_add(client, xfer);
+	info->cookie = xfer->cookie;
+	spin_unlock_bh(&client->lock);
+
+	return 0;
+}
+
+/* Prepare a copy within the DMA memory by the memory to memory channel of
+ * the node. It is split into descriptors of 'max_chunk', or
+ * XDMA_SCHED_CHUNK, bytes so the clients sharing the engine take turns.
+ */
+static int xdma_prep_memcpy(struct xdma_client *client,
+			    struct xdma_memcpy *info)
+{
+	struct xdma_device *xdev = client->xdev;
+	struct xdma_chan *xchan;
+	struct xdma_xfer *xfer;
+
+	xchan = xdma_lookup_chan(xdev, info->chan);
+	if (!xchan || (xchan != xdev->mem))
+		return -EINVAL;
+
+	if ((info->src_offset > DMA_LENGTH) ||
+	    (info->dst_offset > DMA_LENGTH) || (info->size == 0) ||
+	    (info->size > DMA_LENGTH - info->src_offset) ||
+	    (info->size > DMA_LENGTH - info->dst_offset) ||
+	    (info->flags & ~XDMA_BUF_RETRY))
+		return -EINVAL;
+
+	xfer = xdma_xfer_alloc(client, xchan, DMA_MEM_TO_MEM);
+	if (!xfer)
+		return -ENOMEM;
+
+	sg_init_table(&xfer->sg, 1);
+	sg_dma_address(&xfer->sg) = xdev->handle + info->dst_offset;
+	sg_dma_len(&xfer->sg) = info->size;
+	xfer->sgl = &xfer->sg;
+	xfer->nents = 1;
+	xfer->src = xdev->handle + info->src_offset;
+	xfer->len = info->size;
+	xfer->record = true;
+	if (info->flags & XDMA_BUF_RETRY) {
+		xfer->retry = true;
+		xfer->retries = XDMA_SCHED_RETRIES;
+	}
+
+	spin_lock_bh(&client->lock);
+	if (!xdma_client_space(client, xchan, 1)) {
+		spin_unlock_bh(&client->lock);
+		xdma_xfer_put(xfer);
+		return -EAGAIN;
+	}
+	xdma_client_add(client, xfer);
+	info->cookie = xfer->cookie;
+	spin_unlock_bh(&client->lock);
+
+	return 0;
+}
+
+/* Describe a frame as an interleaved template of one chunk per row. The
+ * memory side skips the gap after each row, the stream does not.
+ */
+static struct dma_interleaved_template *xdma_frame_xt(struct xdma_device *xdev,
+						      struct xdma_frame *info,
+						      enum dma_transfer_direction
+						      dir)
+{
+	struct dma_interleaved_template *xt;
+	dma_addr_t addr = xdev->handle + info->offset;
+
+	xt = kzalloc(sizeof(struct dma_interleaved_template) +
+		     sizeof(struct data_chunk), GFP_KERNEL);
+	if (!xt)
+		return NULL;
+
+	xt->dir = dir;
+	if (dir == DMA_MEM_TO_DEV) {
+		xt->src_start = addr;
+		xt->src_inc = true;
+		xt->src_sgl = true;
+	} else {
+		xt->dst_start = addr;
+		xt->dst_inc = true;
+		xt->dst_sgl = true;
+	}
+	xt->numf = info->rows;
+	xt->frame_size = 1;
+	xt->sgl[0].size = info->row_size;
+	xt->sgl[0].icg = info->stride - info->row_size;
+
+	return xt;
+}
+
+/* Describe a frame as a list with a segment per row, or a single segment
+ * when the rows are back to back.
+ */
+static struct scatterlist *xdma_frame_sgl(struct xdma_device *xdev,
+					  struct xdma_frame *info,
+					  unsigned int *nents)
+{
+	struct scatterlist *sgl;
+	unsigned int i;
+
+	*nents = (info->stride == info->row_size) ? 1 : info->rows;
+
+	sgl = kcalloc(*nents, sizeof(struct scatterlist), GFP_KERNEL);
+	if (!sgl)
+		return NULL;
+
+	sg_init_table(sgl, *nents);
+	for (i = 0; i < *nents; i++) {
+		sg_dma_address(&sgl[i]) = xdev->handle + info->offset +
+		    i * info->stride;
+		sg_dma_len(&sgl[i]) = (*nents == 1) ?
+		    info->rows * info->row_size : info->row_size;
+	}
+
+	return sgl;
+}
+
+/* Prepare a 2D frame, such as an image tile, as a single descriptor so it
+ * needs no repacking by the CPU. Channels that take interleaved descriptors
+ * (AXI VDMA) get one, the others (AXI DMA) a scatter-gather list with a
+ * segment per row that is never split into chunks.
+ */
+static int xdma_prep_frame(struct xdma_client *client,
+			   struct xdma_frame *info)
+{
+	struct xdma_device *xdev = client->xdev;
+	struct xdma_chan *xchan;
+	struct xdma_xfer *xfer;
+	unsigned int nents;
+	bool interleave;
+
+	xchan = xdma_lookup_chan(xdev, info->chan);
+	if (!xchan || (xchan == xdev->mem))
+		return -EINVAL;
+
+	if ((info->rows == 0) || (info->row_size == 0) ||
+	    (info->stride < info->row_size) || (info->stride > DMA_LENGTH) ||
+	    (info->rows > DMA_LENGTH) || (info->offset > DMA_LENGTH) ||
+	    ((info->rows - 1) * info->stride + info->row_size >
+	     DMA_LENGTH - info->offset) || (info->flags & ~XDMA_BUF_RETRY))
+		return -EINVAL;
+
+	interleave = dma_has_cap(DMA_INTERLEAVE,
+				 xchan->chan->device->cap_mask);
+	if (!interleave && !xchan->slave)
+		return -EOPNOTSUPP;
+
+	if (!interleave && (info->stride != info->row_size) &&
+	    (info->rows > XDMA_MAX_ROWS))
+		return -EINVAL;
+
+	xfer = xdma_xfer_alloc(client, xchan, xdma_chan_direction(xchan));
+	if (!xfer)
+		return -ENOMEM;
+
+	if (interleave) {
+		xfer->xt = xdma_frame_xt(xdev, info, xfer->dir);
+		if (!xfer->xt) {
+			xdma_xfer_put(xfer);
+			return -ENOMEM;
+		}
+	} else {
+		xfer->own_sgl = xdma_frame_sgl(xdev, info, &nents);
+		if (!xfer->own_sgl) {
+			xdma_xfer_put(xfer);
+			return -ENOMEM;
+		}
+		xfer->sgl = xfer->own_sgl;
+		xfer->nents = nents;
+		xfer->whole = true;
+	}
+
+	xfer->len = info->rows * info->row_size;
+	xfer->record = true;
+	if (info->flags & XDMA_BUF_RETRY) {
+		xfer->retry = true;
+		xfer->retries = XDMA_SCHED_RETRIES;
+	}
+
+	spin_lock_bh(&client->lock);
+	if (!xdma_client_space(client, xchan, 1)) {
+		spin_unlock_bh(&client->lock);
+		xdma_xfer_put(xfer);
+		return -EAGAIN;
+	}
+	xdma_client_add(client, xfer);
+	info->cookie = xfer->cookie;
+	spin_unlock_bh(&client->lock);
+
+	return 0;
+}
+
+/* Cyclic playback
+ *
+ * A cyclic descriptor plays a table in the DMA memory on a tx channel over
+ * and over without the CPU, for example a waveform for a DAC. It owns the
+ * engine until it is stopped, transfers queued on the channel wait until
+ * then. A swap copies the periods of a new table over the old ones, each
+ * right after the engine played it, so no period is played half old and
+ * half new.
+ */
+struct xdma_cycle {
+	struct xdma_client *client;	/* owner */
+	struct xdma_chan *xchan;
+	s32 cookie;
+	u32 periods;
+	size_t period_size;
+	size_t offset;
+	u32 pos;		/* period the engine plays next */
+	u64 played;
+
+	/* a swap in progress copies 'swap_left' more periods from 'swap',
+	 * 'swap_pending' of them were played and wait for 'swap_work'
+	 */
+	size_t swap;
+	u32 swap_left;
+	u32 swap_pending;
+	u32 swap_pos;		/* next period to copy */
+	u64 swapped;		/* first period of the new table */
+	struct work_struct swap_work;
+};
+
+/* Copy the played periods of a swap over the old table. A period may take
+ * milliseconds to copy from uncached memory, too long for the tasklet. The
+ * copy must end before the engine comes back to the period, which is why a
+ * swap needs XDMA_CYCLIC_MIN_SWAP periods.
+ */
+static void xdma_cyclic_swap_work(struct work_struct *work)
+{
+	struct xdma_cycle *cyc = container_of(work, struct xdma_cycle,
+					      swap_work);
+	struct xdma_chan *xchan = cyc->xchan;
+	size_t from, to;
+
+	for (;;) {
+		spin_lock_bh(&xchan->sched_lock);
+		if (!cyc->swap_pending) {
+			spin_unlock_bh(&xchan->sched_lock);
+			break;
+		}
+		from = cyc->swap + cyc->swap_pos * cyc->period_size;
+		to = cyc->offset + cyc->swap_pos * cyc->period_size;
+		spin_unlock_bh(&xchan->sched_lock);
+
+		memcpy(xchan->xdev->addr + to, xchan->xdev->addr + from,
+		       cyc->period_size);
+
+		spin_lock_bh(&xchan->sched_lock);
+		cyc->swap_pos = (cyc->swap_pos + 1 == cyc->periods) ?
+		    0 : cyc->swap_pos + 1;
+		cyc->swap_pending--;
+		spin_unlock_bh(&xchan->sched_lock);
+	}
+}
+
+/* Called for every period that was played, in tasklet context. */
+static void xdma_cyclic_callback(void *param)
+{
+	struct xdma_chan *xchan = param;
+	struct xdma_client *client = NULL;
+	struct xdma_cycle *cyc;
+	u64 bytes = 0;
+	s32 cookie = 0;
+
+	spin_lock_bh(&xchan->sched_lock);
+	cyc = xchan->cyclic;
+	if (cyc) {
+		if (cyc->swap_left) {
+			if (cyc->swap_left == cyc->periods) {
+				cyc->swapped = cyc->played + cyc->periods;
+				cyc->swap_pos = cyc->pos;
+			}
+			cyc->swap_left--;
+			cyc->swap_pending++;
+			schedule_work(&cyc->swap_work);
+		}
+
+		cyc->pos = (cyc->pos + 1 == cyc->periods) ? 0 : cyc->pos + 1;
+		cyc->played++;
+		xchan->bytes += cyc->period_size;
+
+		client = cyc->client;
+		cookie = cyc->cookie;
+		bytes = cyc->period_size;
+		kref_get(&client->ref);
+	}
+	spin_unlock_bh(&xchan->sched_lock);
+
+	if (!client)
+		return;		// stopped in the meantime
+
+	spin_lock_bh(&client->lock);
+	if (client->ring)
+		xdma_ring_write(client->ring, cookie, 0, bytes);
+	spin_unlock_bh(&client->lock);
+
+	wake_up_interruptible(&xchan->cyclic_wait);
+	kref_put(&client->ref, xdma_client_release);
+}
+
+/* Start playing on a tx channel of the node, which must have nothing on
+ * the engine. The channel stays awake while it plays.
+ */
+static int xdma_start_cyclic(struct xdma_client *client,
+			     struct xdma_cyclic *info)
+{
+	struct xdma_device *xdev = client->xdev;
+	struct dma_async_tx_descriptor *chan_desc;
+	struct xdma_chan *xchan;
+	struct xdma_cycle *cyc;
+	dma_cookie_t cookie;
+	int ret;
+
+	xchan = xdma_lookup_slave(xdev, info->chan);
+	if (!xchan || (xchan != xdev->tx))
+		return -EINVAL;
+
+	if ((info->periods == 0) || (info->period_size == 0) ||
+	    (info->periods > DMA_LENGTH) || (info->offset > DMA_LENGTH) ||
+	    (info->period_size > DMA_LENGTH) ||
+	    ((u64) info->periods * info->period_size >
+	     DMA_LENGTH - info->offset) || info->flags)
+		return -EINVAL;
+
+	if (!dma_has_cap(DMA_CYCLIC, xchan->chan->device->cap_mask))
+		return -EOPNOTSUPP;
+
+	cyc = kzalloc(sizeof(struct xdma_cycle), GFP_KERNEL);
+	if (!cyc)
+		return -ENOMEM;
+
+	cyc->client = client;
+	cyc->xchan = xchan;
+	INIT_WORK(&cyc->swap_work, xdma_cyclic_swap_work);
+	cyc->periods = info->periods;
+	cyc->period_size = info->period_size;
+	cyc->offset = info->offset;
+
+	spin_lock_bh(&client->lock);
+	cyc->cookie = client->next_cookie;
+	client->next_cookie = (client->next_cookie == INT_MAX) ?
+	    1 : client->next_cookie + 1;
+	spin_unlock_bh(&client->lock);
+
+	xdma_pm_get(xchan);	// dropped when it stops
+
+	spin_lock_bh(&xchan->sched_lock);
+	if (xchan->cyclic || xchan->inflight || xchan->stopping) {
+		spin_unlock_bh(&xchan->sched_lock);
+		ret = -EBUSY;
+		goto err_put;
+	}
+	xchan->cyclic = cyc;
+	spin_unlock_bh(&xchan->sched_lock);
+
+	// make the table written through the mapping visible to the engine
+	wmb();
+
+	chan_desc = dmaengine_prep_dma_cyclic(xchan->chan,
+					      xdev->handle + info->offset,
+					      info->periods * info->period_size,
+					      info->period_size, DMA_MEM_TO_DEV,
+					      DMA_CTRL_ACK |
+					      DMA_PREP_INTERRUPT);
+	if (!chan_desc) {
+		printk(KERN_ERR "<%s> Error: preparing a descriptor failed\n",
+		       MODULE_NAME);
+		ret = -EBUSY;
+		goto err_release;
+	}
+
+	chan_desc->callback = xdma_cyclic_callback;
+	chan_desc->callback_param = xchan;
+
+	cookie = chan_desc->tx_submit(chan_desc);
+	if (dma_submit_error(cookie)) {
+		printk(KERN_ERR "<%s> Error: tx_submit error\n", MODULE_NAME);
+		ret = -EIO;
+		goto err_release;
+	}
+
+	dma_async_issue_pending(xchan->chan);
+
+	info->cookie = cyc->cookie;
+	return 0;
+
+ err_release:
+	spin_lock_bh(&xchan->sched_lock);
+	xchan->cyclic = NULL;
+	spin_unlock_bh(&xchan->sched_lock);
+	xdma_sched_kick(xchan);
+ err_put:
+	xdma_pm_put(xchan);
+	kfree(cyc);
+	return ret;
+}
+
+/* Stop playing, only the file that started it may. Transfers queued on the
+ * channel in the meantime are submitted after.
+ */
+static int xdma_stop_cyclic(struct xdma_client *client,
+			    struct xdma_chan *xchan)
+{
+	struct xdma_cycle *cyc;
+
+	spin_lock_bh(&xchan->sched_lock);
+	cyc = xchan->cyclic;
+	if (!cyc || (cyc->client != client)) {
+		spin_unlock_bh(&xchan->sched_lock);
+		return cyc ? -EPERM : -EINVAL;
+	}
+
+	// nothing may reach the engine until the descriptor is gone
+	xchan->cyclic = NULL;
+	xchan->stopping++;
+	spin_unlock_bh(&xchan->sched_lock);
+
+	xdma_stop_transfer(xchan->chan);
+
+	spin_lock_bh(&xchan->sched_lock);
+	xchan->stopping--;
+	spin_unlock_bh(&xchan->sched_lock);
+
+	// no callback schedules it any more
+	cancel_work_sync(&cyc->swap_work);
+
+	wake_up_interruptible(&xchan->cyclic_wait);
+	kfree(cyc);
+
+	xdma_sched_kick(xchan);
+	xdma_pm_put(xchan);
+
+	return 0;
+}
+
+static int xdma_swap_cyclic(struct xdma_client *client,
+			    struct xdma_cyclic_swap *info)
+{
+	struct xdma_chan *xchan;
+	struct xdma_cycle *cyc;
+	int ret = 0;
+
+	xchan = xdma_lookup_chan(client->xdev, info->chan);
+	if (!xchan || info->reserved || (info->offset > DMA_LENGTH))
+		return -EINVAL;
+
+	spin_lock_bh(&xchan->sched_lock);
+	cyc = xchan->cyclic;
+	if (!cyc || (cyc->periods < XDMA_CYCLIC_MIN_SWAP) ||
+	    ((u64) cyc->periods * cyc->period_size >
+	     DMA_LENGTH - info->offset)) {
+		ret = -EINVAL;
+	} else if (cyc->client != client) {
+		ret = -EPERM;
+	} else if (cyc->swap_left || cyc->swap_pending) {
+		ret = -EBUSY;	// the last swap is still being copied
+	} else {
+		cyc->swap = info->offset;
+		cyc->swap_left = cyc->periods;
+		cyc->swapped = 0;
+	}
+	spin_unlock_bh(&xchan->sched_lock);
+
+	return ret;
+}
+
+/* Fill in 'st', returns true once more than 'st->period' periods were
+ * played or the channel does not play.
+ */
+static bool xdma_cyclic_status(struct xdma_chan *xchan,
+			       struct xdma_cyclic_status *st, bool *playing)
+{
+	struct xdma_cycle *cyc;
+
+	spin_lock_bh(&xchan->sched_lock);
+	cyc = xchan->cyclic;
+	*playing = (cyc != NULL);
+	if (cyc) {
+		st->played = cyc->played;
+		st->swapped = cyc->swapped;
+	}
+	spin_unlock_bh(&xchan->sched_lock);
+
+	return !*playing || (st->played > st->period);
+}
+
+static int xdma_wait_cyclic(struct xdma_client *client,
+			    struct xdma_cyclic_status *st)
+{
+	struct xdma_chan *xchan;
+	bool playing;
+	long ret;
+
+	xchan = xdma_lookup_chan(client->xdev, st->chan);
+	if (!xchan)
+		return -EINVAL;
+
+	st->played = 0;
+	st->swapped = 0;
+
+	ret = wait_event_interruptible_timeout(xchan->cyclic_wait,
+					       xdma_cyclic_status(xchan, st,
+								  &playing),
+					       msecs_to_jiffies(st->timeout_ms));
+	if (ret < 0)
+		return ret;
+
+	if (!playing)
+		return -EINVAL;	// not started, or stopped while waiting
+
+	return ret ? 0 : -ETIMEDOUT;
+}
+
+/* dma-buf exporter
+ *
+ * A page aligned region of the DMA memory of a device can be handed to other
+ * drivers (V4L2, DRM, ...) as a dma-buf. The memory itself stays with the
+ * device, an exported buffer only pins the module.
+ */
+struct xdma_export_buf {
+	struct xdma_device *xdev;
+	size_t offset;
+	size_t size;
+};
+
+static struct sg_table *xdma_dmabuf_map(struct dma_buf_attachment *attach,
+					enum dma_data_direction dir)
+{
+	struct xdma_export_buf *exp = attach->dmabuf->priv;
+	struct xdma_device *xdev = exp->xdev;
+	struct sg_table *sgt;
+	int ret;
+
+	sgt = kzalloc(sizeof(struct sg_table), GFP_KERNEL);
+	if (!sgt)
+		return ERR_PTR(-ENOMEM);
+
+	ret = dma_get_sgtable(xdma_dma_dev(xdev), sgt, xdev->addr + exp->offset,
+			      xdev->handle + exp->offset, exp->size);
+	if (ret < 0)
+		goto err_free;
+
+	// map for the importer, it may sit behind another bus or IOMMU
+	if (!dma_map_sg(attach->dev, sgt->sgl, sgt->orig_nents, dir)) {
+		ret = -EIO;
+		goto err_table;
+	}
+	sgt->nents = sgt->orig_nents;
+
+	return sgt;
+
+ err_table:
+	sg_free_table(sgt);
+ err_free:
+	kfree(sgt);
+	return ERR_PTR(ret);
+}
+
+static void xdma_dmabuf_unmap(struct dma_buf_attachment *attach,
+			      struct sg_table *sgt, enum dma_data_direction dir)
+{
+	dma_unmap_sg(attach->dev, sgt->sgl, sgt->orig_nents, dir);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+static void xdma_dmabuf_release(struct dma_buf *dmabuf)
+{
+	kfree(dmabuf->priv);
+	module_put(THIS_MODULE);
+}
+
+static void *xdma_dmabuf_kmap(struct dma_buf *dmabuf, unsigned long page)
+{
+	struct xdma_export_buf *exp = dmabuf->priv;
+
+	return exp->xdev->addr + exp->offset + (page << PAGE_SHIFT);
+}
+
+static void xdma_dmabuf_kunmap(struct dma_buf *dmabuf, unsigned long page,
+			       void *vaddr)
+{
+}
+
+static void *xdma_dmabuf_vmap(struct dma_buf *dmabuf)
+{
+	struct xdma_export_buf *exp = dmabuf->priv;
+
+	return exp->xdev->addr + exp->offset;
+}
+
+static int xdma_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+	struct xdma_export_buf *exp = dmabuf->priv;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
+
+	if ((offset >= exp->size) || (size > exp->size - offset))
+		return -EINVAL;
+
+	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+
+	return remap_pfn_range(vma, vma->vm_start,
+			       virt_to_pfn(exp->xdev->addr + exp->offset +
+					   offset), size, vma->vm_page_prot);
+}
+
+static const struct dma_buf_ops xdma_dmabuf_ops = {
+	.map_dma_buf = xdma_dmabuf_map,
+	.unmap_dma_buf = xdma_dmabuf_unmap,
+	.release = xdma_dmabuf_release,
+	.kmap_atomic = xdma_dmabuf_kmap,
+	.kunmap_atomic = xdma_dmabuf_kunmap,
+	.kmap = xdma_dmabuf_kmap,
+	.kunmap = xdma_dmabuf_kunmap,
+	.mmap = xdma_dmabuf_mmap,
+	.vmap = xdma_dmabuf_vmap,
+};
+
+static int xdma_export(struct xdma_client *client, struct xdma_export *info)
+{
+	struct xdma_export_buf *exp;
+	struct dma_buf *dmabuf;
+	int fd;
+
+	if ((info->offset & ~PAGE_MASK) || (info->size & ~PAGE_MASK) ||
+	    (info->size == 0) || (info->offset >= DMA_LENGTH) ||
+	    (info->size > DMA_LENGTH - info->offset) ||
+	    (info->flags & ~XDMA_EXPORT_CLOEXEC))
+		return -EINVAL;
+
+	exp = kzalloc(sizeof(struct xdma_export_buf), GFP_KERNEL);
+	if (!exp)
+		return -ENOMEM;
+
+	exp->xdev = client->xdev;
+	exp->offset = info->offset;
+	exp->size = info->size;
+
+	if (!try_module_get(THIS_MODULE)) {
+		kfree(exp);
+		return -ENODEV;
+	}
+
+	dmabuf = dma_buf_export(exp, &xdma_dmabuf_ops, exp->size, O_RDWR);
+	if (IS_ERR(dmabuf)) {
+		module_put(THIS_MODULE);
+		kfree(exp);
+		return PTR_ERR(dmabuf);
+	}
+
+	fd = dma_buf_fd(dmabuf, (info->flags & XDMA_EXPORT_CLOEXEC) ?
+			O_CLOEXEC : 0);
+	if (fd < 0) {
+		dma_buf_put(dmabuf);	// releases 'exp' and the module
+		return fd;
+	}
+
+	info->fd = fd;
+
+	return 0;
+}
+
+/* Prepare a transfer from or into a dma-buf of another driver, for example
+ * a V4L2 capture buffer or a DRM framebuffer. The buffer stays attached to
+ * the engine until the transfer is released.
+ */
+static int xdma_prep_dmabuf(struct xdma_client *client,
+			    struct xdma_dmabuf_info *info)
+{
+	struct xdma_device *xdev = client->xdev;
+	enum dma_transfer_direction dir;
+	struct dma_buf_attachment *attach;
+	struct xdma_chan *xchan;
+	struct xdma_xfer *xfer;
+	struct dma_buf *dmabuf;
+	struct scatterlist *sgl;
+	struct scatterlist *sg;
+	struct sg_table *sgt;
+	size_t skip, left, len;
+	unsigned int nents;
+	int ret, i;
+
+	xchan = xdma_lookup_slave(xdev, info->chan);
+	if (!xchan || (info->flags & ~XDMA_BUF_RETRY))
+		return -EINVAL;
+
+	dir = xdma_chan_direction(xchan);
+
+	dmabuf = dma_buf_get(info->fd);
+	if (IS_ERR(dmabuf))
+		return PTR_ERR(dmabuf);
+
+	if (info->size == 0 && info->offset < dmabuf->size)
+		info->size = dmabuf->size - info->offset;
+
+	if ((info->offset >= dmabuf->size) || (info->size == 0) ||
+	    (info->size > dmabuf->size - info->offset)) {
+		ret = -EINVAL;
+		goto err_put;
+	}
+
+	attach = dma_buf_attach(dmabuf, xdma_dma_dev(xdev));
+	if (IS_ERR(attach)) {
+		ret = PTR_ERR(attach);
+		goto err_put;
+	}
+
+	sgt = dma_buf_map_attachment(attach, xdma_to_data_direction(dir));
+	if (IS_ERR_OR_NULL(sgt)) {
+		ret = sgt ? PTR_ERR(sgt) : -ENOMEM;
+		goto err_detach;
+	}
+
+	// count the mapped segments that cover the requested range
+	nents = 0;
+	skip = info->offset;
+	left = info->size;
+	for_each_sg(sgt->sgl, sg, sgt->nents, i) {
+		if (skip >= sg_dma_len(sg)) {
+			skip -= sg_dma_len(sg);
+			continue;
+		}
+		len = min_t(size_t, sg_dma_len(sg) - skip, left);
+		left -= len;
+		skip = 0;
+		nents++;
+		if (!left)
+			break;
+	}
+
+	if (left) {
+		ret = -EINVAL;
+		goto err_unmap;
+	}
+
+	sgl = kcalloc(nents, sizeof(struct scatterlist), GFP_KERNEL);
+	if (!sgl) {
+		ret = -ENOMEM;
+		goto err_unmap;
+	}
+
+	sg_init_table(sgl, nents);
+	nents = 0;
+	skip = info->offset;
+	left = info->size;
+	for_each_sg(sgt->sgl, sg, sgt->nents, i) {
+		if (skip >= sg_dma_len(sg)) {
+			skip -= sg_dma_len(sg);
+			continue;
+		}
+		len = min_t(size_t, sg_dma_len(sg) - skip, left);
+		sg_dma_address(&sgl[nents]) = sg_dma_address(sg) + skip;
+		sg_dma_len(&sgl[nents]) = len;
+		left -= len;
+		skip = 0;
+		nents++;
+		if (!left)
+			break;
+	}
+
+	xfer = xdma_xfer_alloc(client, xchan, dir);
+	if (!xfer) {
+		kfree(sgl);
+		ret = -ENOMEM;
+		goto err_unmap;
+	}
+
+	xfer->attach = attach;
+	xfer->sgt = sgt;
+	xfer->own_sgl = sgl;
+	xfer->sgl = sgl;
+	xfer->nents = nents;
+	xfer->len = info->size;
+	xfer->record = true;
+	if (info->flags & XDMA_BUF_RETRY) {
+		xfer->retry = true;
+		xfer->retries = XDMA_SCHED_RETRIES;
+	}
+
+	spin_lock_bh(&client->lock);
+	if (!xdma_client_space(client, xchan, 1)) {
+		spin_unlock_bh(&client->lock);
+		xdma_xfer_put(xfer);	// also drops the dma-buf, if any
+		return -EAGAIN;
+	}
+	xdma_client_add(client, xfer);
+	info->cookie = xfer->cookie;
+	spin_unlock_bh(&client->lock);
+
+	return 0;
+
+ err_unmap:
+	dma_buf_unmap_attachment(attach, sgt, xdma_to_data_direction(dir));
+ err_detach:
+	dma_buf_detach(dmabuf, attach);
+ err_put:
+	dma_buf_put(dmabuf);
+	return ret;
+}
+
+/* Stages of 'chain' on the channel of stage 'n'. */
+static unsigned int xdma_chain_uses(struct xdma_chain *chain, u32 n)
+{
+	unsigned int uses = 0;
+	u32 i;
+
+	for (i = 0; i < chain->num_stages; i++)
+		if (chain->stages[i].chan == chain->stages[n].chan)
+			uses++;
+
+	return uses;
+}
+
+/* Prepare and start a chain of transfers across the engines of any devices.
+ * A stage with 'after' set is queued from the completion callback of that
+ * earlier stage, so data moves from engine to engine without a round trip
+ * through userspace. With XDMA_CHAIN_WAIT the call waits for every stage,
+ * as a stage may end before userspace could wait for its cookie.
+ */
+static int xdma_prep_chain(struct xdma_client *client, struct xdma_chain *chain)
+{
+	struct xdma_xfer *xfers[XDMA_MAX_STAGES];
+	struct xdma_stage *stage;
+	struct xdma_device *mem;
+	struct xdma_chan *xchan;
+	unsigned long kick = 0;
+	const bool wait = chain->flags & XDMA_CHAIN_WAIT;
+	u32 i;
+	int status;
+	int ret;
+
+	if ((chain->num_stages == 0) || (chain->num_stages > XDMA_MAX_STAGES) ||
+	    (chain->flags & ~XDMA_CHAIN_WAIT))
+		return -EINVAL;
+
+	for (i = 0; i < chain->num_stages; i++) {
+		stage = &chain->stages[i];
+		xchan = xdma_get_chan(stage->chan);
+
+		if (!xchan || !xchan->slave ||
+		    (stage->mem_device >= num_devices) ||
+		    (stage->after < -1) || (stage->after >= (s32) i) ||
+		    (stage->buf_offset > DMA_LENGTH) ||
+		    (stage->buf_size == 0) ||
+		    (stage->buf_size > DMA_LENGTH - stage->buf_offset))
+			return -EINVAL;
+
+		// the buffer may be in the memory of a node nobody opened yet
+		ret = xdma_alloc_memory(xdma_devices[stage->mem_device]);
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; i < chain->num_stages; i++) {
+		stage = &chain->stages[i];
+		xchan = &xdma_chans[stage->chan];
+		mem = xdma_devices[stage->mem_device];
+
+		xfers[i] = xdma_xfer_alloc(client, xchan,
+					   xdma_chan_direction(xchan));
+		if (!xfers[i]) {
+			while (i--)
+				xdma_xfer_put(xfers[i]);
+			return -ENOMEM;
+		}
+
+		sg_init_table(&xfers[i]->sg, 1);
+		sg_dma_address(&xfers[i]->sg) = mem->handle + stage->buf_offset;
+		sg_dma_len(&xfers[i]->sg) = stage->buf_size;
+		xfers[i]->sgl = &xfers[i]->sg;
+		xfers[i]->nents = 1;
+		xfers[i]->len = stage->buf_size;
+		xfers[i]->record = true;
+	}
+
+	// no stage can end, and advance the chain, before all are linked
+	spin_lock_bh(&client->lock);
+	for (i = 0; i < chain->num_stages; i++) {
+		if (!xdma_client_space(client, xfers[i]->xchan,
+				       xdma_chain_uses(chain, i))) {
+			spin_unlock_bh(&client->lock);
+			for (i = 0; i < chain->num_stages; i++)
+				xdma_xfer_put(xfers[i]);
+			return -EAGAIN;
+		}
+	}
+
+	for (i = 0; i < chain->num_stages; i++) {
+		stage = &chain->stages[i];
+
+		xdma_client_add(client, xfers[i]);
+		stage->cookie = xfers[i]->cookie;
+		if (wait)
+			kref_get(&xfers[i]->ref);	// ours while waiting
+
+		if (stage->after >= 0) {
+			xfers[i]->chained = true;
+			list_add_tail(&xfers[i]->cnode,
+				      &xfers[stage->after]->chain);
+		}
+	}
+
+	for (i = 0; i < chain->num_stages; i++) {
+		xdma_xfer_start(xfers[i]);
+		if (!xfers[i]->chained)
+			kick |= 1UL << xdma_chan_handle(xfers[i]->xchan);
+	}
+	spin_unlock_bh(&client->lock);
+
+	xdma_sched_kick_mask(kick);
+
+	if (!wait)
+		return 0;
+
+	// a failed stage ends the stages after it with -EPIPE
+	ret = 0;
+	for (i = 0; i < chain->num_stages; i++) {
+		status = xdma_xfer_wait(xfers[i], false);
+		if (!ret)
+			ret = status;
+		xdma_xfer_put(xfers[i]);
+	}
+
+	return ret;
+}
+
+/* Start all transfers prepared on the channel up to 'cookie', as
+ * dma_async_issue_pending() issues all submitted descriptors, and wait for
+ * the one of 'cookie' if asked to.
+ */
+static int xdma_start_transfer(struct xdma_client *client,
+			       struct xdma_transfer *trans)
+{
+	struct xdma_chan *xchan;
+	struct xdma_xfer *xfer;
+	struct xdma_xfer *wait_xfer = NULL;
+	bool ended;
+	int ret;
+
+	// chains put transfers of the file on other devices too
+	xchan = xdma_get_chan(trans->chan);
+	if (!xchan)
+		return -EINVAL;
+
+	spin_lock_bh(&client->lock);
+	list_for_each_entry(xfer, &client->xfers, node) {
+		if ((xfer->xchan != xchan) || (xfer->cookie > trans->cookie))
+			continue;
+
+		if (!xfer->started)
+			xdma_xfer_start(xfer);
+
+		if (trans->wait && (xfer->cookie == trans->cookie)) {
+			kref_get(&xfer->ref);
+			wait_xfer = xfer;
+		}
+	}
+	ended = (trans->cookie > 0) && (trans->cookie < client->next_cookie);
+	spin_unlock_bh(&client->lock);
+
+	xdma_sched_kick(xchan);
+
+	if (!trans->wait)
+		return 0;
+
+	// transfers leave the client list once they ended
+	if (!wait_xfer)
+		return ended ? 0 : -EINVAL;
+
+	ret = xdma_xfer_wait(wait_xfer, false);
+	trans->bytes = wait_xfer->done;
+	xdma_xfer_put(wait_xfer);
+
+	return ret;
+}
+
+/* Stream interface
+ *
+ * read() and write() (and readv()/writev() through aio_read/aio_write) DMA
+ * directly to and from the callers pages: the user buffer is pinned and
+ * handed to the engine as a scatter-gather list. The splice operations do
+ * the same with the pages of a pipe, so data can move between the FPGA and
+ * files or sockets without a copy.
+ */
+static struct xdma_chan *xdma_stream_chan(struct xdma_client *client,
+					  enum dma_transfer_direction dir)
+{
+	struct xdma_device *xdev = client->xdev;
+	struct xdma_chan *xchan = (dir == DMA_MEM_TO_DEV) ? xdev->tx : xdev->rx;
+
+	return (xchan && xchan->slave) ? xchan : NULL;
+}
+
+/* Run a DMA mapped scatter-gather list through the scheduler as one
+ * transfer of 'client' and wait for it. If 'actual' is given it is set to
+ * the bytes that landed, less than the list holds if a packet ended early.
+ */
+static int xdma_sg_transfer(struct xdma_client *client,
+			    struct xdma_chan *xchan, struct scatterlist *sgl,
+			    unsigned int nents, enum dma_transfer_direction dir,
+			    size_t *actual)
+{
+	struct xdma_xfer *xfer;
+	struct scatterlist *sg;
+	int ret;
+	int i;
+
+	xfer = xdma_xfer_alloc(client, xchan, dir);
+	if (!xfer)
+		return -ENOMEM;
+
+	xfer->sgl = sgl;
+	xfer->nents = nents;
+	for_each_sg(sgl, sg, nents, i)
+	    xfer->len += sg_dma_len(sg);
+
+	kref_get(&xfer->ref);	// ours while waiting
+
+	spin_lock_bh(&client->lock);
+	xdma_client_add(client, xfer);
+	xdma_xfer_start(xfer);
+	spin_unlock_bh(&client->lock);
+
+	xdma_sched_kick(xchan);
+
+	ret = xdma_xfer_wait(xfer, true);
+	if (actual)
+		*actual = xfer->done;
+	xdma_xfer_put(xfer);
+
+	return ret;
+}
+
+/* Map 'sgl' for the engine, transfer it and unmap it again. */
+static int xdma_sg_map_transfer(struct xdma_client *client,
+				struct xdma_chan *xchan,
+				struct scatterlist *sgl, unsigned int nents,
+				enum dma_transfer_direction dir, size_t *actual)
+{
+	struct device *dev = xchan->chan->device->dev;
+	enum dma_data_direction data_dir = xdma_to_data_direction(dir);
+	int mapped;
+	int ret;
+
+	mapped = dma_map_sg(dev, sgl, nents, data_dir);
+	if (!mapped)
+		return -ENOMEM;
+
+	ret = xdma_sg_transfer(client, xchan, sgl, mapped, dir, actual);
+
+	dma_unmap_sg(dev, sgl, nents, data_dir);
+
+	return ret;
+}
+
+static void xdma_put_pages(struct page **pages, int npages, bool dirty)
+{
+	int i;
+
+	for (i = 0; i < npages; i++) {
+		if (dirty)
+			set_page_dirty_lock(pages[i]);
+		put_page(pages[i]);
+	}
+}
+
+/* DMA between the channel and the user memory described by 'iov'.
+ *
+ * The user pages are pinned and transferred in chunks of up to
+ * XDMA_STREAM_PAGES pages, one transfer per chunk, so a readv()/writev() of
+ * many small segments still results in a single hardware operation. That
+ * is one descriptor and packet, unless the client set a 'max_chunk' and a
+ * MEM_TO_DEV chunk is split at it or at XDMA_SLOT_SEGS pages.
+ * Returns the number of bytes transferred or a negative error if nothing was.
+ */
+static ssize_t xdma_user_transfer(struct xdma_client *client,
+				  struct xdma_chan *xchan,
+				  const struct iovec *iov,
+				  unsigned long nr_segs,
+				  enum dma_transfer_direction dir)
+{
+	const bool to_user = (dir == DMA_DEV_TO_MEM);
+	struct page **pages;
+	struct scatterlist *sgl;
+	unsigned long seg = 0;
+	size_t seg_off = 0;
+	ssize_t done = 0;
+	size_t actual = 0;
+	int ret = 0;
+
+	pages = kmalloc(XDMA_STREAM_PAGES * sizeof(*pages), GFP_KERNEL);
+	sgl = kmalloc(XDMA_STREAM_PAGES * sizeof(*sgl), GFP_KERNEL);
+	if (!pages || !sgl) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	while (seg < nr_segs) {
+		unsigned int npages = 0;
+		size_t len = 0;
+
+		sg_init_table(sgl, XDMA_STREAM_PAGES);
+
+		// gather pages of consecutive segments until the chunk is full
+		while ((seg < nr_segs) && (npages < XDMA_STREAM_PAGES)) {
+			unsigned long uaddr;
+			unsigned int pg_off;
+			size_t left;
+			int n, got, i;
+
+			uaddr = (unsigned long)iov[seg].iov_base + seg_off;
+			left = iov[seg].iov_len - seg_off;
+			if (left == 0) {
+				seg++;
+				seg_off = 0;
+				continue;
+			}
+
+			pg_off = offset_in_page(uaddr);
+			n = min_t(size_t, DIV_ROUND_UP(pg_off + left, PAGE_SIZE),
+				  XDMA_STREAM_PAGES - npages);
+			left = min_t(size_t, left, n * PAGE_SIZE - pg_off);
+
+			got = get_user_pages_fast(uaddr & PAGE_MASK, n,
+						  to_user, &pages[npages]);
+			if (got < n) {
+				if (got > 0)
+					xdma_put_pages(&pages[npages], got,
+						       false);
+				ret = -EFAULT;
+				break;
+			}
+
+			for (i = 0; i < n; i++) {
+				unsigned int pg_len;
+
+				pg_len = min_t(size_t, left, PAGE_SIZE - pg_off);
+				sg_set_page(&sgl[npages + i], pages[npages + i],
+					    pg_len, pg_off);
+
+				len += pg_len;
+				seg_off += pg_len;
+				left -= pg_len;
+				pg_off = 0;
+			}
+			npages += n;
+		}
+
+		if (npages) {
+			sg_mark_end(&sgl[npages - 1]);
+			if (!ret)
+				ret = xdma_sg_map_transfer(client, xchan, sgl,
+							   npages, dir, &actual);
+			xdma_put_pages(pages, npages, to_user && !ret);
+		}
+
+		if (ret)
+			break;
+
+		// a packet from the FPGA that ended early ends the read
+		done += actual;
+		if (actual < len)
+			break;
+	}
+
+ out:
+	kfree(sgl);
+	kfree(pages);
+
+	return done ? done : ret;
+}
+
+static ssize_t xdma_aio_read(struct kiocb *iocb, const struct iovec *iov,
+			     unsigned long nr_segs, loff_t pos)
+{
+	struct xdma_client *client = iocb->ki_filp->private_data;
+	struct xdma_chan *xchan = xdma_stream_chan(client, DMA_DEV_TO_MEM);
+	ssize_t ret;
+
+	xdma_dbg("file: read()\n");
+
+	if (!xchan)
+		return -ENODEV;
+
+	if (mutex_lock_interruptible(&xchan->lock))
+		return -ERESTARTSYS;
+
+	ret = xdma_user_transfer(client, xchan, iov, nr_segs, DMA_DEV_TO_MEM);
+
+	mutex_unlock(&xchan->lock);
+
+	return ret;
+}
+
+static ssize_t xdma_aio_write(struct kiocb *iocb, const struct iovec *iov,
+			      unsigned long nr_segs, loff_t pos)
+{
+	struct xdma_client *client = iocb->ki_filp->private_data;
+	struct xdma_chan *xchan = xdma_stream_chan(client, DMA_MEM_TO_DEV);
+	ssize_t ret;
+
+	xdma_dbg("file: write()\n");
+
+	if (!xchan)
+		return -ENODEV;
+
+	if (mutex_lock_interruptible(&xchan->lock))
+		return -ERESTARTSYS;
+
+	ret = xdma_user_transfer(client, xchan, iov, nr_segs, DMA_MEM_TO_DEV);
+
+	mutex_unlock(&xchan->lock);
+
+	return ret;
+}
+
+struct xdma_splice {
+	struct scatterlist sgl[PIPE_DEF_BUFFERS];
+	unsigned int nents;
+};
+
+/* splice actor: take a reference on the pipe buffer page and add it to the
+ * scatter-gather list, the pipe buffer itself is consumed as usual.
+ */
+static int xdma_pipe_to_sg(struct pipe_inode_info *pipe,
+			   struct pipe_buffer *buf, struct splice_desc *sd)
+{
+	struct xdma_splice *xs = sd->u.data;
+	int ret;
+
+	if (xs->nents == PIPE_DEF_BUFFERS)
+		return 0;
+
+	ret = buf->ops->confirm(pipe, buf);
+	if (ret)
+		return ret;
+
+	get_page(buf->page);
+	sg_set_page(&xs->sgl[xs->nents++], buf->page, sd->len, buf->offset);
+
+	return sd->len;
+}
+
+static ssize_t xdma_splice_write(struct pipe_inode_info *pipe,
+				 struct file *out, loff_t * ppos, size_t len,
+				 unsigned int flags)
+{
+	struct xdma_client *client = out->private_data;
+	struct xdma_chan *xchan = xdma_stream_chan(client, DMA_MEM_TO_DEV);
+	struct xdma_splice xs;
+	struct splice_desc sd = {
+		.total_len = len,
+		.flags = flags,
+		.pos = *ppos,
+		.u.data = &xs,
+	};
+	ssize_t ret;
+	int err;
+	int i;
+
+	xdma_dbg("file: splice_write()\n");
+
+	if (!xchan)
+		return -ENODEV;
+
+	sg_init_table(xs.sgl, PIPE_DEF_BUFFERS);
+	xs.nents = 0;
+
+	mutex_lock(&xchan->lock);
+
+	pipe_lock(pipe);
+	ret = __splice_from_pipe(pipe, &sd, xdma_pipe_to_sg);
+	pipe_unlock(pipe);
+
+	if (xs.nents) {
+		sg_mark_end(&xs.sgl[xs.nents - 1]);
+		err = xdma_sg_map_transfer(client, xchan, xs.sgl, xs.nents,
+					   DMA_MEM_TO_DEV, NULL);
+		if (err)
+			ret = err;
+
+		for (i = 0; i < xs.nents; i++)
+			put_page(sg_page(&xs.sgl[i]));
+	}
+
+	mutex_unlock(&xchan->lock);
+
+	return ret;
+}
+
+static const struct pipe_buf_operations xdma_pipe_buf_ops = {
+	.can_merge = 0,
+	.confirm = generic_pipe_buf_confirm,
+	.release = generic_pipe_buf_release,
+	.steal = generic_pipe_buf_steal,
+	.get = generic_pipe_buf_get,
+};
+
+static void xdma_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+	put_page(spd->pages[i]);
+}
+
+static ssize_t xdma_splice_read(struct file *in, loff_t * ppos,
+				struct pipe_inode_info *pipe, size_t len,
+				unsigned int flags)
+{
+	struct xdma_client *client = in->private_data;
+	struct xdma_chan *xchan = xdma_stream_chan(client, DMA_DEV_TO_MEM);
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct scatterlist sgl[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages = pages,
+		.partial = partial,
+		.nr_pages = 0,
+		.nr_pages_max = PIPE_DEF_BUFFERS,
+		.flags = flags,
+		.ops = &xdma_pipe_buf_ops,
+		.spd_release = xdma_spd_release,
+	};
+	size_t actual = 0;
+	unsigned int i;
+	ssize_t ret;
+
+	xdma_dbg("file: splice_read()\n");
+
+	if (!xchan)
+		return -ENODEV;
+
+	sg_init_table(sgl, PIPE_DEF_BUFFERS);
+
+	// DMA into freshly allocated pages which are then moved into the pipe
+	while ((len > 0) && (spd.nr_pages < PIPE_DEF_BUFFERS)) {
+		struct page *page = alloc_page(GFP_KERNEL);
 
-		// set the prepared descriptor to be executed by the engine
-		cookie = chan_desc->tx_submit(chan_desc);
-		if (dma_submit_error(cookie)) {
-			printk(KERN_ERR "<%s> Error: tx_submit error\n",
-			       MODULE_NAME);
-			ret = -1;
-		}
+		if (!page)
+			break;
+
+		pages[spd.nr_pages] = page;
+		partial[spd.nr_pages].offset = 0;
+		partial[spd.nr_pages].len = min_t(size_t, len, PAGE_SIZE);
+		sg_set_page(&sgl[spd.nr_pages], page,
+			    partial[spd.nr_pages].len, 0);
 
-		buf_info->cookie = cookie;
+		len -= partial[spd.nr_pages].len;
+		spd.nr_pages++;
 	}
 
-	return ret;
-}
+	if (spd.nr_pages == 0)
+		return -ENOMEM;
 
-static int xdma_start_transfer(struct xdma_transfer *trans)
-{
-	int ret = 0;
-	unsigned long tmo = msecs_to_jiffies(3000);
-	enum dma_status status;
-	struct dma_chan *chan;
-	struct completion *cmp;
-	dma_cookie_t cookie;
+	sg_mark_end(&sgl[spd.nr_pages - 1]);
 
-	chan = (struct dma_chan *)trans->chan;
-	cmp = (struct completion *)trans->completion;
-	cookie = trans->cookie;
+	mutex_lock(&xchan->lock);
+	ret = xdma_sg_map_transfer(client, xchan, sgl, spd.nr_pages,
+				   DMA_DEV_TO_MEM, &actual);
+	mutex_unlock(&xchan->lock);
 
-	init_completion(cmp);
-	dma_async_issue_pending(chan);
+	if (ret) {
+		xdma_put_pages(pages, spd.nr_pages, false);
+		return ret;
+	}
 
-	if (trans->wait) {
-		tmo = wait_for_completion_timeout(cmp, tmo);
-		status = dma_async_is_tx_complete(chan, cookie, NULL, NULL);
-		if (0 == tmo) {
-			printk(KERN_ERR "<%s> Error: transfer timed out\n",
-			       MODULE_NAME);
-			ret = -1;
-		} else if (status != DMA_COMPLETE) {
-			printk(KERN_DEBUG
-			       "<%s> transfer: returned completion callback status of: \'%s\'\n",
-			       MODULE_NAME,
-			       status == DMA_ERROR ? "error" : "in progress");
-			ret = -1;
-		}
+	// a packet that ended early leaves pages the engine never wrote
+	for (i = 0; i < spd.nr_pages; i++) {
+		partial[i].len = min_t(size_t, actual, partial[i].len);
+		actual -= partial[i].len;
+		if (partial[i].len == 0)
+			break;
 	}
-	return ret;
-}
+	xdma_put_pages(&pages[i], spd.nr_pages - i, false);
+	spd.nr_pages = i;
 
-static void xdma_stop_transfer(struct dma_chan *chan)
-{
-	struct dma_device *chan_dev;
+	if (spd.nr_pages == 0)
+		return 0;
 
-	if (chan) {
-		chan_dev = chan->device;
-		chan_dev->device_control(chan, DMA_TERMINATE_ALL,
-					 (unsigned long)NULL);
-	}
+	return splice_to_pipe(pipe, &spd);
 }
 
-static void xdma_test_transfer(void)
+static void xdma_test_transfer(struct xdma_client *client)
 {
+	struct xdma_device *xdev = client->xdev;
 	const int LENGTH = 1048576;	// max image is 1024x1024 for now!
 
 	int i;
@@ -263,56 +3275,64 @@ static void xdma_test_transfer(void)
 
 	struct timeval ti, tf;
 
-	memset(xdma_addr, 'Y', LENGTH);	// fill rx with a value
-	xdma_addr[LENGTH - 1] = '\n';
-	memset(xdma_addr + LENGTH, 'Z', LENGTH);	// fill tx with a value
-	xdma_addr[LENGTH + LENGTH - 1] = '\n';
+	if (!xdev->tx || !xdev->rx || !xdev->tx->slave || !xdev->rx->slave) {
+		printk(KERN_ERR "<%s> Error: test needs a tx and rx channel\n",
+		       MODULE_NAME);
+		return;
+	}
+
+	memset(xdev->addr, 'Y', LENGTH);	// fill rx with a value
+	xdev->addr[LENGTH - 1] = '\n';
+	memset(xdev->addr + LENGTH, 'Z', LENGTH);	// fill tx with a value
+	xdev->addr[LENGTH + LENGTH - 1] = '\n';
 
 	// display contents before transfer:
 	printk(KERN_DEBUG "<%s> test: rx buffer before transmit:\n",
 	       MODULE_NAME);
 	for (i = 0; i < 10; i++) {
-		printk("%c\t", xdma_addr[i]);
+		printk("%c\t", xdev->addr[i]);
 	}
 	printk("\n");
 
 	// measure time:
 	do_gettimeofday(&ti);
 
-	rx_config.chan = xdma_dev_info[0]->rx_chan;
+	rx_config.chan = xdma_chan_handle(xdev->rx);
+	rx_config.dir = XDMA_DEV_TO_MEM;
 	rx_config.coalesc = 1;
 	rx_config.delay = 0;
-	xdma_device_control(&rx_config);
+	rx_config.reset = 0;
+	xdma_device_control(xdev, &rx_config);
 
-	tx_config.chan = xdma_dev_info[0]->tx_chan;
+	tx_config.chan = xdma_chan_handle(xdev->tx);
+	tx_config.dir = XDMA_MEM_TO_DEV;
 	tx_config.coalesc = 1;
 	tx_config.delay = 0;
-	xdma_device_control(&tx_config);
+	tx_config.reset = 0;
+	xdma_device_control(xdev, &tx_config);
 
-	rx_buf.chan = xdma_dev_info[0]->rx_chan;
-	rx_buf.buf_offset = (u32) 0;
-	rx_buf.buf_size = (u32) LENGTH;
+	rx_buf.chan = xdma_chan_handle(xdev->rx);
+	rx_buf.buf_offset = 0;
+	rx_buf.buf_size = LENGTH;
 	rx_buf.dir = XDMA_DEV_TO_MEM;
-	rx_buf.completion = (u32) xdma_dev_info[0]->rx_cmp;
-	xdma_prep_buffer(&rx_buf);
+	rx_buf.flags = 0;
+	xdma_prep_buffer(client, &rx_buf);
 
-	tx_buf.chan = xdma_dev_info[0]->tx_chan;
-	tx_buf.buf_offset = (u32) LENGTH;
-	tx_buf.buf_size = (u32) LENGTH;
+	tx_buf.chan = xdma_chan_handle(xdev->tx);
+	tx_buf.buf_offset = LENGTH;
+	tx_buf.buf_size = LENGTH;
 	tx_buf.dir = XDMA_MEM_TO_DEV;
-	tx_buf.completion = (u32) xdma_dev_info[0]->tx_cmp;
-	xdma_prep_buffer(&tx_buf);
+	tx_buf.flags = 0;
+	xdma_prep_buffer(client, &tx_buf);
 
 	printk(KERN_DEBUG "<%s> test: xdma_start_transfer rx\n", MODULE_NAME);
-	rx_trans.chan = xdma_dev_info[0]->rx_chan;
+	rx_trans.chan = xdma_chan_handle(xdev->rx);
 	rx_trans.wait = 0;
-	rx_trans.completion = (u32) xdma_dev_info[0]->rx_cmp;
 	rx_trans.cookie = rx_buf.cookie;
 
 	printk(KERN_DEBUG "<%s> test: xdma_start_transfer tx\n", MODULE_NAME);
-	tx_trans.chan = xdma_dev_info[0]->tx_chan;
+	tx_trans.chan = xdma_chan_handle(xdev->tx);
 	tx_trans.wait = 1;
-	tx_trans.completion = (u32) xdma_dev_info[0]->tx_cmp;
 	tx_trans.cookie = tx_buf.cookie;
 
 	// measure time to prepare channels:
@@ -322,8 +3342,8 @@ static void xdma_test_transfer(void)
 	do_gettimeofday(&ti);	// to read transfer time only
 
 	// start transfer:
-	xdma_start_transfer(&rx_trans);
-	xdma_start_transfer(&tx_trans);
+	xdma_start_transfer(client, &rx_trans);
+	xdma_start_transfer(client, &tx_trans);
 
 	// measure time:
 	do_gettimeofday(&tf);
@@ -338,7 +3358,7 @@ static void xdma_test_transfer(void)
 	printk(KERN_DEBUG "<%s> test: rx buffer after transmit:\n",
 	       MODULE_NAME);
 	for (i = 0; i < 10; i++) {
-		printk("%c\t", xdma_addr[i]);
+		printk("%c\t", xdev->addr[i]);
 	}
 	printk("\n");
 }
@@ -346,17 +3366,39 @@ static void xdma_test_transfer(void)
 static long xdma_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	long ret = 0;
-	struct xdma_dev xdma_dev;
-	struct xdma_chan_cfg chan_cfg;
-	struct xdma_buf_info buf_info;
-	struct xdma_transfer trans;
+	struct xdma_client *client = file->private_data;
+	struct xdma_device *xdev = client->xdev;
+	struct xdma_chan *xchan;
+	// one command at a time, the arguments share the stack
+	union {
+		struct xdma_dev xdma_dev;
+		struct xdma_info info;
+		struct xdma_chan_cfg chan_cfg;
+		struct xdma_buf_info buf_info;
+		struct xdma_transfer trans;
+		struct xdma_cancel cancel;
+		struct xdma_space space;
+		struct xdma_qos qos;
+		struct xdma_chain chain;
+		struct xdma_sg_info sg_info;
+		struct xdma_memcpy memcpy_info;
+		struct xdma_frame frame;
+		struct xdma_rate rate;
+		struct xdma_chan_stats stats;
+		struct xdma_cyclic cyclic;
+		struct xdma_cyclic_swap cyclic_swap;
+		struct xdma_cyclic_status cyclic_status;
+		struct xdma_export export;
+		struct xdma_dmabuf_info dmabuf_info;
+	} args;
+	u32 credits;
 	u32 devices;
 	u32 chan;
+	u32 version;
 
 	switch (cmd) {
 	case XDMA_GET_NUM_DEVICES:
-		printk(KERN_DEBUG "<%s> ioctl: XDMA_GET_NUM_DEVICES\n",
-		       MODULE_NAME);
+		xdma_dbg("ioctl: XDMA_GET_NUM_DEVICES\n");
 
 		devices = num_devices;
 		if (copy_to_user((u32 *) arg, &devices, sizeof(u32)))
@@ -364,220 +3406,699 @@ static long xdma_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 
 		break;
 	case XDMA_GET_DEV_INFO:
-		printk(KERN_DEBUG "<%s> ioctl: XDMA_GET_DEV_INFO\n",
-		       MODULE_NAME);
+		xdma_dbg("ioctl: XDMA_GET_DEV_INFO\n");
 
-		if (copy_from_user((void *)&xdma_dev,
+		if (copy_from_user((void *)&args.xdma_dev,
 				   (const void __user *)arg,
 				   sizeof(struct xdma_dev)))
 			return -EFAULT;
 
-		xdma_get_dev_info(xdma_dev.device_id, &xdma_dev);
+		xdma_get_dev_info(xdev, &args.xdma_dev);
 
 		if (copy_to_user((struct xdma_dev *)arg,
-				 &xdma_dev, sizeof(struct xdma_dev)))
+				 &args.xdma_dev, sizeof(struct xdma_dev)))
+			return -EFAULT;
+
+		break;
+	case XDMA_GET_INFO:
+		xdma_dbg("ioctl: XDMA_GET_INFO\n");
+
+		xdma_get_info(&args.info);
+
+		if (copy_to_user((struct xdma_info *)arg, &args.info,
+				 sizeof(struct xdma_info)))
 			return -EFAULT;
 
 		break;
 	case XDMA_DEVICE_CONTROL:
-		printk(KERN_DEBUG "<%s> ioctl: XDMA_DEVICE_CONTROL\n",
-		       MODULE_NAME);
+		xdma_dbg("ioctl: XDMA_DEVICE_CONTROL\n");
 
-		if (copy_from_user((void *)&chan_cfg,
+		if (copy_from_user((void *)&args.chan_cfg,
 				   (const void __user *)arg,
 				   sizeof(struct xdma_chan_cfg)))
 			return -EFAULT;
 
-		xdma_device_control(&chan_cfg);
+		ret = (long)xdma_device_control(xdev, &args.chan_cfg);
 		break;
 	case XDMA_PREP_BUF:
-		printk(KERN_DEBUG "<%s> ioctl: XDMA_PREP_BUF\n", MODULE_NAME);
+		xdma_dbg("ioctl: XDMA_PREP_BUF\n");
 
-		if (copy_from_user((void *)&buf_info,
+		if (copy_from_user((void *)&args.buf_info,
 				   (const void __user *)arg,
 				   sizeof(struct xdma_buf_info)))
 			return -EFAULT;
 
-		ret = (long)xdma_prep_buffer(&buf_info);
+		ret = (long)xdma_prep_buffer(client, &args.buf_info);
 
 		if (copy_to_user((struct xdma_buf_info *)arg,
-				 &buf_info, sizeof(struct xdma_buf_info)))
+				 &args.buf_info, sizeof(struct xdma_buf_info)))
+			return -EFAULT;
+
+		break;
+	case XDMA_PREP_SG:
+		xdma_dbg("ioctl: XDMA_PREP_SG\n");
+
+		if (copy_from_user((void *)&args.sg_info,
+				   (const void __user *)arg,
+				   sizeof(struct xdma_sg_info)))
+			return -EFAULT;
+
+		ret = (long)xdma_prep_sg(client, &args.sg_info);
+		if (ret)
+			break;
+
+		if (copy_to_user((struct xdma_sg_info *)arg, &args.sg_info,
+				 sizeof(struct xdma_sg_info)))
+			return -EFAULT;
+
+		break;
+	case XDMA_PREP_MEMCPY:
+		xdma_dbg("ioctl: XDMA_PREP_MEMCPY\n");
+
+		if (copy_from_user((void *)&args.memcpy_info,
+				   (const void __user *)arg,
+				   sizeof(struct xdma_memcpy)))
+			return -EFAULT;
+
+		ret = (long)xdma_prep_memcpy(client, &args.memcpy_info);
+		if (ret)
+			break;
+
+		if (copy_to_user((struct xdma_memcpy *)arg, &args.memcpy_info,
+				 sizeof(struct xdma_memcpy)))
+			return -EFAULT;
+
+		break;
+	case XDMA_PREP_FRAME:
+		xdma_dbg("ioctl: XDMA_PREP_FRAME\n");
+
+		if (copy_from_user((void *)&args.frame, (const void __user *)arg,
+				   sizeof(struct xdma_frame)))
+			return -EFAULT;
+
+		ret = (long)xdma_prep_frame(client, &args.frame);
+		if (ret)
+			break;
+
+		if (copy_to_user((struct xdma_frame *)arg, &args.frame,
+				 sizeof(struct xdma_frame)))
+			return -EFAULT;
+
+		break;
+	case XDMA_SET_RATE:
+		xdma_dbg("ioctl: XDMA_SET_RATE\n");
+
+		if (copy_from_user((void *)&args.rate, (const void __user *)arg,
+				   sizeof(struct xdma_rate)))
+			return -EFAULT;
+
+		ret = (long)xdma_set_rate(xdev, &args.rate);
+		break;
+	case XDMA_GET_CHAN_STATS:
+		xdma_dbg("ioctl: XDMA_GET_CHAN_STATS\n");
+
+		if (copy_from_user((void *)&args.stats, (const void __user *)arg,
+				   sizeof(struct xdma_chan_stats)))
+			return -EFAULT;
+
+		ret = (long)xdma_get_chan_stats(xdev, &args.stats);
+		if (ret)
+			break;
+
+		if (copy_to_user((struct xdma_chan_stats *)arg, &args.stats,
+				 sizeof(struct xdma_chan_stats)))
+			return -EFAULT;
+
+		break;
+	case XDMA_START_CYCLIC:
+		xdma_dbg("ioctl: XDMA_START_CYCLIC\n");
+
+		if (copy_from_user((void *)&args.cyclic,
+				   (const void __user *)arg,
+				   sizeof(struct xdma_cyclic)))
+			return -EFAULT;
+
+		ret = (long)xdma_start_cyclic(client, &args.cyclic);
+		if (ret)
+			break;
+
+		if (copy_to_user((struct xdma_cyclic *)arg, &args.cyclic,
+				 sizeof(struct xdma_cyclic)))
+			return -EFAULT;
+
+		break;
+	case XDMA_SWAP_CYCLIC:
+		xdma_dbg("ioctl: XDMA_SWAP_CYCLIC\n");
+
+		if (copy_from_user((void *)&args.cyclic_swap,
+				   (const void __user *)arg,
+				   sizeof(struct xdma_cyclic_swap)))
+			return -EFAULT;
+
+		ret = (long)xdma_swap_cyclic(client, &args.cyclic_swap);
+		break;
+	case XDMA_WAIT_CYCLIC:
+		xdma_dbg("ioctl: XDMA_WAIT_CYCLIC\n");
+
+		if (copy_from_user((void *)&args.cyclic_status,
+				   (const void __user *)arg,
+				   sizeof(struct xdma_cyclic_status)))
+			return -EFAULT;
+
+		ret = (long)xdma_wait_cyclic(client, &args.cyclic_status);
+		if (ret && (ret != -ETIMEDOUT))
+			break;
+
+		if (copy_to_user((struct xdma_cyclic_status *)arg,
+				 &args.cyclic_status,
+				 sizeof(struct xdma_cyclic_status)))
+			return -EFAULT;
+
+		break;
+	case XDMA_STOP_CYCLIC:
+		xdma_dbg("ioctl: XDMA_STOP_CYCLIC\n");
+
+		if (copy_from_user((void *)&chan,
+				   (const void __user *)arg, sizeof(u32)))
+			return -EFAULT;
+
+		xchan = xdma_lookup_chan(xdev, chan);
+		if (!xchan)
+			return -EINVAL;
+
+		ret = (long)xdma_stop_cyclic(client, xchan);
+		break;
+	case XDMA_EXPORT:
+		xdma_dbg("ioctl: XDMA_EXPORT\n");
+
+		if (copy_from_user((void *)&args.export,
+				   (const void __user *)arg,
+				   sizeof(struct xdma_export)))
+			return -EFAULT;
+
+		ret = (long)xdma_export(client, &args.export);
+		if (ret)
+			break;
+
+		if (copy_to_user((struct xdma_export *)arg, &args.export,
+				 sizeof(struct xdma_export)))
+			return -EFAULT;
+
+		break;
+	case XDMA_PREP_DMABUF:
+		xdma_dbg("ioctl: XDMA_PREP_DMABUF\n");
+
+		if (copy_from_user((void *)&args.dmabuf_info,
+				   (const void __user *)arg,
+				   sizeof(struct xdma_dmabuf_info)))
+			return -EFAULT;
+
+		ret = (long)xdma_prep_dmabuf(client, &args.dmabuf_info);
+		if (ret)
+			break;
+
+		if (copy_to_user((struct xdma_dmabuf_info *)arg,
+				 &args.dmabuf_info,
+				 sizeof(struct xdma_dmabuf_info)))
+			return -EFAULT;
+
+		break;
+	case XDMA_PREP_CHAIN:
+		xdma_dbg("ioctl: XDMA_PREP_CHAIN\n");
+
+		if (copy_from_user((void *)&args.chain, (const void __user *)arg,
+				   sizeof(struct xdma_chain)))
+			return -EFAULT;
+
+		ret = (long)xdma_prep_chain(client, &args.chain);
+		if (ret)
+			break;
+
+		if (copy_to_user((struct xdma_chain *)arg, &args.chain,
+				 sizeof(struct xdma_chain)))
 			return -EFAULT;
 
 		break;
 	case XDMA_START_TRANSFER:
-		printk(KERN_DEBUG "<%s> ioctl: XDMA_START_TRANSFER\n",
-		       MODULE_NAME);
+		xdma_dbg("ioctl: XDMA_START_TRANSFER\n");
 
-		if (copy_from_user((void *)&trans,
+		if (copy_from_user((void *)&args.trans,
 				   (const void __user *)arg,
 				   sizeof(struct xdma_transfer)))
 			return -EFAULT;
 
-		ret = (long)xdma_start_transfer(&trans);
+		args.trans.bytes = 0;
+		ret = (long)xdma_start_transfer(client, &args.trans);
+
+		// the bytes that landed are reported even if the wait failed
+		if (args.trans.wait &&
+		    copy_to_user((struct xdma_transfer *)arg, &args.trans,
+				 sizeof(struct xdma_transfer)))
+			return -EFAULT;
+
+		break;
+	case XDMA_WAIT_SPACE:
+		xdma_dbg("ioctl: XDMA_WAIT_SPACE\n");
+
+		if (copy_from_user((void *)&args.space, (const void __user *)arg,
+				   sizeof(struct xdma_space)))
+			return -EFAULT;
+
+		ret = (long)xdma_wait_space(client, &args.space);
+		break;
+	case XDMA_SET_CREDITS:
+		xdma_dbg("ioctl: XDMA_SET_CREDITS\n");
+
+		if (copy_from_user((void *)&credits,
+				   (const void __user *)arg, sizeof(u32)))
+			return -EFAULT;
+
+		if ((credits == 0) || (credits > XDMA_MAX_CREDITS))
+			return -EINVAL;
+
+		client->credits = credits;
+		wake_up_interruptible(&client->space);
+		break;
+	case XDMA_CANCEL:
+		xdma_dbg("ioctl: XDMA_CANCEL\n");
+
+		if (copy_from_user((void *)&args.cancel,
+				   (const void __user *)arg,
+				   sizeof(struct xdma_cancel)))
+			return -EFAULT;
+
+		ret = (long)xdma_cancel(client, &args.cancel);
 		break;
 	case XDMA_STOP_TRANSFER:
-		printk(KERN_DEBUG "<%s> ioctl: XDMA_STOP_TRANSFER\n",
-		       MODULE_NAME);
+		xdma_dbg("ioctl: XDMA_STOP_TRANSFER\n");
 
 		if (copy_from_user((void *)&chan,
 				   (const void __user *)arg, sizeof(u32)))
 			return -EFAULT;
 
-		xdma_stop_transfer((struct dma_chan *)chan);
+		xchan = xdma_get_chan(chan);
+		if (!xchan)
+			return -EINVAL;
+
+		xdma_pm_get(xchan);
+		xdma_client_stop(client, xchan, true);
+		xdma_pm_put(xchan);
 		break;
 	case XDMA_TEST_TRANSFER:
-		printk(KERN_DEBUG "<%s> ioctl: XDMA_TEST_TRANSFER\n",
-		       MODULE_NAME);
+		xdma_dbg("ioctl: XDMA_TEST_TRANSFER\n");
 
-		xdma_test_transfer();
+		xdma_test_transfer(client);
 		break;
-	default:
+	case XDMA_GET_ABI_VERSION:
+		xdma_dbg("ioctl: XDMA_GET_ABI_VERSION\n");
+
+		version = XDMA_ABI_VERSION;
+		if (copy_to_user((u32 *) arg, &version, sizeof(u32)))
+			return -EFAULT;
+
 		break;
+	case XDMA_SET_QOS:
+		xdma_dbg("ioctl: XDMA_SET_QOS\n");
+
+		if (copy_from_user((void *)&args.qos, (const void __user *)arg,
+				   sizeof(struct xdma_qos)))
+			return -EFAULT;
+
+		ret = (long)xdma_set_qos(client, &args.qos);
+		break;
+	default:
+		return -ENOTTY;
 	}
 
 	return ret;
 }
 
+#ifdef CONFIG_COMPAT
+/* The ioctl structures have the same layout for 32 bit userspace. */
+static long xdma_compat_ioctl(struct file *file, unsigned int cmd,
+			      unsigned long arg)
+{
+	return xdma_ioctl(file, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif
+
 static struct file_operations fops = {
 	.owner = THIS_MODULE,
 	.open = xdma_open,
 	.release = xdma_close,
-	.read = xdma_read,
-	.write = xdma_write,
+	.llseek = no_llseek,
+	.read = do_sync_read,
+	.write = do_sync_write,
+	.aio_read = xdma_aio_read,
+	.aio_write = xdma_aio_write,
+	.splice_read = xdma_splice_read,
+	.splice_write = xdma_splice_write,
 	.mmap = xdma_mmap,
 	.unlocked_ioctl = xdma_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl = xdma_compat_ioctl,
+#endif
 };
 
 static bool xdma_filter(struct dma_chan *chan, void *param)
 {
-	if (*((int *)chan->private) == *(int *)param)
+	if (chan->private && (*((int *)chan->private) == *(int *)param))
 		return true;
 
 	return false;
 }
 
-static void xdma_add_dev_info(struct dma_chan *tx_chan,
-			      struct dma_chan *rx_chan)
+/* Request channel 'dir' of the Xilinx engine of type 'ip' with the number
+ * 'id', NULL if there is none.
+ */
+static struct dma_chan *xdma_request_chan(u32 ip,
+					  enum dma_transfer_direction dir,
+					  u32 id)
+{
+	dma_cap_mask_t mask;
+	u32 match;
+
+	dma_cap_zero(mask);
+	dma_cap_set((dir == DMA_MEM_TO_MEM) ? DMA_MEMCPY : DMA_SLAVE, mask);
+
+	match = (dir & 0xFF) | ip | (id << XILINX_DMA_DEVICE_ID_SHIFT);
+
+	return dma_request_channel(mask, xdma_filter, (void *)&match);
+}
+
+/* Read the stream width of a channel from its node in the device tree, and
+ * the burst length from the node of the engine.
+ */
+static void xdma_init_geometry(struct xdma_chan *xchan,
+			       enum dma_transfer_direction dir)
+{
+	struct device_node *node = xchan->chan->device->dev->of_node;
+	struct device_node *child;
+	const char *compat;
+	const char *burst;
+	u32 val;
+
+	xchan->bus_bytes = XDMA_DEF_BUS_BYTES;
+	xchan->burst = XDMA_DEF_BURST;
+
+	// a CDMA has no stream
+	if (!node || (dir == DMA_MEM_TO_MEM))
+		return;
+
+	if (dir == DMA_MEM_TO_DEV) {
+		compat = (xchan->engine == XDMA_ENGINE_VDMA) ?
+		    "xlnx,axi-vdma-mm2s-channel" : "xlnx,axi-dma-mm2s-channel";
+		burst = "xlnx,mm2s-burst-size";
+	} else {
+		compat = (xchan->engine == XDMA_ENGINE_VDMA) ?
+		    "xlnx,axi-vdma-s2mm-channel" : "xlnx,axi-dma-s2mm-channel";
+		burst = "xlnx,s2mm-burst-size";
+	}
+
+	if (!of_property_read_u32(node, burst, &val) && val)
+		xchan->burst = val;
+
+	for_each_child_of_node(node, child) {
+		if (of_device_is_compatible(child, compat) &&
+		    !of_property_read_u32(child, "xlnx,datawidth", &val) &&
+		    (val >= 8))
+			xchan->bus_bytes = val / 8;	// in bits
+	}
+
+	printk(KERN_DEBUG "<%s> chan: %u bit stream, %u beat bursts\n",
+	       MODULE_NAME, xchan->bus_bytes * 8, xchan->burst);
+}
+
+/* Claim the next entry of the channel table for 'chan', returns NULL if
+ * there is no such channel.
+ */
+static struct xdma_chan *xdma_init_chan(struct xdma_device *xdev,
+					struct dma_chan *chan,
+					enum dma_transfer_direction dir,
+					u32 engine)
+{
+	struct xdma_chan *xchan;
+	int i;
+
+	if (!chan || (num_chans == XDMA_MAX_CHANS))
+		return NULL;
+
+	xchan = &xdma_chans[num_chans++];
+	xchan->chan = chan;
+	xchan->xdev = xdev;
+	xchan->engine = engine;
+	xchan->slave = (dir != DMA_MEM_TO_MEM) &&
+	    chan->device->device_prep_slave_sg;
+	mutex_init(&xchan->lock);
+
+	spin_lock_init(&xchan->sched_lock);
+	for (i = 0; i < XDMA_NUM_PRIOS; i++)
+		INIT_LIST_HEAD(&xchan->active[i]);
+	for (i = 0; i < XDMA_SCHED_DEPTH; i++) {
+		xchan->slots[i].xchan = xchan;
+		xchan->slots[i].xfer = NULL;
+	}
+	xchan->head = 0;
+	xchan->inflight = 0;
+	xchan->stopping = 0;
+	xchan->bytes = 0;
+	xchan->cyclic = NULL;
+	init_waitqueue_head(&xchan->cyclic_wait);
+	xchan->rate = 0;
+	setup_timer(&xchan->rate_timer, xdma_rate_expire,
+		    (unsigned long)xchan);
+
+	// configure the defaults now, so users need not do it on every start
+	mutex_init(&xchan->reset_lock);
+	xchan->config.direction = dir;
+	xchan->config.coalesc = XDMA_DEF_COALESC;
+	xchan->config.delay = XDMA_DEF_DELAY;
+	xchan->config.reset = 0;
+	xchan->configured = false;
+
+	// awake for the configuration, suspends unless it is used soon
+	atomic_set(&xchan->users, 1);
+	mutex_init(&xchan->pm_lock);
+	INIT_DELAYED_WORK(&xchan->idle_work, xdma_chan_idle);
+	xchan->awake_ns = 0;
+	xchan->suspends = 0;
+	xdma_chan_resume(xchan);
+
+	xchan->configured = !xdma_chan_control(chan, DMA_SLAVE_CONFIG,
+					       (unsigned long)&xchan->config);
+	xchan->resets = 0;
+
+	xdma_init_geometry(xchan, dir);
+	xdma_pm_put(xchan);
+
+	return xchan;
+}
+
+/* Undo xdma_init_chan() before the channel is released, the engine must be
+ * idle.
+ */
+static void xdma_exit_chan(struct xdma_chan *xchan)
+{
+	del_timer_sync(&xchan->rate_timer);
+	cancel_delayed_work_sync(&xchan->idle_work);
+
+	mutex_lock(&xchan->pm_lock);
+	if (xchan->awake)
+		xdma_chan_suspend(xchan);
+	mutex_unlock(&xchan->pm_lock);
+
+	xchan->xdev = NULL;
+}
+
+/* Create the next node for the 'engine' channels 'tx_chan' and 'rx_chan',
+ * which the caller releases on failure. The CDMA with the number of the
+ * node, if any, becomes its memory to memory channel. Returns -ENODEV if
+ * there are no channels at all.
+ */
+static int xdma_add_device(struct dma_chan *tx_chan, struct dma_chan *rx_chan,
+			   u32 engine)
 {
-	struct completion *tx_cmp, *rx_cmp;
+	struct xdma_device *xdev;
+	struct device *device;
+	struct dma_chan *mem_chan;
+	dev_t devt = MKDEV(MAJOR(dev_num), num_devices);
+	const u32 first_chan = num_chans;
+	int ret;
 
-	tx_cmp = (struct completion *)
-	    kzalloc(sizeof(struct completion), GFP_KERNEL);
+	mem_chan = xdma_request_chan(XILINX_DMA_IP_CDMA, DMA_MEM_TO_MEM,
+				     num_devices);
+	if (!tx_chan && !rx_chan && !mem_chan)
+		return -ENODEV;
 
-	rx_cmp = (struct completion *)
-	    kzalloc(sizeof(struct completion), GFP_KERNEL);
+	xdev = kzalloc(sizeof(struct xdma_device), GFP_KERNEL);
+	if (!xdev) {
+		ret = -ENOMEM;
+		goto err_mem;
+	}
 
-	xdma_dev_info[num_devices] = (struct xdma_dev *)
-	    kzalloc(sizeof(struct xdma_dev), GFP_KERNEL);
+	xdev->device_id = num_devices;
+	xdev->engine = engine;
+	xdev->tx = xdma_init_chan(xdev, tx_chan, DMA_MEM_TO_DEV, engine);
+	xdev->rx = xdma_init_chan(xdev, rx_chan, DMA_DEV_TO_MEM, engine);
+	xdev->mem = xdma_init_chan(xdev, mem_chan, DMA_MEM_TO_MEM,
+				   XDMA_ENGINE_CDMA);
+	mutex_init(&xdev->mem_lock);
 
-	xdma_dev_info[num_devices]->tx_chan = (u32) tx_chan;
-	xdma_dev_info[num_devices]->tx_cmp = (u32) tx_cmp;
+	cdev_init(&xdev->cdev, &fops);
+	xdev->cdev.owner = THIS_MODULE;
+	ret = cdev_add(&xdev->cdev, devt, 1);
+	if (ret)
+		goto err_chans;
 
-	xdma_dev_info[num_devices]->rx_chan = (u32) rx_chan;
-	xdma_dev_info[num_devices]->rx_cmp = (u32) rx_cmp;
+	device = device_create(cl, NULL, devt, xdev, MODULE_NAME "%d",
+			       xdev->device_id);
+	if (IS_ERR(device)) {
+		ret = PTR_ERR(device);
+		goto err_cdev;
+	}
 
-	xdma_dev_info[num_devices]->device_id = num_devices;
+	xdma_devices[num_devices] = xdev;
 	num_devices++;
+
+	return 0;
+
+ err_cdev:
+	cdev_del(&xdev->cdev);
+ err_chans:
+	if (xdev->tx)
+		xdma_exit_chan(xdev->tx);
+	if (xdev->rx)
+		xdma_exit_chan(xdev->rx);
+	if (xdev->mem)
+		xdma_exit_chan(xdev->mem);
+
+	// the caller releases the channels, so give their slots back
+	while (num_chans > first_chan) {
+		num_chans--;
+		xdma_chans[num_chans].chan = NULL;
+		xdma_chans[num_chans].slave = false;
+	}
+	kfree(xdev);
+ err_mem:
+	if (mem_chan)
+		dma_release_channel(mem_chan);
+	return ret;
 }
 
-static void xdma_probe(void)
+static void xdma_remove_chan(struct xdma_chan *xchan)
 {
-	dma_cap_mask_t mask;
-	u32 match_tx, match_rx;
-	struct dma_chan *tx_chan, *rx_chan;
+	// descriptors of closed files may still be on the engine
+	xdma_pm_get(xchan);
+	xdma_sched_flush(xchan, -ENODEV, false);
+	xdma_exit_chan(xchan);
+	dma_release_channel(xchan->chan);
+}
 
-	dma_cap_zero(mask);
-	dma_cap_set(DMA_SLAVE | DMA_PRIVATE, mask);
+static void xdma_remove_device(struct xdma_device *xdev)
+{
+	device_destroy(cl, xdev->cdev.dev);
+	cdev_del(&xdev->cdev);
 
-	for (;;) {
-		match_tx = (DMA_MEM_TO_DEV & 0xFF) | XILINX_DMA_IP_DMA |
-		    (num_devices << XILINX_DMA_DEVICE_ID_SHIFT);
+	if (xdev->tx)
+		xdma_remove_chan(xdev->tx);
+	if (xdev->rx)
+		xdma_remove_chan(xdev->rx);
+	if (xdev->mem)
+		xdma_remove_chan(xdev->mem);
+
+	if (xdev->addr) {
+		dma_free_coherent(xdma_dma_dev(xdev), DMA_LENGTH, xdev->addr,
+				  xdev->handle);
+	}
 
-		tx_chan = dma_request_channel(mask, xdma_filter,
-					      (void *)&match_tx);
+	kfree(xdev);
+}
+
+/* Create a node for each engine of type 'ip', numbered from 0 on. */
+static void xdma_probe_engines(u32 ip, u32 engine)
+{
+	struct dma_chan *tx_chan, *rx_chan;
+	u32 id;
 
-		match_rx = (DMA_DEV_TO_MEM & 0xFF) | XILINX_DMA_IP_DMA |
-		    (num_devices << XILINX_DMA_DEVICE_ID_SHIFT);
+	for (id = 0; num_devices < MAX_DEVICES; id++) {
+		tx_chan = xdma_request_chan(ip, DMA_MEM_TO_DEV, id);
+		rx_chan = xdma_request_chan(ip, DMA_DEV_TO_MEM, id);
 
-		rx_chan = dma_request_channel(mask, xdma_filter,
-					      (void *)&match_rx);
+		if (!tx_chan && !rx_chan)
+			break;
 
-		if (!tx_chan && !rx_chan) {
-			printk(KERN_DEBUG
-			       "<%s> probe: number of devices found: %d\n",
+		if (xdma_add_device(tx_chan, rx_chan, engine)) {
+			printk(KERN_ERR
+			       "<%s> Error: creating device %d failed\n",
 			       MODULE_NAME, num_devices);
+
+			if (tx_chan)
+				dma_release_channel(tx_chan);
+			if (rx_chan)
+				dma_release_channel(rx_chan);
 			break;
-		} else {
-			xdma_add_dev_info(tx_chan, rx_chan);
 		}
 	}
 }
 
-static void xdma_remove(void)
+/* AXI DMA engines come first, so their nodes keep the numbers they had
+ * before the driver knew about other engines.
+ */
+static void xdma_probe(void)
 {
-	int i;
+	int ret;
 
-	for (i = 0; i < MAX_DEVICES; i++) {
-		if (xdma_dev_info[i]) {
-			if (xdma_dev_info[i]->tx_chan)
-				dma_release_channel((struct dma_chan *)
-						    xdma_dev_info[i]->tx_chan);
+	xdma_probe_engines(XILINX_DMA_IP_DMA, XDMA_ENGINE_DMA);
+	xdma_probe_engines(XILINX_DMA_IP_VDMA, XDMA_ENGINE_VDMA);
 
-			if (xdma_dev_info[i]->tx_cmp)
-				kfree((struct completion *)
-				      xdma_dev_info[i]->tx_cmp);
+	// CDMA engines beyond the last node get nodes of their own
+	while (num_devices < MAX_DEVICES) {
+		ret = xdma_add_device(NULL, NULL, XDMA_ENGINE_CDMA);
+		if (ret) {
+			if (ret != -ENODEV)
+				printk(KERN_ERR
+				       "<%s> Error: creating device %d failed\n",
+				       MODULE_NAME, num_devices);
+			break;
+		}
+	}
 
-			if (xdma_dev_info[i]->rx_chan)
-				dma_release_channel((struct dma_chan *)
-						    xdma_dev_info[i]->rx_chan);
+	printk(KERN_DEBUG "<%s> probe: number of devices found: %d\n",
+	       MODULE_NAME, num_devices);
+}
 
-			if (xdma_dev_info[i]->rx_cmp)
-				kfree((struct completion *)
-				      xdma_dev_info[i]->rx_cmp);
+static void xdma_remove(void)
+{
+	int i;
 
-		}
+	for (i = 0; i < num_devices; i++) {
+		xdma_remove_device(xdma_devices[i]);
+		xdma_devices[i] = NULL;
 	}
+	num_devices = 0;
+	num_chans = 0;
 }
 
 static int __init xdma_init(void)
 {
+	int ret;
+
 	num_devices = 0;
 
 	/* device constructor */
 	printk(KERN_DEBUG "<%s> init: registered\n", MODULE_NAME);
-	if (alloc_chrdev_region(&dev_num, 0, 1, MODULE_NAME) < 0) {
-		return -1;
-	}
-	if ((cl = class_create(THIS_MODULE, MODULE_NAME)) == NULL) {
-		unregister_chrdev_region(dev_num, 1);
-		return -1;
-	}
-	if (device_create(cl, NULL, dev_num, NULL, MODULE_NAME) == NULL) {
-		class_destroy(cl);
-		unregister_chrdev_region(dev_num, 1);
-		return -1;
-	}
-	cdev_init(&c_dev, &fops);
-	if (cdev_add(&c_dev, dev_num, 1) == -1) {
-		device_destroy(cl, dev_num);
-		class_destroy(cl);
-		unregister_chrdev_region(dev_num, 1);
-		return -1;
+	ret = alloc_chrdev_region(&dev_num, 0, MAX_DEVICES, MODULE_NAME);
+	if (ret < 0) {
+		return ret;
 	}
-
-	/* allocate mmap area */
-	xdma_addr =
-	    dma_zalloc_coherent(NULL, DMA_LENGTH, &xdma_handle, GFP_KERNEL);
-
-	if (!xdma_addr) {
-		printk(KERN_ERR "<%s> Error: allocating dma memory failed\n",
-		       MODULE_NAME);
-
-		return -ENOMEM;
+	// class_create() returns an error pointer, never NULL
+	cl = class_create(THIS_MODULE, MODULE_NAME);
+	if (IS_ERR(cl)) {
+		unregister_chrdev_region(dev_num, MAX_DEVICES);
+		return PTR_ERR(cl);
 	}
 
-	/* hardware setup */
+	/* hardware setup, creates one node per device */
 	xdma_probe();
 
 	return 0;
@@ -585,20 +4106,17 @@ static int __init xdma_init(void)
 
 static void __exit xdma_exit(void)
 {
-	/* device destructor */
-	cdev_del(&c_dev);
-	device_destroy(cl, dev_num);
-	class_destroy(cl);
-	unregister_chrdev_region(dev_num, 1);
-	printk(KERN_DEBUG "<%s> exit: unregistered\n", MODULE_NAME);
-
-	/* hardware shutdown */
+	/* hardware shutdown and device destructor */
 	xdma_remove();
 
-	/* free mmap area */
-	if (xdma_addr) {
-		dma_free_coherent(NULL, DMA_LENGTH, xdma_addr, xdma_handle);
-	}
+	/* imported dma-bufs still waiting to be detached, flushing the
+	 * channels above may have queued more
+	 */
+	flush_scheduled_work();
+
+	class_destroy(cl);
+	unregister_chrdev_region(dev_num, MAX_DEVICES);
+	printk(KERN_DEBUG "<%s> exit: unregistered\n", MODULE_NAME);
 }
 
 module_init(xdma_init);
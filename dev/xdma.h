@@ -12,14 +12,101 @@ extern "C" {
 #define DMA_LENGTH	(32*1024*1024)
 #define MAX_DEVICES     4
 
+/* The mmap offset selects the memory attributes of the mapping. Both ranges
+ * alias the same DMA memory; the write-combined one is meant for buffers
+ * that are only used as MEM_TO_DEV sources.
+ */
+#define XDMA_MMAP_NONCACHED	(0)
+#define XDMA_MMAP_WRITECOMBINE	(DMA_LENGTH)
+
+/* Mapping the completion ring (struct xdma_ring) of the file at this offset
+ * makes the driver post a record for each transfer that was prepared with
+ * XDMA_PREP_BUF or XDMA_PREP_CHAIN once it ends.
+ */
+#define XDMA_MMAP_RING		(2 * DMA_LENGTH)
+#define XDMA_RING_ENTRIES	256	// power of two
+
+/* Version of the ioctl ABI below, reported by XDMA_GET_ABI_VERSION. The
+ * structure sizes are also encoded in the ioctl numbers, so a mismatched
+ * user of an older layout gets -ENOTTY instead of misinterpreted data.
+ */
+#define XDMA_ABI_VERSION	11
+
+/* Channels are referred to by small integer handles, XDMA_NO_CHAN marks a
+ * device without a channel in that direction.
+ */
+#define XDMA_NO_CHAN	(0xFFFFFFFF)
+
+/* Flags of struct xdma_buf_info. A transfer marked XDMA_BUF_RETRY is
+ * idempotent, if its descriptors are aborted by a channel reset it is
+ * submitted again instead of failing.
+ */
+#define XDMA_BUF_RETRY	(1 << 0)
+
+/* Channel configuration the driver applies when it finds an engine. The
+ * flags of struct xdma_dev tell whether a channel still has it, so users
+ * that want these settings need not configure the channel again.
+ */
+#define XDMA_DEF_COALESC	1
+#define XDMA_DEF_DELAY		0
+#define XDMA_DEV_TX_DEFAULT	(1 << 0)
+#define XDMA_DEV_RX_DEFAULT	(1 << 1)
+
+/* Flags of struct xdma_cancel. XDMA_CANCEL_ENGINE also terminates the
+ * descriptors of the transfer that are on the engine.
+ */
+#define XDMA_CANCEL_ENGINE	(1 << 0)
+
+/* Flags of struct xdma_export. */
+#define XDMA_EXPORT_CLOEXEC	(1 << 0)
+
+/* Flags of struct xdma_chain. With XDMA_CHAIN_WAIT, XDMA_PREP_CHAIN waits
+ * for all stages and fails with the first error among them.
+ */
+#define XDMA_CHAIN_WAIT	(1 << 0)
+
+/* Most stages in a chain of transfers, see struct xdma_chain. */
+#define XDMA_MAX_STAGES	8
+
+/* Most pieces of a gather or scatter transfer, see struct xdma_sg_info. */
+#define XDMA_MAX_SEGS	16
+
+/* Most rows of a frame on a channel without interleaved descriptors, see
+ * struct xdma_frame.
+ */
+#define XDMA_MAX_ROWS	1024
+
+/* Fewest periods of a cyclic playback that can be swapped, see struct
+ * xdma_cyclic_swap.
+ */
+#define XDMA_CYCLIC_MIN_SWAP	3
+
 #define XDMA_IOCTL_BASE	'W'
-#define XDMA_GET_NUM_DEVICES	_IO(XDMA_IOCTL_BASE, 0)
-#define XDMA_GET_DEV_INFO	_IO(XDMA_IOCTL_BASE, 1)
-#define XDMA_DEVICE_CONTROL	_IO(XDMA_IOCTL_BASE, 2)
-#define XDMA_PREP_BUF		_IO(XDMA_IOCTL_BASE, 3)
-#define XDMA_START_TRANSFER	_IO(XDMA_IOCTL_BASE, 4)
-#define XDMA_STOP_TRANSFER	_IO(XDMA_IOCTL_BASE, 5)
+#define XDMA_GET_NUM_DEVICES	_IOR(XDMA_IOCTL_BASE, 0, __u32)
+#define XDMA_GET_DEV_INFO	_IOWR(XDMA_IOCTL_BASE, 1, struct xdma_dev)
+#define XDMA_DEVICE_CONTROL	_IOW(XDMA_IOCTL_BASE, 2, struct xdma_chan_cfg)
+#define XDMA_PREP_BUF		_IOWR(XDMA_IOCTL_BASE, 3, struct xdma_buf_info)
+#define XDMA_START_TRANSFER	_IOWR(XDMA_IOCTL_BASE, 4, struct xdma_transfer)
+#define XDMA_STOP_TRANSFER	_IOW(XDMA_IOCTL_BASE, 5, __u32)
 #define XDMA_TEST_TRANSFER	_IO(XDMA_IOCTL_BASE, 6)
+#define XDMA_GET_ABI_VERSION	_IOR(XDMA_IOCTL_BASE, 7, __u32)
+#define XDMA_SET_QOS		_IOW(XDMA_IOCTL_BASE, 8, struct xdma_qos)
+#define XDMA_PREP_CHAIN		_IOWR(XDMA_IOCTL_BASE, 9, struct xdma_chain)
+#define XDMA_PREP_SG		_IOWR(XDMA_IOCTL_BASE, 10, struct xdma_sg_info)
+#define XDMA_GET_INFO		_IOR(XDMA_IOCTL_BASE, 11, struct xdma_info)
+#define XDMA_EXPORT		_IOWR(XDMA_IOCTL_BASE, 12, struct xdma_export)
+#define XDMA_PREP_DMABUF	_IOWR(XDMA_IOCTL_BASE, 13, struct xdma_dmabuf_info)
+#define XDMA_CANCEL		_IOW(XDMA_IOCTL_BASE, 14, struct xdma_cancel)
+#define XDMA_WAIT_SPACE		_IOW(XDMA_IOCTL_BASE, 15, struct xdma_space)
+#define XDMA_SET_CREDITS	_IOW(XDMA_IOCTL_BASE, 16, __u32)
+#define XDMA_PREP_MEMCPY	_IOWR(XDMA_IOCTL_BASE, 17, struct xdma_memcpy)
+#define XDMA_PREP_FRAME		_IOWR(XDMA_IOCTL_BASE, 18, struct xdma_frame)
+#define XDMA_SET_RATE		_IOW(XDMA_IOCTL_BASE, 19, struct xdma_rate)
+#define XDMA_GET_CHAN_STATS	_IOWR(XDMA_IOCTL_BASE, 20, struct xdma_chan_stats)
+#define XDMA_START_CYCLIC	_IOWR(XDMA_IOCTL_BASE, 21, struct xdma_cyclic)
+#define XDMA_SWAP_CYCLIC	_IOW(XDMA_IOCTL_BASE, 22, struct xdma_cyclic_swap)
+#define XDMA_WAIT_CYCLIC	_IOWR(XDMA_IOCTL_BASE, 23, struct xdma_cyclic_status)
+#define XDMA_STOP_CYCLIC	_IOW(XDMA_IOCTL_BASE, 24, __u32)
 
 	enum xdma_direction {
 		XDMA_MEM_TO_DEV,
@@ -27,39 +114,276 @@ extern "C" {
 		XDMA_TRANS_NONE,
 	};
 
+	/* Scheduling classes, a class is only served when all higher ones
+	 * have nothing queued on the channel.
+	 */
+	enum xdma_prio {
+		XDMA_PRIO_RT,
+		XDMA_PRIO_NORMAL,
+		XDMA_PRIO_BULK,
+		XDMA_NUM_PRIOS,
+	};
+
+	/* Xilinx engines the driver binds to. Each AXI DMA and AXI VDMA
+	 * gets a node for its tx/rx channel pair, an AXI CDMA is the memory
+	 * to memory channel of the node with its number, or of a node of its
+	 * own if there is none.
+	 */
+	enum xdma_engine {
+		XDMA_ENGINE_DMA,
+		XDMA_ENGINE_VDMA,
+		XDMA_ENGINE_CDMA,
+	};
+
+	/* All structures only use fixed size fields and are padded to a
+	 * multiple of 8 bytes, so they have the same layout for 32 and 64 bit
+	 * kernels and userspace.
+	 */
+	/* 'bus_bytes' and 'burst' are the widest stream and longest burst of
+	 * the two channels, buffers are best aligned to their product.
+	 */
 	struct xdma_dev {
-		u32 tx_chan;	/* (struct dma_chan *) */
-		u32 tx_cmp;	/* (struct completion *) callback_param */
-		u32 rx_chan;	/* (struct dma_chan *) */
-		u32 rx_cmp;	/* (struct completion *) callback_param */
-		u32 device_id;
+		__u32 device_id;
+		__u32 tx_chan;	/* channel handle */
+		__u32 rx_chan;	/* channel handle */
+		__u32 bus_bytes;	/* AXI stream data width in bytes */
+		__u32 burst;	/* beats per burst */
+		__u32 flags;	/* XDMA_DEV_* */
+		__u32 mem_chan;	/* channel handle, memory to memory */
+		__u32 engine;	/* enum xdma_engine of tx_chan and rx_chan */
+	};
+
+	/* Everything a user needs to know at startup, from any device node
+	 * in one call.
+	 */
+	struct xdma_info {
+		__u32 abi_version;
+		__u32 num_devices;
+		struct xdma_dev devs[MAX_DEVICES];
 	};
 
 	struct xdma_chan_cfg {
-		u32 chan;	/* (struct dma_chan *) */
+		__u32 chan;	/* channel handle */
 
-		enum xdma_direction dir;	/* Channel direction */
-		int coalesc;	/* Interrupt coalescing threshold */
-		int delay;	/* Delay counter */
-		int reset;	/* Reset Channel */
+		__u32 dir;	/* Channel direction (enum xdma_direction) */
+		__s32 coalesc;	/* Interrupt coalescing threshold */
+		__s32 delay;	/* Delay counter */
+		__u32 reset;	/* Reset Channel */
+		__u32 reserved;
 	};
 
 	struct xdma_buf_info {
-		u32 chan;	/* (struct dma_chan *) */
-		u32 completion;	/* (struct completion *) callback_param */
+		__u32 chan;	/* channel handle */
+		__s32 cookie;
+
+		__u64 buf_offset;
+		__u64 buf_size;
+		__u32 dir;	/* enum xdma_direction */
+		__u32 flags;	/* XDMA_BUF_* */
+	};
 
-		dma_cookie_t cookie;
-		u32 buf_offset;
-		u32 buf_size;
-		enum xdma_direction dir;
+	struct xdma_seg {
+		__u64 offset;	/* in the DMA memory of the device */
+		__u64 size;
 	};
 
+	/* A transfer of several pieces of the DMA memory, which a MEM_TO_DEV
+	 * channel gathers into one stream and a DEV_TO_MEM channel scatters
+	 * one packet over. It is started like any prepared buffer.
+	 */
+	struct xdma_sg_info {
+		__u32 chan;	/* channel handle */
+		__s32 cookie;	/* out */
+		__u32 nsegs;
+		__u32 flags;	/* XDMA_BUF_* */
+		struct xdma_seg segs[XDMA_MAX_SEGS];
+	};
+
+	/* A copy within the DMA memory of the device, done by its memory to
+	 * memory channel so large moves cost no CPU memory bandwidth.
+	 */
+	struct xdma_memcpy {
+		__u32 chan;	/* channel handle */
+		__s32 cookie;	/* out */
+		__u32 flags;	/* XDMA_BUF_* */
+		__u32 reserved;
+		__u64 src_offset;
+		__u64 dst_offset;
+		__u64 size;
+	};
+
+	/* 'rows' lines of 'row_size' bytes, each 'stride' bytes after the
+	 * one before, starting at 'offset' of the DMA memory, for example a
+	 * tile of a larger image. A VDMA channel moves the frame as one
+	 * interleaved descriptor, an AXI DMA channel as one scatter-gather
+	 * descriptor of at most XDMA_MAX_ROWS rows.
+	 */
+	struct xdma_frame {
+		__u32 chan;	/* channel handle */
+		__s32 cookie;	/* out */
+		__u32 flags;	/* XDMA_BUF_* */
+		__u32 rows;
+		__u64 offset;
+		__u64 row_size;
+		__u64 stride;
+	};
+
+	/* A page aligned region of the DMA memory, exported as a dma-buf file
+	 * descriptor for other drivers.
+	 */
+	struct xdma_export {
+		__u64 offset;
+		__u64 size;
+		__s32 fd;	/* out */
+		__u32 flags;	/* XDMA_EXPORT_* */
+	};
+
+	/* A transfer from or into a dma-buf of another driver. A 'size' of
+	 * zero takes the rest of the buffer after 'offset'.
+	 */
+	struct xdma_dmabuf_info {
+		__u32 chan;	/* channel handle */
+		__s32 cookie;	/* out */
+		__s32 fd;	/* dma-buf */
+		__u32 flags;	/* XDMA_BUF_* */
+		__u64 offset;
+		__u64 size;	/* in/out */
+	};
+
+	/* With 'wait' set, 'bytes' returns how much the engine moved. A
+	 * DEV_TO_MEM packet that ends early gives less than the buffer size,
+	 * if the engine driver reports the residue.
+	 */
 	struct xdma_transfer {
-		u32 chan;	/* (struct dma_chan *) */
-		u32 completion;	/* (struct completion *) callback_param */
+		__u32 chan;	/* channel handle */
+		__s32 cookie;
+
+		__u32 wait;	/* true/false */
+		__u32 reserved;
+		__u64 bytes;	/* out */
+	};
+
+	/* Each file may have a limited number of transfers prepared and not
+	 * yet ended per channel (XDMA_SET_CREDITS, 64 by default). Preparing
+	 * more fails with EAGAIN, XDMA_WAIT_SPACE waits until one ended.
+	 */
+	struct xdma_space {
+		__u32 chan;	/* channel handle */
+		__u32 timeout_ms;
+	};
+
+	/* Cancel the transfer with 'cookie' of the calling file. */
+	struct xdma_cancel {
+		__s32 cookie;
+		__u32 flags;	/* XDMA_CANCEL_* */
+	};
+
+	/* Scheduling parameters of the calling file, for both channels. */
+	struct xdma_qos {
+		__u32 prio;	/* enum xdma_prio */
+		__u32 weight;	/* share within the class, 1 to 64 */
+		__u32 max_chunk;	/* MEM_TO_DEV split size, 0 never */
+		__u32 reserved;
+	};
+
+	/* Throughput cap of a channel, for all files using it. */
+	struct xdma_rate {
+		__u32 chan;	/* channel handle */
+		__u32 reserved;
+		__u64 bytes_per_sec;	/* 0 for no cap */
+	};
+
+	/* Activity of a channel since the driver was loaded. Dividing the
+	 * energy the board used by 'bytes' gives the cost per byte, and
+	 * 'awake_ns' is how long the engine was kept powered.
+	 */
+	struct xdma_chan_stats {
+		__u32 chan;	/* channel handle */
+		__u32 awake;	/* 0 if the channel is suspended */
+		__u64 bytes;	/* moved by the engine */
+		__u64 awake_ns;
+		__u64 suspends;
+		__u64 bytes_per_sec;	/* current cap, 0 for none */
+	};
+
+	/* Play 'periods' periods of 'period_size' bytes from 'offset' of the
+	 * DMA memory on a tx channel, over and over until XDMA_STOP_CYCLIC.
+	 * Every period posts a record with 'cookie' to the completion ring.
+	 */
+	struct xdma_cyclic {
+		__u32 chan;	/* channel handle */
+		__s32 cookie;	/* out */
+		__u32 periods;
+		__u32 flags;	/* none yet, must be 0 */
+		__u64 offset;
+		__u64 period_size;
+	};
+
+	/* Replace what is played with 'periods * period_size' bytes from
+	 * 'offset'. Each period is copied once the engine is done with it,
+	 * so the new table starts at a period boundary. The copy has to end
+	 * while the engine plays the other periods, so the playback needs at
+	 * least XDMA_CYCLIC_MIN_SWAP of them.
+	 */
+	struct xdma_cyclic_swap {
+		__u32 chan;	/* channel handle */
+		__u32 reserved;
+		__u64 offset;
+	};
+
+	/* Wait until more than 'period' periods were played, or for
+	 * 'timeout_ms'.
+	 */
+	struct xdma_cyclic_status {
+		__u32 chan;	/* channel handle */
+		__u32 timeout_ms;
+		__u64 period;	/* in */
+		__u64 played;	/* out, periods played so far */
+		__u64 swapped;	/* out, first period of the last swap, or 0 */
+	};
+
+	struct xdma_ring_entry {
+		__s32 cookie;
+		__s32 status;	/* 0 or a negative errno */
+		__u64 bytes;	/* transferred */
+		__u64 timestamp;	/* ns, CLOCK_MONOTONIC */
+		__u64 reserved;
+	};
+
+	/* Single producer, single consumer ring, 'head' and 'tail' count
+	 * records and are only ever incremented. The driver writes a record,
+	 * then 'head' with release semantics. Userspace reads 'head' with an
+	 * acquire load, consumes records up to it, then stores 'tail' with
+	 * release semantics. Records that find the ring full are dropped.
+	 */
+	struct xdma_ring {
+		__u32 head;	/* written by the driver */
+		__u32 dropped;	/* records lost to a full ring */
+		__u8 pad0[56];
+		__u32 tail;	/* written by userspace */
+		__u8 pad1[60];
+		struct xdma_ring_entry entries[XDMA_RING_ENTRIES];
+	};
+
+	/* A transfer in a chain. Its channel and buffer may belong to any
+	 * device, the direction follows from the channel.
+	 */
+	struct xdma_stage {
+		__u32 chan;	/* channel handle */
+		__u32 mem_device;	/* device with the buf in its memory */
+		__u64 buf_offset;
+		__u64 buf_size;
+		__s32 after;	/* earlier stage that starts this one, or -1 */
+		__s32 cookie;	/* out */
+	};
 
-		dma_cookie_t cookie;
-		u32 wait;	/* true/false */
+	/* Stages are prepared and started together, a stage with 'after' set
+	 * is submitted by the driver when that stage completes.
+	 */
+	struct xdma_chain {
+		__u32 num_stages;
+		__u32 flags;	/* XDMA_CHAIN_* */
+		struct xdma_stage stages[XDMA_MAX_STAGES];
 	};
 
 #ifdef __cplusplus
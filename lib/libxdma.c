@@ -1,141 +1,652 @@
 #include "libxdma.h"
-
-// the below defines are a hack that enables the use of kernel data types
-// without having to included standard kernel headers
-#define u32 uint32_t
-// dma_cookie_t is defined in the kernel header <linux/dmaengine.h>
-#define dma_cookie_t int32_t
 #include "xdma.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+/* Default stream geometry, the Makefile sets it for the bitstream at hand
+ * (make BUS_IN_BYTES=8 BUS_BURST=32). Buffers of a device are aligned to the
+ * geometry the driver reports for it, but never less than this, and the
+ * buffer helpers work in blocks of this size.
+ */
+#ifndef BUS_IN_BYTES
 #define BUS_IN_BYTES 4
+#endif
+#ifndef BUS_BURST
 #define BUS_BURST 16
+#endif
+
+#define XDMA_BLOCK (BUS_IN_BYTES * BUS_BURST)
+#if (XDMA_BLOCK & (XDMA_BLOCK - 1)) || (XDMA_BLOCK < 16) || (XDMA_BLOCK > 256)
+#error "BUS_IN_BYTES * BUS_BURST must be a power of two from 16 to 256"
+#endif
+
+/* Calibration results are kept across runs in this file, unless the
+ * XDMA_CALIBRATION environment variable names another one.
+ */
+#define XDMA_CALIB_FILE "/var/tmp/xdma-calibration"
+#define XDMA_CALIB_MIN_SIZE (4 * 1024)
+#define XDMA_CALIB_MAX_SIZE (4 * 1024 * 1024)
+#define XDMA_CALIB_TIME_NS (20 * 1000 * 1000)	/* per transfer size */
+#define XDMA_CALIB_EFFICIENCY 90	/* percent of peak bandwidth */
+
+/* Setting XDMA_TRACE to a file name traces the calls from xdma_init() on,
+ * see xdma_trace_start().
+ */
+#define XDMA_TRACE_BUFFER (256 * 1024)
 
-static uint32_t alloc_offset;
-static int fd;
-static uint8_t *map;		/* mmapped array of char's */
+/* Every device has its own node and DMA memory area. */
+static int fd[MAX_DEVICES];
+static uint8_t *map[MAX_DEVICES];	/* mmapped array of char's */
+static uint8_t *wc_map[MAX_DEVICES];	/* write-combined alias of 'map' */
+static uint32_t alloc_offset[MAX_DEVICES];
+static uint32_t align_mask[MAX_DEVICES];	/* buffer alignment - 1 */
+static bool ready[MAX_DEVICES];	/* mapped and configured */
+static struct xdma_ring *ring[MAX_DEVICES];	/* completion rings */
+static struct xdma_calibration calib[MAX_DEVICES];	/* chunk 0 if none */
+static struct xdma_qos cur_qos[MAX_DEVICES];	/* see xdma_set_qos() */
+static FILE *trace;		/* NULL unless tracing */
 
 int num_of_devices;
 struct xdma_dev xdma_devices[MAX_DEVICES];
 
-uint32_t xdma_calc_offset(void *ptr)
+static int xdma_use_device(int device_id);
+
+/* Errors
+ *
+ * Failures are recorded per thread and passed to the log callback, if one
+ * is set, but never printed: under an error storm the writes to stderr
+ * would stall the very loop that handles the errors.
+ */
+static __thread struct xdma_error_info last_error;
+static xdma_log_fn log_fn;
+static void *log_arg;
+
+static int xdma_fail_code(int device_id, enum xdma_error code, int err,
+			  const char *call)
+{
+	last_error.code = code;
+	last_error.sys_errno = err;
+	last_error.device_id = device_id;
+	last_error.call = call;
+
+	if (log_fn) {
+		log_fn(log_arg, &last_error);
+	}
+
+	errno = err;
+	return -1;
+}
+
+/* A failed system call, classified by its errno. */
+static int xdma_fail(int device_id, const char *call)
+{
+	const int err = errno;
+
+	return xdma_fail_code(device_id, xdma_error_code(err), err, call);
+}
+
+enum xdma_error xdma_error_code(int status)
+{
+	switch ((status < 0) ? -status : status) {
+	case 0:
+		return XDMA_OK;
+	case ENOENT:
+	case ENODEV:
+	case ENXIO:
+		return XDMA_ERR_NO_DEVICE;
+	case EINVAL:
+		return XDMA_ERR_INVALID;
+	case EOPNOTSUPP:
+		return XDMA_ERR_UNSUPPORTED;
+	case EAGAIN:
+	case EBUSY:
+		return XDMA_ERR_BUSY;
+	case ETIMEDOUT:
+		return XDMA_ERR_TIMEOUT;
+	case EIO:
+		return XDMA_ERR_DMA;
+	case ECANCELED:
+	case EPIPE:
+		return XDMA_ERR_CANCELED;
+	case ENOMEM:
+		return XDMA_ERR_NO_MEMORY;
+	default:
+		return XDMA_ERR_SYSTEM;
+	}
+}
+
+const char *xdma_error_string(enum xdma_error code)
+{
+	switch (code) {
+	case XDMA_OK:
+		return "success";
+	case XDMA_ERR_SYSTEM:
+		return "system call failed";
+	case XDMA_ERR_NO_DEVICE:
+		return "no such device";
+	case XDMA_ERR_ABI:
+		return "driver ABI version mismatch";
+	case XDMA_ERR_INVALID:
+		return "invalid argument";
+	case XDMA_ERR_OFFSET:
+		return "buffer not in device memory";
+	case XDMA_ERR_NO_ENGINE:
+		return "device has no such engine";
+	case XDMA_ERR_UNSUPPORTED:
+		return "not supported by the engine";
+	case XDMA_ERR_BUSY:
+		return "busy";
+	case XDMA_ERR_TIMEOUT:
+		return "timed out";
+	case XDMA_ERR_DMA:
+		return "DMA error";
+	case XDMA_ERR_CANCELED:
+		return "canceled";
+	case XDMA_ERR_NO_MEMORY:
+		return "out of memory";
+	}
+
+	return "unknown error";
+}
+
+/* Last failure of the calling thread, it is not cleared by calls that
+ * succeed.
+ */
+const struct xdma_error_info *xdma_last_error(void)
+{
+	return &last_error;
+}
+
+/* Pass every failure to 'fn', NULL turns that off. It runs in the thread
+ * that failed, so it must be thread safe and should be cheap. Set it before
+ * starting other threads.
+ */
+void xdma_set_log(xdma_log_fn fn, void *arg)
+{
+	log_arg = arg;
+	log_fn = fn;
+}
+
+static bool xdma_in_map(uint8_t * base, void *ptr)
+{
+	return ((base != NULL) && (((uint8_t *) ptr) >= &base[0]) &&
+		(((uint8_t *) ptr) < &base[FILESIZE]));
+}
+
+/* Offset of 'ptr' within the DMA memory area of the device, or UINT32_MAX if
+ * the pointer is not in that area.
+ */
+uint32_t xdma_calc_offset(int device_id, void *ptr)
+{
+	if (xdma_in_map(wc_map[device_id], ptr)) {
+		return (((uint8_t *) ptr) - &wc_map[device_id][0]);
+	}
+
+	if (xdma_in_map(map[device_id], ptr)) {
+		return (((uint8_t *) ptr) - &map[device_id][0]);
+	}
+
+	return UINT32_MAX;
+}
+
+/* CLOCK_MONOTONIC in ns, for the call trace and the calibration. */
+static uint64_t xdma_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Call trace, the records are written through a large stdio buffer so a
+ * traced call only costs a clock read and a copy.
+ */
+
+static uint32_t xdma_trace_offset(int device_id, void *ptr)
+{
+	if ((ptr == NULL) || (device_id < 0) || (device_id >= MAX_DEVICES)) {
+		return UINT32_MAX;
+	}
+
+	return xdma_calc_offset(device_id, ptr);
+}
+
+static void xdma_trace_put(enum xdma_trace_op op, int device_id, int wait,
+			   uint64_t start, int result,
+			   void *src_ptr, uint32_t src_bytes,
+			   void *dst_ptr, uint32_t dst_bytes)
+{
+	struct xdma_trace_record rec;
+
+	rec.timestamp = start;
+	rec.duration = (uint32_t) (xdma_now() - start);
+	rec.op = op;
+	rec.device_id = device_id;
+	rec.wait = wait;
+	rec.result = (result < 0) ? -1 : 0;
+	rec.src_offset = xdma_trace_offset(device_id, src_ptr);
+	rec.src_length = src_bytes;
+	rec.dst_offset = xdma_trace_offset(device_id, dst_ptr);
+	rec.dst_length = dst_bytes;
+
+	fwrite(&rec, sizeof(rec), 1, trace);
+}
+
+/* Round a buffer size up to whole bursts, the block sizes are powers of two
+ * so this is a mask rather than a division.
+ */
+static inline uint32_t xdma_round_size(uint32_t length, uint32_t mask)
 {
-	return (((uint8_t *) ptr) - &map[0]);
+	return (length + mask) & ~mask;
 }
 
 uint32_t xdma_calc_size(int length, int byte_num)
 {
-	const int block = (BUS_IN_BYTES * BUS_BURST);
-	length = length * byte_num;
+	return xdma_round_size(length * byte_num, XDMA_BLOCK - 1);
+}
+
+/* Buffer alignment of a device, a whole burst of its widest channel.
+ */
+uint32_t xdma_buf_align(int device_id)
+{
+	return align_mask[device_id] + 1;
+}
+
+/* Largest power of two that is not below 'n'.
+ */
+static uint32_t xdma_pow2_ceil(uint32_t n)
+{
+	uint32_t p = 1;
 
-	if (0 != (length % block)) {
-		length += (block - (length % block));
+	while (p < n) {
+		p <<= 1;
 	}
 
-	return length;
+	return p;
 }
 
-// Static allocator
-void *xdma_alloc(int length, int byte_num)
+static void xdma_init_align(int device_id, const struct xdma_dev *dev)
+{
+	uint32_t block = xdma_pow2_ceil(dev->bus_bytes * dev->burst);
+
+	align_mask[device_id] = ((block > XDMA_BLOCK) ? block : XDMA_BLOCK) - 1;
+}
+
+/* Reserve the next buffer in the DMA memory of a device and set 'offset' to
+ * its start, fails if it does not fit.
+ */
+static int xdma_alloc_reserve(int device_id, int length, int byte_num,
+			      uint32_t * offset)
+{
+	const uint64_t size = (uint64_t) length * byte_num;
+
+	if (xdma_use_device(device_id) < 0) {
+		return -1;
+	}
+
+	if ((length < 0) || (byte_num < 0)) {
+		return xdma_fail_code(device_id, XDMA_ERR_INVALID, EINVAL,
+				      "invalid buffer size");
+	}
+
+	// offsets stay aligned, so the rounded size fits if the size does
+	if (size > FILESIZE - alloc_offset[device_id]) {
+		return xdma_fail_code(device_id, XDMA_ERR_NO_MEMORY, ENOMEM,
+				      "DMA memory exhausted");
+	}
+
+	*offset = alloc_offset[device_id];
+	alloc_offset[device_id] += xdma_round_size((uint32_t) size,
+						   align_mask[device_id]);
+
+	return 0;
+}
+
+// Static allocator, buffers can only be used with the device they came from
+void *xdma_alloc_dev(int device_id, int length, int byte_num)
+{
+	const uint64_t start = trace ? xdma_now() : 0;
+	uint32_t offset;
+	void *array;
+
+	if (xdma_alloc_reserve(device_id, length, byte_num, &offset) < 0) {
+		return NULL;
+	}
+
+	array = &map[device_id][offset];
+
+	if (trace) {
+		xdma_trace_put(XDMA_TRACE_ALLOC, device_id, 0, start, 0,
+			       NULL, 0, array, length * byte_num);
+	}
+
+	return array;
+}
+
+/* Static allocator for MEM_TO_DEV source buffers
+ *
+ * Returns memory through the write-combined mapping, which makes CPU stores
+ * into the buffer much faster. Reads from it are still uncached, so only use
+ * it for buffers that the CPU fills and the DMA engine reads.
+ */
+void *xdma_alloc_src_dev(int device_id, int length, int byte_num)
 {
-	void *array = &map[alloc_offset];
+	const uint64_t start = trace ? xdma_now() : 0;
+	uint32_t offset;
+	void *array;
+
+	if (xdma_alloc_reserve(device_id, length, byte_num, &offset) < 0) {
+		return NULL;
+	}
+
+	array = &wc_map[device_id][offset];
 
-	alloc_offset += xdma_calc_size(length, byte_num);
+	if (trace) {
+		xdma_trace_put(XDMA_TRACE_ALLOC_SRC, device_id, 0, start, 0,
+			       NULL, 0, array, length * byte_num);
+	}
 
 	return array;
 }
 
+void *xdma_alloc(int length, int byte_num)
+{
+	return xdma_alloc_dev(0, length, byte_num);
+}
+
+void *xdma_alloc_src(int length, int byte_num)
+{
+	return xdma_alloc_src_dev(0, length, byte_num);
+}
+
 void xdma_alloc_reset(void)
 {
-	alloc_offset = 0;
+	int i;
+
+	for (i = 0; i < MAX_DEVICES; i++) {
+		alloc_offset[i] = 0;
+	}
+}
+
+/* Calibration results of earlier runs, see xdma_calibrate().
+ */
+static const char *xdma_calib_path(void)
+{
+	const char *path = getenv("XDMA_CALIBRATION");
+
+	return path ? path : XDMA_CALIB_FILE;
 }
 
-int xdma_init(void)
+static void xdma_calib_load(void)
 {
+	struct xdma_calibration c;
+	char line[128];
+	FILE *file;
 	int i;
-	struct xdma_chan_cfg dst_config;
-	struct xdma_chan_cfg src_config;
 
-	/* Open the char device file.
-	 */
-	fd = open(FILEPATH, O_RDWR | O_CREAT | O_TRUNC, (mode_t) 0600);
-	if (fd == -1) {
-		perror("Error opening file for writing");
-		return EXIT_FAILURE;
+	file = fopen(xdma_calib_path(), "r");
+	if (!file) {
+		return;
+	}
+
+	while (fgets(line, sizeof(line), file)) {
+		if (sscanf(line, "%d %u %u %u", &i, &c.overhead_ns,
+			   &c.bandwidth, &c.chunk) != 4) {
+			continue;
+		}
+
+		if ((i >= 0) && (i < num_of_devices)) {
+			calib[i] = c;
+		}
+	}
+
+	fclose(file);
+}
+
+/* Open the char device file of a device, unless it is open already, and
+ * mmap its DMA memory area. A device whose configuration failed is mapped
+ * already, and buffers may have been handed out from that mapping.
+ */
+static int xdma_open_device(int device_id)
+{
+	char path[32];
+
+	if (map[device_id]) {
+		return 0;
+	}
+
+	if (fd[device_id] == -1) {
+		snprintf(path, sizeof(path), FILEPATH, device_id);
+
+		fd[device_id] = open(path, O_RDWR);
+		if (fd[device_id] == -1) {
+			return xdma_fail(device_id, "opening device file");
+		}
+	}
+
+	map[device_id] = mmap(0, FILESIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+			      fd[device_id], XDMA_MMAP_NONCACHED);
+	if (map[device_id] == MAP_FAILED) {
+		xdma_fail(device_id, "mmapping the file");
+		map[device_id] = NULL;
+		close(fd[device_id]);
+		fd[device_id] = -1;
+		return -1;
+	}
+
+	wc_map[device_id] = mmap(0, FILESIZE, PROT_READ | PROT_WRITE,
+				 MAP_SHARED, fd[device_id],
+				 XDMA_MMAP_WRITECOMBINE);
+	if (wc_map[device_id] == MAP_FAILED) {
+		xdma_fail(device_id, "mmapping the file write-combined");
+		wc_map[device_id] = NULL;
+		munmap(map[device_id], FILESIZE);
+		map[device_id] = NULL;
+		close(fd[device_id]);
+		fd[device_id] = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Configure a channel of a device, the driver keeps the configuration and
+ * restores it whenever the channel is reset.
+ */
+static int xdma_config_chan(int device_id, uint32_t chan,
+			    enum xdma_direction dir, bool reset)
+{
+	struct xdma_chan_cfg config;
+
+	if (chan == XDMA_NO_CHAN) {
+		return 0;
+	}
+
+	config.chan = chan;
+	config.dir = dir;
+	config.coalesc = XDMA_DEF_COALESC;
+	config.delay = XDMA_DEF_DELAY;
+	config.reset = reset;
+	config.reserved = 0;
+	return ioctl(fd[device_id], XDMA_DEVICE_CONTROL, &config);
+}
+
+/* Map and configure a device on its first use, so processes only pay for
+ * the devices they touch. Channels that still have the default
+ * configuration are left alone.
+ */
+static int xdma_use_device(int device_id)
+{
+	const struct xdma_dev *dev;
+
+	if ((device_id < 0) || (device_id >= num_of_devices)) {
+		return xdma_fail_code(device_id, XDMA_ERR_NO_DEVICE, ENODEV,
+				      "invalid device ID");
+	}
+
+	if (ready[device_id]) {
+		return 0;
+	}
+
+	if (xdma_open_device(device_id) < 0) {
+		return -1;
+	}
+
+	dev = &xdma_devices[device_id];
+	if (!(dev->flags & XDMA_DEV_RX_DEFAULT) &&
+	    (xdma_config_chan(device_id, dev->rx_chan,
+			      XDMA_DEV_TO_MEM, false) < 0)) {
+		return xdma_fail(device_id, "ioctl config dst (rx) chan");
+	}
+
+	if (!(dev->flags & XDMA_DEV_TX_DEFAULT) &&
+	    (xdma_config_chan(device_id, dev->tx_chan,
+			      XDMA_MEM_TO_DEV, false) < 0)) {
+		return xdma_fail(device_id, "ioctl config src (tx) chan");
 	}
 
-	/* mmap the file to get access to the DMA memory area.
-	 */
-	map = mmap(0, FILESIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (map == MAP_FAILED) {
-		close(fd);
-		perror("Error mmapping the file");
-		return EXIT_FAILURE;
+	ready[device_id] = true;
+
+	return 0;
+}
+
+/* Learn about all devices with one ioctl on the first node. The devices
+ * are mapped lazily by xdma_use_device().
+ */
+int xdma_init(void)
+{
+	struct xdma_info info;
+	char path[32];
+	int i;
+
+	for (i = 0; i < MAX_DEVICES; i++) {
+		fd[i] = -1;
+		map[i] = NULL;
+		wc_map[i] = NULL;
+		ring[i] = NULL;
+		ready[i] = false;
+		memset(&calib[i], 0, sizeof(calib[i]));
+		memset(&cur_qos[i], 0, sizeof(cur_qos[i]));
+		cur_qos[i].prio = XDMA_PRIO_NORMAL;	// driver defaults
+		cur_qos[i].weight = 1;
+		align_mask[i] = XDMA_BLOCK - 1;
 	}
 
 	xdma_alloc_reset();
 
-	num_of_devices = xdma_num_of_devices();
+	snprintf(path, sizeof(path), FILEPATH, 0);
+
+	fd[0] = open(path, O_RDWR);
+	if (fd[0] == -1) {
+		return xdma_fail(0, "opening device file");
+	}
+
+	// drivers of an older ABI do not know XDMA_GET_INFO
+	if ((ioctl(fd[0], XDMA_GET_INFO, &info) < 0) ||
+	    (info.abi_version != XDMA_ABI_VERSION)) {
+		close(fd[0]);
+		fd[0] = -1;
+		return xdma_fail_code(0, XDMA_ERR_ABI, EPROTO,
+				      "driver ioctl ABI version mismatch");
+	}
+
+	num_of_devices = info.num_devices;
 	if (num_of_devices <= 0) {
-		perror("Error no DMA devices found");
-		return EXIT_FAILURE;
+		close(fd[0]);
+		fd[0] = -1;
+		return xdma_fail_code(-1, XDMA_ERR_NO_DEVICE, ENODEV,
+				      "no DMA devices found");
 	}
 
 	for (i = 0; i < MAX_DEVICES; i++) {
-		xdma_devices[i].tx_chan = (u32) NULL;
-		xdma_devices[i].tx_cmp = (u32) NULL;
-		xdma_devices[i].rx_chan = (u32) NULL;
-		xdma_devices[i].rx_cmp = (u32) NULL;
-		xdma_devices[i].device_id = i;
-
 		if (i < num_of_devices) {
-			if (ioctl(fd, XDMA_GET_DEV_INFO, &xdma_devices[i]) < 0) {
-				perror("Error ioctl getting device info");
-				return EXIT_FAILURE;
-			}
+			xdma_devices[i] = info.devs[i];
+			xdma_init_align(i, &xdma_devices[i]);
+		} else {
+			memset(&xdma_devices[i], 0, sizeof(xdma_devices[i]));
+			xdma_devices[i].device_id = i;
+			xdma_devices[i].tx_chan = XDMA_NO_CHAN;
+			xdma_devices[i].rx_chan = XDMA_NO_CHAN;
+			xdma_devices[i].mem_chan = XDMA_NO_CHAN;
+		}
+	}
 
-			dst_config.chan = xdma_devices[i].rx_chan;
-			dst_config.dir = XDMA_DEV_TO_MEM;
-			dst_config.coalesc = 1;
-			dst_config.delay = 0;
-			dst_config.reset = 0;
-			if (ioctl(fd, XDMA_DEVICE_CONTROL, &dst_config) < 0) {
-				perror("Error ioctl config dst (rx) chan");
-				return EXIT_FAILURE;
-			}
+	xdma_calib_load();
 
-			src_config.chan = xdma_devices[i].tx_chan;
-			src_config.dir = XDMA_MEM_TO_DEV;
-			src_config.coalesc = 1;
-			src_config.delay = 0;
-			src_config.reset = 0;
-			if (ioctl(fd, XDMA_DEVICE_CONTROL, &src_config) < 0) {
-				perror("Error ioctl config src (tx) chan");
-				return EXIT_FAILURE;
-			}
-		}
+	if (getenv("XDMA_TRACE") &&
+	    (xdma_trace_start(getenv("XDMA_TRACE")) < 0)) {
+		return -1;
 	}
-	return EXIT_SUCCESS;
+
+	return 0;
 }
 
 int xdma_exit(void)
 {
-	if (munmap(map, FILESIZE) == -1) {
-		perror("Error un-mmapping the file");
-		return EXIT_FAILURE;
+	int i;
+	int ret = 0;
+
+	if (xdma_trace_stop() < 0) {
+		ret = -1;
+	}
+
+	for (i = 0; i < MAX_DEVICES; i++) {
+		if (fd[i] == -1) {
+			continue;
+		}
+
+		ready[i] = false;
+
+		if (ring[i] && (munmap(ring[i], sizeof(struct xdma_ring)) == -1)) {
+			ret = xdma_fail(i, "un-mmapping the completion ring");
+		}
+
+		if (wc_map[i] && (munmap(wc_map[i], FILESIZE) == -1)) {
+			ret = xdma_fail(i, "un-mmapping the write-combined "
+					"file");
+		}
+
+		if (map[i] && (munmap(map[i], FILESIZE) == -1)) {
+			ret = xdma_fail(i, "un-mmapping the file");
+		}
+
+		/* Un-mmaping doesn't close the file.
+		 */
+		close(fd[i]);
+		fd[i] = -1;
+		map[i] = NULL;
+		wc_map[i] = NULL;
+		ring[i] = NULL;
 	}
 
-	/* Un-mmaping doesn't close the file.
-	 */
-	close(fd);
-	return EXIT_SUCCESS;
+	return ret;
+}
+
+/* Query driver for the version of its ioctl ABI.
+ */
+int xdma_abi_version(void)
+{
+	uint32_t version = 0;
+	if (ioctl(fd[0], XDMA_GET_ABI_VERSION, &version) < 0) {
+		return xdma_fail(-1, "ioctl getting ABI version");
+	}
+	return (int)version;
 }
 
 /* Query driver for number of devices.
@@ -143,122 +654,1688 @@ int xdma_exit(void)
 int xdma_num_of_devices(void)
 {
 	int num_devices = 0;
-	if (ioctl(fd, XDMA_GET_NUM_DEVICES, &num_devices) < 0) {
-		perror("Error ioctl getting device num");
-		return -1;
+	if (ioctl(fd[0], XDMA_GET_NUM_DEVICES, &num_devices) < 0) {
+		return xdma_fail(-1, "ioctl getting device num");
 	}
 	return num_devices;
 }
 
-/* Perform DMA transaction
- *
- * To perform a one-way transaction set the unused directions pointer to NULL
- * or length to zero.
+/* Stores through 'wc_map' may still sit in the write-combining buffers of
+ * the CPU. Drain them before an ioctl hands the buffer to an engine, which
+ * reads the DMA memory directly.
  */
-int xdma_perform_transaction(int device_id, enum xdma_wait wait,
-			     uint32_t * src_ptr, uint32_t src_length,
-			     uint32_t * dst_ptr, uint32_t dst_length)
+static inline void xdma_wc_flush(void)
+{
+	__sync_synchronize();
+}
+
+static void xdma_drop_prepared(int device_id, int32_t cookie)
+{
+	struct xdma_cancel cancel;
+	const int err = errno;
+
+	cancel.cookie = cookie;
+	cancel.flags = 0;
+	ioctl(fd[device_id], XDMA_CANCEL, &cancel);
+
+	errno = err;
+}
+
+/* Prepare and start the transfers of a transaction, waiting as asked to.
+ */
+static int xdma_transaction(int device_id, enum xdma_wait wait,
+			    uint32_t * src_ptr, uint32_t src_length,
+			    uint32_t * dst_ptr, uint32_t dst_length,
+			    int32_t * src_cookie, int32_t * dst_cookie)
 {
 	int ret = 0;
 	struct xdma_buf_info dst_buf;
 	struct xdma_buf_info src_buf;
 	struct xdma_transfer dst_trans;
 	struct xdma_transfer src_trans;
+	uint32_t src_offset;
+	uint32_t dst_offset;
 	const bool src_used = ((src_ptr != NULL) && (src_length != 0));
 	const bool dst_used = ((dst_ptr != NULL) && (dst_length != 0));
 
-	if (device_id >= num_of_devices) {
-		perror("Error invalid device ID");
+	if (xdma_use_device(device_id) < 0) {
 		return -1;
 	}
 
+	src_offset = src_used ? xdma_calc_offset(device_id, src_ptr) : 0;
+	dst_offset = dst_used ? xdma_calc_offset(device_id, dst_ptr) : 0;
+	if ((src_offset == UINT32_MAX) || (dst_offset == UINT32_MAX)) {
+		return xdma_fail_code(device_id, XDMA_ERR_OFFSET, EINVAL,
+				      "buffer not in device memory");
+	}
+
 	if (src_used) {
+		xdma_wc_flush();
+
 		src_buf.chan = xdma_devices[device_id].tx_chan;
-		src_buf.completion = xdma_devices[device_id].tx_cmp;
 		src_buf.cookie = 0;
-		src_buf.buf_offset = (u32) xdma_calc_offset(src_ptr);
-		src_buf.buf_size = (u32) (src_length * sizeof(src_ptr[0]));
+		src_buf.buf_offset = src_offset;
+		src_buf.buf_size = src_length * sizeof(src_ptr[0]);
 		src_buf.dir = XDMA_MEM_TO_DEV;
-		ret = (int)ioctl(fd, XDMA_PREP_BUF, &src_buf);
+		src_buf.flags = (wait & XDMA_RETRY) ? XDMA_BUF_RETRY : 0;
+		ret = (int)ioctl(fd[device_id], XDMA_PREP_BUF, &src_buf);
 		if (ret < 0) {
-			perror("Error ioctl set src (tx) buf");
-			return ret;
+			return xdma_fail(device_id, "ioctl set src (tx) buf");
+		}
+
+		if (src_cookie) {
+			*src_cookie = src_buf.cookie;
 		}
 	}
 
 	if (dst_used) {
 		dst_buf.chan = xdma_devices[device_id].rx_chan;
-		dst_buf.completion = xdma_devices[device_id].rx_cmp;
 		dst_buf.cookie = 0;
-		dst_buf.buf_offset = (u32) xdma_calc_offset(dst_ptr);
-		dst_buf.buf_size = (u32) (dst_length * sizeof(dst_ptr[0]));
+		dst_buf.buf_offset = dst_offset;
+		dst_buf.buf_size = dst_length * sizeof(dst_ptr[0]);
 		dst_buf.dir = XDMA_DEV_TO_MEM;
-		ret = (int)ioctl(fd, XDMA_PREP_BUF, &dst_buf);
+		dst_buf.flags = (wait & XDMA_RETRY) ? XDMA_BUF_RETRY : 0;
+		ret = (int)ioctl(fd[device_id], XDMA_PREP_BUF, &dst_buf);
 		if (ret < 0) {
-			perror("Error ioctl set dst (rx) buf");
-			return ret;
+			xdma_fail(device_id, "ioctl set dst (rx) buf");
+			if (src_used) {
+				// don't leave the prepared half behind
+				xdma_drop_prepared(device_id, src_buf.cookie);
+			}
+			return -1;
+		}
+
+		if (dst_cookie) {
+			*dst_cookie = dst_buf.cookie;
 		}
 	}
 
 	if (src_used) {
 		src_trans.chan = xdma_devices[device_id].tx_chan;
-		src_trans.completion = xdma_devices[device_id].tx_cmp;
 		src_trans.cookie = src_buf.cookie;
 		src_trans.wait = (0 != (wait & XDMA_WAIT_SRC));
-		ret = (int)ioctl(fd, XDMA_START_TRANSFER, &src_trans);
+		ret = (int)ioctl(fd[device_id], XDMA_START_TRANSFER, &src_trans);
 		if (ret < 0) {
-			perror("Error ioctl start src (tx) trans");
-			return ret;
+			return xdma_fail(device_id,
+					 "ioctl start src (tx) trans");
 		}
 	}
 
 	if (dst_used) {
 		dst_trans.chan = xdma_devices[device_id].rx_chan;
-		dst_trans.completion = xdma_devices[device_id].rx_cmp;
 		dst_trans.cookie = dst_buf.cookie;
 		dst_trans.wait = (0 != (wait & XDMA_WAIT_DST));
-		ret = (int)ioctl(fd, XDMA_START_TRANSFER, &dst_trans);
+		ret = (int)ioctl(fd[device_id], XDMA_START_TRANSFER, &dst_trans);
 		if (ret < 0) {
-			perror("Error ioctl start dst (rx) trans");
-			return ret;
+			return xdma_fail(device_id,
+					 "ioctl start dst (rx) trans");
 		}
 	}
 
 	return ret;
 }
 
-int xdma_stop_transaction(int device_id,
-			  uint32_t * src_ptr, uint32_t src_length,
-			  uint32_t * dst_ptr, uint32_t dst_length)
+/* Perform DMA transaction
+ *
+ * To perform a one-way transaction set the unused directions pointer to NULL
+ * or length to zero.
+ *
+ * A transaction that stalls is aborted by resetting the channel, the wait
+ * then fails with errno ETIMEDOUT. With XDMA_RETRY the driver submits the
+ * buffers again after a reset instead, only use it when repeating the
+ * transfer is harmless.
+ */
+int xdma_perform_transaction(int device_id, enum xdma_wait wait,
+			     uint32_t * src_ptr, uint32_t src_length,
+			     uint32_t * dst_ptr, uint32_t dst_length)
 {
-	int ret = 0;
-	struct xdma_transfer dst_trans;
-	struct xdma_transfer src_trans;
-	const bool src_used = ((src_ptr != NULL) && (src_length != 0));
+	const uint64_t start = trace ? xdma_now() : 0;
+	int ret;
+
+	ret = xdma_transaction(device_id, wait, src_ptr, src_length,
+			       dst_ptr, dst_length, NULL, NULL);
+
+	if (trace) {
+		xdma_trace_put(XDMA_TRACE_PERFORM, device_id, wait, start, ret,
+			       src_ptr, src_length * sizeof(src_ptr[0]),
+			       dst_ptr, dst_length * sizeof(dst_ptr[0]));
+	}
+
+	return ret;
+}
+
+/* Start a DMA transaction without waiting
+ *
+ * Like xdma_perform_transaction() with XDMA_WAIT_NONE, the cookies of the
+ * transfers are returned for matching their records in the completion ring.
+ */
+int xdma_submit_transaction(int device_id,
+			    uint32_t * src_ptr, uint32_t src_length,
+			    uint32_t * dst_ptr, uint32_t dst_length,
+			    int32_t * src_cookie, int32_t * dst_cookie)
+{
+	const uint64_t start = trace ? xdma_now() : 0;
+	int ret;
+
+	ret = xdma_transaction(device_id, XDMA_WAIT_NONE, src_ptr, src_length,
+			       dst_ptr, dst_length, src_cookie, dst_cookie);
+
+	if (trace) {
+		xdma_trace_put(XDMA_TRACE_SUBMIT, device_id, XDMA_WAIT_NONE,
+			       start, ret,
+			       src_ptr, src_length * sizeof(src_ptr[0]),
+			       dst_ptr, dst_length * sizeof(dst_ptr[0]));
+	}
+
+	return ret;
+}
+
+/* Receive a packet of unknown length
+ *
+ * Posts 'dst_ptr' as a DEV_TO_MEM transfer of up to 'dst_length' words and
+ * waits for it. '*received' is set to the bytes that landed, which is less
+ * than the buffer if the FPGA ended the packet early, so no length header
+ * is needed. Engine drivers that do not report the residue always give the
+ * full size.
+ */
+int xdma_perform_receive(int device_id, uint32_t * dst_ptr,
+			 uint32_t dst_length, uint64_t * received)
+{
+	struct xdma_buf_info buf;
+	struct xdma_transfer trans;
+	uint32_t offset;
+
+	if (xdma_use_device(device_id) < 0) {
+		return -1;
+	}
+
+	offset = xdma_calc_offset(device_id, dst_ptr);
+	if (offset == UINT32_MAX) {
+		return xdma_fail_code(device_id, XDMA_ERR_OFFSET, EINVAL,
+				      "buffer not in device memory");
+	}
+
+	buf.chan = xdma_devices[device_id].rx_chan;
+	buf.cookie = 0;
+	buf.buf_offset = offset;
+	buf.buf_size = dst_length * sizeof(dst_ptr[0]);
+	buf.dir = XDMA_DEV_TO_MEM;
+	buf.flags = 0;
+	if (ioctl(fd[device_id], XDMA_PREP_BUF, &buf) < 0) {
+		return xdma_fail(device_id, "ioctl set dst (rx) buf");
+	}
+
+	// start and wait in one call, so the length can't be missed
+	memset(&trans, 0, sizeof(trans));
+	trans.chan = buf.chan;
+	trans.cookie = buf.cookie;
+	trans.wait = 1;
+	if (ioctl(fd[device_id], XDMA_START_TRANSFER, &trans) < 0) {
+		return xdma_fail(device_id, "ioctl start dst (rx) trans");
+	}
+
+	if (received) {
+		*received = trans.bytes;
+	}
+
+	return 0;
+}
+
+/* Limit the transfers this process may have pending per channel of a
+ * device, 64 by default. Beyond that, starting transactions without
+ * waiting fails with errno EAGAIN until xdma_wait_space() returns.
+ */
+int xdma_set_credits(int device_id, uint32_t credits)
+{
+	if (xdma_use_device(device_id) < 0) {
+		return -1;
+	}
+
+	if (ioctl(fd[device_id], XDMA_SET_CREDITS, &credits) < 0) {
+		return xdma_fail(device_id, "ioctl set credits");
+	}
+
+	return 0;
+}
+
+/* Wait until a transaction can be started again on the channels selected
+ * by 'which' (XDMA_WAIT_SRC, XDMA_WAIT_DST or both), or for 'timeout_ms'.
+ * Fails with errno ETIMEDOUT if there is still no space.
+ */
+int xdma_wait_space(int device_id, enum xdma_wait which, uint32_t timeout_ms)
+{
+	struct xdma_space space;
+
+	if (xdma_use_device(device_id) < 0) {
+		return -1;
+	}
+
+	space.timeout_ms = timeout_ms;
+
+	if ((which & XDMA_WAIT_SRC) &&
+	    (xdma_devices[device_id].tx_chan != XDMA_NO_CHAN)) {
+		space.chan = xdma_devices[device_id].tx_chan;
+		if (ioctl(fd[device_id], XDMA_WAIT_SPACE, &space) < 0) {
+			return xdma_fail(device_id, "ioctl wait space");
+		}
+	}
+
+	if ((which & XDMA_WAIT_DST) &&
+	    (xdma_devices[device_id].rx_chan != XDMA_NO_CHAN)) {
+		space.chan = xdma_devices[device_id].rx_chan;
+		if (ioctl(fd[device_id], XDMA_WAIT_SPACE, &space) < 0) {
+			return xdma_fail(device_id, "ioctl wait space");
+		}
+	}
+
+	return 0;
+}
+
+/* Cap the throughput of the channels selected by 'which' (XDMA_WAIT_SRC,
+ * XDMA_WAIT_DST or both) at 'bytes_per_sec', 0 removes the cap. The cap
+ * holds for every process using the channel, and trades peak bandwidth for
+ * power.
+ */
+int xdma_set_rate(int device_id, enum xdma_wait which, uint64_t bytes_per_sec)
+{
+	struct xdma_rate rate;
+
+	if (xdma_use_device(device_id) < 0) {
+		return -1;
+	}
+
+	memset(&rate, 0, sizeof(rate));
+	rate.bytes_per_sec = bytes_per_sec;
+
+	if ((which & XDMA_WAIT_SRC) &&
+	    (xdma_devices[device_id].tx_chan != XDMA_NO_CHAN)) {
+		rate.chan = xdma_devices[device_id].tx_chan;
+		if (ioctl(fd[device_id], XDMA_SET_RATE, &rate) < 0) {
+			return xdma_fail(device_id, "ioctl set rate");
+		}
+	}
+
+	if ((which & XDMA_WAIT_DST) &&
+	    (xdma_devices[device_id].rx_chan != XDMA_NO_CHAN)) {
+		rate.chan = xdma_devices[device_id].rx_chan;
+		if (ioctl(fd[device_id], XDMA_SET_RATE, &rate) < 0) {
+			return xdma_fail(device_id, "ioctl set rate");
+		}
+	}
+
+	return 0;
+}
+
+/* Read the activity of the tx (XDMA_WAIT_SRC) or rx (XDMA_WAIT_DST)
+ * channel of a device: the bytes it moved and how long it was awake. Read
+ * before and after a run, together with the power the board drew, they
+ * give the energy per byte.
+ */
+int xdma_get_chan_stats(int device_id, enum xdma_wait which,
+			struct xdma_chan_stats *stats)
+{
+	if (xdma_use_device(device_id) < 0) {
+		return -1;
+	}
+
+	memset(stats, 0, sizeof(*stats));
+	if (which == XDMA_WAIT_SRC) {
+		stats->chan = xdma_devices[device_id].tx_chan;
+	} else if (which == XDMA_WAIT_DST) {
+		stats->chan = xdma_devices[device_id].rx_chan;
+	} else {
+		return xdma_fail_code(device_id, XDMA_ERR_INVALID, EINVAL,
+				      "select one channel");
+	}
+
+	if (ioctl(fd[device_id], XDMA_GET_CHAN_STATS, stats) < 0) {
+		return xdma_fail(device_id, "ioctl get channel stats");
+	}
+
+	return 0;
+}
+
+/* Cancel one transfer, identified by the cookie xdma_submit_transaction()
+ * returned
+ *
+ * The other transfers on the channel are not affected. Descriptors of the
+ * transfer that are already on the engine still run to the end, unless
+ * 'engine' is set. Then they are terminated as long as no other transfer
+ * has descriptors there, else the call fails with errno EBUSY.
+ */
+int xdma_cancel(int device_id, int32_t cookie, int engine)
+{
+	struct xdma_cancel cancel;
+
+	if (xdma_use_device(device_id) < 0) {
+		return -1;
+	}
+
+	cancel.cookie = cookie;
+	cancel.flags = engine ? XDMA_CANCEL_ENGINE : 0;
+	if (ioctl(fd[device_id], XDMA_CANCEL, &cancel) < 0) {
+		return xdma_fail(device_id, "ioctl cancel trans");
+	}
+
+	return 0;
+}
+
+/* Map the completion ring of a device
+ *
+ * From then on the driver posts a record for every transaction of this
+ * process on the device, which xdma_reap() reads without a system call.
+ */
+int xdma_ring_init(int device_id)
+{
+	void *ptr;
+
+	if (xdma_use_device(device_id) < 0) {
+		return -1;
+	}
+
+	if (ring[device_id]) {
+		return 0;
+	}
+
+	ptr = mmap(0, sizeof(struct xdma_ring), PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd[device_id], XDMA_MMAP_RING);
+	if (ptr == MAP_FAILED) {
+		return xdma_fail(device_id, "mmapping the completion ring");
+	}
+
+	ring[device_id] = ptr;
+	return 0;
+}
+
+/* Reap up to 'max' completion records of a device into 'done'
+ *
+ * Returns the number of records, or -1 if the ring is not mapped. The ring
+ * only uses loads and stores shared with the driver, so this never enters
+ * the kernel.
+ */
+int xdma_reap(int device_id, struct xdma_completion *done, int max)
+{
+	struct xdma_ring *r;
+	struct xdma_ring_entry *entry;
+	uint32_t head, tail;
+	int n = 0;
+
+	if ((device_id < 0) || (device_id >= num_of_devices) ||
+	    !ring[device_id]) {
+		return xdma_fail_code(device_id, XDMA_ERR_INVALID, EINVAL,
+				      "no completion ring on device");
+	}
+	r = ring[device_id];
+
+	tail = r->tail;
+	head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+	while ((tail != head) && (n < max)) {
+		entry = &r->entries[tail & (XDMA_RING_ENTRIES - 1)];
+		done[n].cookie = entry->cookie;
+		done[n].status = entry->status;
+		done[n].bytes = entry->bytes;
+		done[n].timestamp = entry->timestamp;
+		tail++;
+		n++;
+	}
+
+	__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+	return n;
+}
+
+/* Records the driver dropped because the ring of a device was full.
+ */
+uint32_t xdma_ring_dropped(int device_id)
+{
+	if ((device_id < 0) || (device_id >= num_of_devices) ||
+	    !ring[device_id]) {
+		return 0;
+	}
+
+	return ring[device_id]->dropped;
+}
+
+/* Memory device of a buffer, or -1 if it is in none of them. */
+static int xdma_find_mem_device(void *ptr, uint32_t * offset)
+{
+	int i;
+
+	for (i = 0; i < num_of_devices; i++) {
+		*offset = xdma_calc_offset(i, ptr);
+		if (*offset != UINT32_MAX) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/* Perform a chain of DMA transfers
+ *
+ * All hops are handed to the driver at once. Hops with 'after' set to an
+ * earlier hop are started by the driver when that hop completes, so the
+ * output of one engine can be fed to the next (rx on one device, then tx of
+ * the same buffer on another) without waking this process. If 'wait' is set
+ * the call returns once all hops are done, and fails if any of them did.
+ */
+int xdma_perform_chain(struct xdma_hop *hops, int num_hops, int wait)
+{
+	struct xdma_chain chain;
+	struct xdma_stage *stage;
+	uint32_t *ptr;
+	uint32_t offset;
+	int mem_device;
+	int device_id;
+	int i;
+
+	if ((num_hops <= 0) || (num_hops > XDMA_MAX_STAGES)) {
+		return xdma_fail_code(-1, XDMA_ERR_INVALID, EINVAL,
+				      "invalid number of hops");
+	}
+
+	memset(&chain, 0, sizeof(chain));
+	chain.num_stages = num_hops;
+	chain.flags = wait ? XDMA_CHAIN_WAIT : 0;
+
+	for (i = 0; i < num_hops; i++) {
+		device_id = hops[i].device_id;
+		ptr = hops[i].src_ptr ? hops[i].src_ptr : hops[i].dst_ptr;
+
+		if (xdma_use_device(device_id) < 0) {
+			return -1;
+		}
+
+		mem_device = xdma_find_mem_device(ptr, &offset);
+		if (mem_device < 0) {
+			return xdma_fail_code(device_id, XDMA_ERR_OFFSET,
+					      EINVAL,
+					      "buffer not in device memory");
+		}
+
+		stage = &chain.stages[i];
+		stage->chan = hops[i].src_ptr ?
+		    xdma_devices[device_id].tx_chan :
+		    xdma_devices[device_id].rx_chan;
+		stage->mem_device = mem_device;
+		stage->buf_offset = offset;
+		stage->buf_size = hops[i].length * sizeof(ptr[0]);
+		stage->after = hops[i].after;
+	}
+
+	xdma_wc_flush();
+
+	// the driver waits for the hops, a hop may end before we could
+	device_id = hops[0].device_id;
+	if (ioctl(fd[device_id], XDMA_PREP_CHAIN, &chain) < 0) {
+		return xdma_fail(device_id, "ioctl prep chain");
+	}
+
+	return 0;
+}
+
+/* Prepare and start one transfer over several buffers of a device.
+ */
+static int xdma_perform_sg(int device_id, enum xdma_wait wait, bool tx,
+			   const struct xdma_iov *iov, int iovcnt)
+{
+	struct xdma_sg_info info;
+	struct xdma_transfer trans;
+	uint32_t offset;
+	int i;
+
+	if (xdma_use_device(device_id) < 0) {
+		return -1;
+	}
+
+	if ((iovcnt <= 0) || (iovcnt > XDMA_MAX_SEGS)) {
+		return xdma_fail_code(device_id, XDMA_ERR_INVALID, EINVAL,
+				      "invalid number of buffers");
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.chan = tx ? xdma_devices[device_id].tx_chan :
+	    xdma_devices[device_id].rx_chan;
+	info.nsegs = iovcnt;
+	info.flags = (wait & XDMA_RETRY) ? XDMA_BUF_RETRY : 0;
+
+	for (i = 0; i < iovcnt; i++) {
+		offset = xdma_calc_offset(device_id, iov[i].ptr);
+		if (offset == UINT32_MAX) {
+			return xdma_fail_code(device_id, XDMA_ERR_OFFSET,
+					      EINVAL,
+					      "buffer not in device memory");
+		}
+
+		info.segs[i].offset = offset;
+		info.segs[i].size = iov[i].length * sizeof(iov[i].ptr[0]);
+	}
+
+	if (tx) {
+		xdma_wc_flush();
+	}
+
+	if (ioctl(fd[device_id], XDMA_PREP_SG, &info) < 0) {
+		return xdma_fail(device_id, "ioctl prep sg");
+	}
+
+	trans.chan = info.chan;
+	trans.cookie = info.cookie;
+	trans.wait = (0 != (wait & (tx ? XDMA_WAIT_SRC : XDMA_WAIT_DST)));
+	trans.reserved = 0;
+	if (ioctl(fd[device_id], XDMA_START_TRANSFER, &trans) < 0) {
+		return xdma_fail(device_id, "ioctl start sg trans");
+	}
+
+	return 0;
+}
+
+/* Perform a gather transfer
+ *
+ * Sends the buffers in 'iov' one after the other as a single MEM_TO_DEV
+ * transfer, for example a header and a payload that live apart. Waits if
+ * 'wait' includes XDMA_WAIT_SRC.
+ */
+int xdma_perform_gather(int device_id, enum xdma_wait wait,
+			const struct xdma_iov *iov, int iovcnt)
+{
+	return xdma_perform_sg(device_id, wait, true, iov, iovcnt);
+}
+
+/* Perform a scatter transfer
+ *
+ * Receives one DEV_TO_MEM transfer into the buffers in 'iov', filling each
+ * before the next. Waits if 'wait' includes XDMA_WAIT_DST.
+ */
+int xdma_perform_scatter(int device_id, enum xdma_wait wait,
+			 const struct xdma_iov *iov, int iovcnt)
+{
+	return xdma_perform_sg(device_id, wait, false, iov, iovcnt);
+}
+
+/* Query the engine of a device, one of enum xdma_engine.
+ */
+int xdma_device_engine(int device_id)
+{
+	if ((device_id < 0) || (device_id >= MAX_DEVICES)) {
+		return xdma_fail_code(device_id, XDMA_ERR_NO_DEVICE, ENODEV,
+				      "invalid device ID");
+	}
+
+	return (int)xdma_devices[device_id].engine;
+}
+
+/* Copy with the CDMA engine of a device
+ *
+ * Copies 'length' words from 'src_ptr' to 'dst_ptr' without the CPU, so
+ * large moves within the DMA memory don't take its memory bandwidth. Both
+ * buffers must be in the DMA memory of the device. Waits if 'wait' includes
+ * XDMA_WAIT_SRC or XDMA_WAIT_DST.
+ */
+int xdma_memcpy(int device_id, enum xdma_wait wait, uint32_t * dst_ptr,
+		uint32_t * src_ptr, uint32_t length)
+{
+	struct xdma_memcpy info;
+	struct xdma_transfer trans;
+	uint32_t src_offset, dst_offset;
+
+	if (xdma_use_device(device_id) < 0) {
+		return -1;
+	}
+
+	if (xdma_devices[device_id].mem_chan == XDMA_NO_CHAN) {
+		return xdma_fail_code(device_id, XDMA_ERR_NO_ENGINE, ENODEV,
+				      "device has no CDMA engine");
+	}
+
+	src_offset = xdma_calc_offset(device_id, src_ptr);
+	dst_offset = xdma_calc_offset(device_id, dst_ptr);
+	if ((src_offset == UINT32_MAX) || (dst_offset == UINT32_MAX)) {
+		return xdma_fail_code(device_id, XDMA_ERR_OFFSET, EINVAL,
+				      "buffer not in device memory");
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.chan = xdma_devices[device_id].mem_chan;
+	info.flags = (wait & XDMA_RETRY) ? XDMA_BUF_RETRY : 0;
+	info.src_offset = src_offset;
+	info.dst_offset = dst_offset;
+	info.size = length * sizeof(src_ptr[0]);
+
+	xdma_wc_flush();
+
+	if (ioctl(fd[device_id], XDMA_PREP_MEMCPY, &info) < 0) {
+		return xdma_fail(device_id, "ioctl prep memcpy");
+	}
+
+	trans.chan = info.chan;
+	trans.cookie = info.cookie;
+	trans.wait = (0 != (wait & XDMA_WAIT_BOTH));
+	trans.reserved = 0;
+	if (ioctl(fd[device_id], XDMA_START_TRANSFER, &trans) < 0) {
+		return xdma_fail(device_id, "ioctl start memcpy");
+	}
+
+	return 0;
+}
+
+/* Prepare and start one frame transfer of a device.
+ */
+static int xdma_perform_frame(int device_id, enum xdma_wait wait, bool tx,
+			      uint32_t * ptr, uint32_t row_length,
+			      uint32_t stride, uint32_t rows)
+{
+	struct xdma_frame info;
+	struct xdma_transfer trans;
+	uint32_t offset;
+
+	if (xdma_use_device(device_id) < 0) {
+		return -1;
+	}
+
+	offset = xdma_calc_offset(device_id, ptr);
+	if (offset == UINT32_MAX) {
+		return xdma_fail_code(device_id, XDMA_ERR_OFFSET, EINVAL,
+				      "buffer not in device memory");
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.chan = tx ? xdma_devices[device_id].tx_chan :
+	    xdma_devices[device_id].rx_chan;
+	info.flags = (wait & XDMA_RETRY) ? XDMA_BUF_RETRY : 0;
+	info.rows = rows;
+	info.offset = offset;
+	info.row_size = row_length * sizeof(ptr[0]);
+	info.stride = stride * sizeof(ptr[0]);
+
+	if (tx) {
+		xdma_wc_flush();
+	}
+
+	if (ioctl(fd[device_id], XDMA_PREP_FRAME, &info) < 0) {
+		return xdma_fail(device_id, "ioctl prep frame");
+	}
+
+	trans.chan = info.chan;
+	trans.cookie = info.cookie;
+	trans.wait = (0 != (wait & (tx ? XDMA_WAIT_SRC : XDMA_WAIT_DST)));
+	trans.reserved = 0;
+	if (ioctl(fd[device_id], XDMA_START_TRANSFER, &trans) < 0) {
+		return xdma_fail(device_id, "ioctl start frame trans");
+	}
+
+	return 0;
+}
+
+/* Send a tile of a larger image
+ *
+ * Sends 'rows' rows of 'row_length' words, the first at 'ptr' and each
+ * 'stride' words after the one before, as one transfer without copying
+ * them next to each other first. Waits if 'wait' includes XDMA_WAIT_SRC.
+ */
+int xdma_send_tile(int device_id, enum xdma_wait wait, uint32_t * ptr,
+		   uint32_t row_length, uint32_t stride, uint32_t rows)
+{
+	return xdma_perform_frame(device_id, wait, true, ptr, row_length,
+				  stride, rows);
+}
+
+/* Receive a tile of a larger image
+ *
+ * Like xdma_send_tile(), fills the rows one after the other and waits if
+ * 'wait' includes XDMA_WAIT_DST.
+ */
+int xdma_recv_tile(int device_id, enum xdma_wait wait, uint32_t * ptr,
+		   uint32_t row_length, uint32_t stride, uint32_t rows)
+{
+	return xdma_perform_frame(device_id, wait, false, ptr, row_length,
+				  stride, rows);
+}
+
+/* Start cyclic playback on the tx channel of a device
+ *
+ * Plays 'periods' periods of 'period_length' words, starting at 'ptr', over
+ * and over until xdma_stop_cyclic(), without any further CPU work. Every
+ * period posts a record with the cookie returned in 'cookie' (may be NULL)
+ * to the completion ring. Fails with errno EBUSY while the channel has
+ * transfers on the engine, and with EOPNOTSUPP if the DMA engine driver
+ * has no cyclic support.
+ */
+int xdma_start_cyclic(int device_id, uint32_t * ptr, uint32_t period_length,
+		      uint32_t periods, int32_t * cookie)
+{
+	struct xdma_cyclic info;
+	uint32_t offset;
+
+	if (xdma_use_device(device_id) < 0) {
+		return -1;
+	}
+
+	offset = xdma_calc_offset(device_id, ptr);
+	if (offset == UINT32_MAX) {
+		return xdma_fail_code(device_id, XDMA_ERR_OFFSET, EINVAL,
+				      "buffer not in device memory");
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.chan = xdma_devices[device_id].tx_chan;
+	info.periods = periods;
+	info.offset = offset;
+	info.period_size = period_length * sizeof(ptr[0]);
+
+	xdma_wc_flush();
+
+	if (ioctl(fd[device_id], XDMA_START_CYCLIC, &info) < 0) {
+		return xdma_fail(device_id, "ioctl start cyclic");
+	}
+
+	if (cookie) {
+		*cookie = info.cookie;
+	}
+
+	return 0;
+}
+
+/* Swap in a new table for cyclic playback
+ *
+ * 'ptr' holds as many periods as the table that is playing. Each period is
+ * copied over the old one right after the engine played it, so the output
+ * switches at a period boundary. xdma_wait_cyclic() reports the first
+ * period of the new table. Fails with errno EBUSY while the last swap is
+ * still in progress, and with EINVAL if fewer than XDMA_CYCLIC_MIN_SWAP
+ * periods are playing.
+ */
+int xdma_swap_cyclic(int device_id, uint32_t * ptr)
+{
+	struct xdma_cyclic_swap swap;
+	uint32_t offset;
+
+	if (xdma_use_device(device_id) < 0) {
+		return -1;
+	}
+
+	offset = xdma_calc_offset(device_id, ptr);
+	if (offset == UINT32_MAX) {
+		return xdma_fail_code(device_id, XDMA_ERR_OFFSET, EINVAL,
+				      "buffer not in device memory");
+	}
+
+	memset(&swap, 0, sizeof(swap));
+	swap.chan = xdma_devices[device_id].tx_chan;
+	swap.offset = offset;
+
+	xdma_wc_flush();
+
+	if (ioctl(fd[device_id], XDMA_SWAP_CYCLIC, &swap) < 0) {
+		return xdma_fail(device_id, "ioctl swap cyclic");
+	}
+
+	return 0;
+}
+
+/* Wait until more than 'period' periods were played, or for 'timeout_ms'
+ *
+ * Returns the periods played so far in 'played' and the first period of the
+ * last swapped in table, or 0 while that swap is in progress, in 'swapped'.
+ * Either may be NULL. A 'timeout_ms' of 0 only reads them. Fails with errno
+ * ETIMEDOUT if not enough periods were played in time.
+ */
+int xdma_wait_cyclic(int device_id, uint64_t period, uint32_t timeout_ms,
+		     uint64_t * played, uint64_t * swapped)
+{
+	struct xdma_cyclic_status st;
+	int ret;
+
+	if (xdma_use_device(device_id) < 0) {
+		return -1;
+	}
+
+	memset(&st, 0, sizeof(st));
+	st.chan = xdma_devices[device_id].tx_chan;
+	st.timeout_ms = timeout_ms;
+	st.period = period;
+
+	ret = ioctl(fd[device_id], XDMA_WAIT_CYCLIC, &st);
+	if ((ret < 0) && (errno != ETIMEDOUT)) {
+		return xdma_fail(device_id, "ioctl wait cyclic");
+	}
+
+	if (played) {
+		*played = st.played;
+	}
+	if (swapped) {
+		*swapped = st.swapped;
+	}
+
+	return (ret < 0) ? xdma_fail(device_id, "ioctl wait cyclic") : 0;
+}
+
+/* Stop cyclic playback on the tx channel of a device. Transfers started on
+ * the channel meanwhile run after it.
+ */
+int xdma_stop_cyclic(int device_id)
+{
+	uint32_t chan;
+
+	if (xdma_use_device(device_id) < 0) {
+		return -1;
+	}
+
+	chan = xdma_devices[device_id].tx_chan;
+	if (ioctl(fd[device_id], XDMA_STOP_CYCLIC, &chan) < 0) {
+		return xdma_fail(device_id, "ioctl stop cyclic");
+	}
+
+	return 0;
+}
+
+/* Export a region of the DMA memory of a device as a dma-buf
+ *
+ * Returns a dma-buf file descriptor that V4L2, DRM and other drivers can
+ * import, so they read or write the buffer without a copy. 'ptr' and 'size'
+ * (in bytes) must be page aligned. Close the descriptor when done.
+ */
+int xdma_export_dmabuf(int device_id, void *ptr, size_t size)
+{
+	struct xdma_export exp;
+	uint32_t offset;
+
+	if (xdma_use_device(device_id) < 0) {
+		return -1;
+	}
+
+	offset = xdma_calc_offset(device_id, ptr);
+	if (offset == UINT32_MAX) {
+		return xdma_fail_code(device_id, XDMA_ERR_OFFSET, EINVAL,
+				      "buffer not in device memory");
+	}
+
+	memset(&exp, 0, sizeof(exp));
+	exp.offset = offset;
+	exp.size = size;
+	exp.flags = XDMA_EXPORT_CLOEXEC;
+	if (ioctl(fd[device_id], XDMA_EXPORT, &exp) < 0) {
+		return xdma_fail(device_id, "ioctl export dma-buf");
+	}
+
+	return exp.fd;
+}
+
+/* Prepare and start one transfer on a dma-buf of another driver.
+ */
+static int xdma_perform_dmabuf(int device_id, enum xdma_wait wait, bool tx,
+			       int dmabuf_fd, uint64_t offset, uint64_t size)
+{
+	struct xdma_dmabuf_info info;
+	struct xdma_transfer trans;
+
+	if (xdma_use_device(device_id) < 0) {
+		return -1;
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.chan = tx ? xdma_devices[device_id].tx_chan :
+	    xdma_devices[device_id].rx_chan;
+	info.fd = dmabuf_fd;
+	info.flags = (wait & XDMA_RETRY) ? XDMA_BUF_RETRY : 0;
+	info.offset = offset;
+	info.size = size;
+	if (ioctl(fd[device_id], XDMA_PREP_DMABUF, &info) < 0) {
+		return xdma_fail(device_id, "ioctl prep dma-buf");
+	}
+
+	trans.chan = info.chan;
+	trans.cookie = info.cookie;
+	trans.wait = (0 != (wait & (tx ? XDMA_WAIT_SRC : XDMA_WAIT_DST)));
+	trans.reserved = 0;
+	if (ioctl(fd[device_id], XDMA_START_TRANSFER, &trans) < 0) {
+		return xdma_fail(device_id, "ioctl start dma-buf trans");
+	}
+
+	return 0;
+}
+
+/* Send a dma-buf of another driver, for example a V4L2 capture buffer
+ *
+ * 'offset' and 'size' are in bytes, a 'size' of zero sends the rest of the
+ * buffer. Waits if 'wait' includes XDMA_WAIT_SRC.
+ */
+int xdma_send_dmabuf(int device_id, enum xdma_wait wait, int dmabuf_fd,
+		     uint64_t offset, uint64_t size)
+{
+	return xdma_perform_dmabuf(device_id, wait, true, dmabuf_fd, offset,
+				   size);
+}
+
+/* Receive into a dma-buf of another driver, for example a DRM framebuffer
+ *
+ * Like xdma_send_dmabuf(), waits if 'wait' includes XDMA_WAIT_DST.
+ */
+int xdma_recv_dmabuf(int device_id, enum xdma_wait wait, int dmabuf_fd,
+		     uint64_t offset, uint64_t size)
+{
+	return xdma_perform_dmabuf(device_id, wait, false, dmabuf_fd, offset,
+				   size);
+}
+
+/* Set the scheduling parameters and remember them for xdma_calibrate().
+ */
+static int xdma_apply_qos(int device_id, const struct xdma_qos *qos)
+{
+	if (ioctl(fd[device_id], XDMA_SET_QOS, qos) < 0) {
+		return xdma_fail(device_id, "ioctl set qos");
+	}
+
+	cur_qos[device_id] = *qos;
+	return 0;
+}
+
+/* Calibration
+ *
+ * Every transfer has a fixed cost (ioctls, descriptor setup, interrupt) on
+ * top of the time the engine takes to move its bytes, so small transfers
+ * waste most of the bandwidth. xdma_calibrate() times loopback transfers of
+ * growing size and picks the smallest chunk size that reaches
+ * XDMA_CALIB_EFFICIENCY percent of the best throughput. A least squares fit
+ * of the times gives the per transfer overhead and the bandwidth.
+ */
+static int xdma_calib_save(void)
+{
+	FILE *file;
+	int i;
+
+	file = fopen(xdma_calib_path(), "w");
+	if (!file) {
+		return xdma_fail(-1, "opening calibration file");
+	}
+
+	fprintf(file, "# device overhead_ns bandwidth_MBps chunk_bytes\n");
+	for (i = 0; i < num_of_devices; i++) {
+		if (calib[i].chunk) {
+			fprintf(file, "%d %u %u %u\n", i, calib[i].overhead_ns,
+				calib[i].bandwidth, calib[i].chunk);
+		}
+	}
+
+	fclose(file);
+	return 0;
+}
+
+/* Time loopback transfers of up to 'max_size' bytes and fit the results.
+ */
+static int xdma_calib_measure(int device_id, uint32_t max_size)
+{
+	uint32_t *src, *dst;
+	uint32_t size, best_size = 0;
+	uint64_t start, elapsed, best_rate = 0;
+	uint64_t rate[32];
+	uint32_t sizes[32];
+	double sx = 0, sy = 0, sxx = 0, sxy = 0;
+	double slope, intercept;
+	int count, n = 0;
+	int i;
+
+	src = (uint32_t *) & wc_map[device_id][alloc_offset[device_id]];
+	dst = (uint32_t *) & map[device_id][alloc_offset[device_id] +
+					    max_size];
+	xdma_buf_fill(src, 0xC0FFEE00, max_size);
+
+	for (size = XDMA_CALIB_MIN_SIZE; size <= max_size; size *= 2) {
+		dst[size / 4 - 1] = ~src[size / 4 - 1];
+
+		count = 0;
+		start = xdma_now();
+		do {
+			if (xdma_perform_transaction(device_id, XDMA_WAIT_BOTH,
+						     src, size / 4, dst,
+						     size / 4) < 0) {
+				return -1;
+			}
+			count++;
+			elapsed = xdma_now() - start;
+		} while (elapsed < XDMA_CALIB_TIME_NS);
+
+		// a packet cut short leaves the end of 'dst' unwritten
+		if (dst[size / 4 - 1] != src[size / 4 - 1]) {
+			return xdma_fail_code(device_id, XDMA_ERR_INVALID, EIO,
+					      "calibration data mismatch");
+		}
+
+		// time per transfer against its size
+		sizes[n] = size;
+		rate[n] = (uint64_t) size * count * 1000000000 / elapsed;
+		sx += size;
+		sy += (double)elapsed / count;
+		sxx += (double)size * size;
+		sxy += (double)size * elapsed / count;
+		n++;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (rate[i] > best_rate) {
+			best_rate = rate[i];
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		if (rate[i] * 100 >= best_rate * XDMA_CALIB_EFFICIENCY) {
+			best_size = sizes[i];
+			break;
+		}
+	}
+
+	slope = (n > 1) ? (n * sxy - sx * sy) / (n * sxx - sx * sx) : 0;
+	intercept = (sy - slope * sx) / n;
+
+	calib[device_id].overhead_ns = (intercept > 0) ? intercept : 0;
+	calib[device_id].bandwidth = (slope > 0) ? 1000 / slope : 0;
+	calib[device_id].chunk = best_size;
+
+	return 0;
+}
+
+/* Calibrate the transfer size of a device
+ *
+ * Needs the FPGA to loop the tx stream back to rx. The buffers come from
+ * the unallocated part of the DMA memory, so call it after allocating the
+ * buffers of the application. The transfers must reach the engine whole,
+ * so a 'max_chunk' set with xdma_set_qos() is raised for the run and
+ * restored afterwards. The result is saved and loaded again by xdma_init()
+ * of later runs.
+ */
+int xdma_calibrate(int device_id)
+{
+	struct xdma_qos saved, whole;
+	uint32_t max_size;
+	int ret;
+
+	if (xdma_use_device(device_id) < 0) {
+		return -1;
+	}
+
+	max_size = (FILESIZE - alloc_offset[device_id]) / 2;
+	if (max_size > XDMA_CALIB_MAX_SIZE) {
+		max_size = XDMA_CALIB_MAX_SIZE;
+	}
+	if (max_size < XDMA_CALIB_MIN_SIZE) {
+		return xdma_fail_code(device_id, XDMA_ERR_NO_MEMORY, ENOMEM,
+				      "no free DMA memory for calibration");
+	}
+
+	saved = cur_qos[device_id];
+	if (saved.max_chunk && (saved.max_chunk < max_size)) {
+		whole = saved;
+		whole.max_chunk = max_size;
+		if (xdma_apply_qos(device_id, &whole) < 0) {
+			return -1;
+		}
+	}
+
+	ret = xdma_calib_measure(device_id, max_size);
+
+	if ((cur_qos[device_id].max_chunk != saved.max_chunk) &&
+	    (xdma_apply_qos(device_id, &saved) < 0)) {
+		return -1;
+	}
+
+	if (ret < 0) {
+		return -1;
+	}
+
+	return xdma_calib_save();
+}
+
+/* Calibration of a device, -1 if it was never calibrated.
+ */
+int xdma_get_calibration(int device_id, struct xdma_calibration *cal)
+{
+	if ((device_id < 0) || (device_id >= num_of_devices)) {
+		return xdma_fail_code(device_id, XDMA_ERR_NO_DEVICE, ENODEV,
+				      "invalid device ID");
+	}
+
+	if (!calib[device_id].chunk) {
+		return xdma_fail_code(device_id, XDMA_ERR_INVALID, ENODATA,
+				      "device not calibrated");
+	}
+
+	*cal = calib[device_id];
+	return 0;
+}
+
+/* Set the scheduling parameters of this process on a device
+ *
+ * 'prio' is one of the XDMA_PRIO_* classes of xdma.h and 'weight' (1 to 64)
+ * the share of the engine relative to other processes in the same class.
+ * MEM_TO_DEV transfers are split into descriptors, and so AXI stream
+ * packets, of 'max_chunk' bytes. Zero never splits them, the default, and
+ * XDMA_CHUNK_AUTO selects the calibrated chunk size of the device.
+ */
+int xdma_set_qos(int device_id, int prio, int weight, uint32_t max_chunk)
+{
+	struct xdma_qos qos;
+
+	if (xdma_use_device(device_id) < 0) {
+		return -1;
+	}
+
+	if (max_chunk == XDMA_CHUNK_AUTO) {
+		max_chunk = calib[device_id].chunk;
+	}
+
+	qos.prio = prio;
+	qos.weight = weight;
+	qos.max_chunk = max_chunk;
+	qos.reserved = 0;
+
+	return xdma_apply_qos(device_id, &qos);
+}
+
+/* Reset both channels of a device
+ *
+ * Recovers a device whose engine is stuck without reloading the driver. The
+ * transfers on the engine of all processes are aborted with ECANCELED, or
+ * submitted again if they were started with XDMA_RETRY.
+ */
+int xdma_reset_device(int device_id)
+{
+	if (xdma_use_device(device_id) < 0) {
+		return -1;
+	}
+
+	if (xdma_config_chan(device_id, xdma_devices[device_id].tx_chan,
+			     XDMA_MEM_TO_DEV, true) < 0) {
+		return xdma_fail(device_id, "ioctl reset src (tx) chan");
+	}
+
+	if (xdma_config_chan(device_id, xdma_devices[device_id].rx_chan,
+			     XDMA_DEV_TO_MEM, true) < 0) {
+		return xdma_fail(device_id, "ioctl reset dst (rx) chan");
+	}
+
+	return 0;
+}
+
+static int xdma_stop(int device_id,
+		     uint32_t * src_ptr, uint32_t src_length,
+		     uint32_t * dst_ptr, uint32_t dst_length)
+{
+	int ret = 0;
+	struct xdma_transfer dst_trans;
+	struct xdma_transfer src_trans;
+	const bool src_used = ((src_ptr != NULL) && (src_length != 0));
 	const bool dst_used = ((dst_ptr != NULL) && (dst_length != 0));
 
-	if (device_id >= num_of_devices) {
-		perror("Error invalid device ID");
+	if (xdma_use_device(device_id) < 0) {
 		return -1;
 	}
 
 	if (src_used) {
 		src_trans.chan = xdma_devices[device_id].tx_chan;
-		ret = (int)ioctl(fd, XDMA_STOP_TRANSFER, &(src_trans.chan));
+		ret = (int)ioctl(fd[device_id], XDMA_STOP_TRANSFER, &(src_trans.chan));
 		if (ret < 0) {
-			perror("Error ioctl stop src (tx) trans");
-			return ret;
+			return xdma_fail(device_id,
+					 "ioctl stop src (tx) trans");
 		}
 	}
 
 	if (dst_used) {
 		dst_trans.chan = xdma_devices[device_id].rx_chan;
-		ret = (int)ioctl(fd, XDMA_STOP_TRANSFER, &(dst_trans.chan));
+		ret = (int)ioctl(fd[device_id], XDMA_STOP_TRANSFER, &(dst_trans.chan));
 		if (ret < 0) {
-			perror("Error ioctl stop dst (rx) trans");
-			return ret;
+			return xdma_fail(device_id,
+					 "ioctl stop dst (rx) trans");
 		}
 	}
 
 	return ret;
 }
+
+int xdma_stop_transaction(int device_id,
+			  uint32_t * src_ptr, uint32_t src_length,
+			  uint32_t * dst_ptr, uint32_t dst_length)
+{
+	const uint64_t start = trace ? xdma_now() : 0;
+	int ret;
+
+	ret = xdma_stop(device_id, src_ptr, src_length, dst_ptr, dst_length);
+
+	if (trace) {
+		xdma_trace_put(XDMA_TRACE_STOP, device_id, 0, start, ret,
+			       src_ptr, src_length * sizeof(src_ptr[0]),
+			       dst_ptr, dst_length * sizeof(dst_ptr[0]));
+	}
+
+	return ret;
+}
+
+/* Start tracing the calls of this process to the file at 'path'
+ *
+ * An open trace is closed first. Records reach the file when the buffer
+ * fills or at xdma_trace_stop()/xdma_exit().
+ */
+int xdma_trace_start(const char *path)
+{
+	struct xdma_trace_header hdr;
+
+	xdma_trace_stop();
+
+	trace = fopen(path, "wb");
+	if (!trace) {
+		return xdma_fail(-1, "opening trace file");
+	}
+	setvbuf(trace, NULL, _IOFBF, XDMA_TRACE_BUFFER);
+
+	hdr.magic = XDMA_TRACE_MAGIC;
+	hdr.version = XDMA_TRACE_VERSION;
+	hdr.num_devices = num_of_devices;
+	hdr.record_size = sizeof(struct xdma_trace_record);
+	if (fwrite(&hdr, sizeof(hdr), 1, trace) != 1) {
+		xdma_fail(-1, "writing trace file");
+		fclose(trace);
+		trace = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+int xdma_trace_stop(void)
+{
+	int ret = 0;
+
+	if (trace && (fclose(trace) != 0)) {
+		ret = xdma_fail(-1, "closing trace file");
+	}
+	trace = NULL;
+
+	return ret;
+}
+
+/* Buffer helpers
+ *
+ * The DMA memory area is mapped uncached, so every CPU access to it turns
+ * into a bus transaction. These helpers move data in blocks of XDMA_BLOCK
+ * bytes using 16 byte vector loads/stores (NEON when available, GCC vector
+ * extensions otherwise) so that each block reaches the interconnect as one
+ * burst instead of a series of single word accesses. The DMA side pointer
+ * is aligned first, the cached side is allowed to be unaligned. XDMA_BLOCK
+ * is a compile time constant, so the block loops unroll completely for the
+ * configured geometry.
+ */
+#define XDMA_VEC 16
+#define XDMA_BLOCK_VECS (XDMA_BLOCK / XDMA_VEC)
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+typedef uint8x16_t xdma_vec_t;
+
+#define xdma_vload(p)		vld1q_u8((const uint8_t *)(p))
+#define xdma_vstore(p, v)	vst1q_u8((uint8_t *)(p), (v))
+#define xdma_vdup32(w)		vreinterpretq_u8_u32(vdupq_n_u32(w))
+#define xdma_vxor(a, b)		veorq_u8((a), (b))
+#define xdma_vor(a, b)		vorrq_u8((a), (b))
+
+static inline int xdma_vnonzero(xdma_vec_t v)
+{
+	uint64x2_t w = vreinterpretq_u64_u8(v);
+
+	return (0 != (vgetq_lane_u64(w, 0) | vgetq_lane_u64(w, 1)));
+}
+#else
+typedef uint8_t xdma_vec_t __attribute__ ((vector_size(XDMA_VEC), may_alias));
+typedef uint32_t xdma_vec32_t __attribute__ ((vector_size(XDMA_VEC), may_alias));
+
+static inline xdma_vec_t xdma_vload(const void *p)
+{
+	xdma_vec_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline void xdma_vstore(void *p, xdma_vec_t v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline xdma_vec_t xdma_vdup32(uint32_t w)
+{
+	xdma_vec32_t v = { w, w, w, w };
+
+	return (xdma_vec_t) v;
+}
+
+#define xdma_vxor(a, b)		((a) ^ (b))
+#define xdma_vor(a, b)		((a) | (b))
+
+static inline int xdma_vnonzero(xdma_vec_t v)
+{
+	uint64_t w[2];
+
+	memcpy(w, &v, sizeof(w));
+	return (0 != (w[0] | w[1]));
+}
+#endif
+
+/* Number of bytes before 'ptr' reaches a XDMA_VEC boundary, capped at length.
+ */
+static inline size_t xdma_head_len(const void *ptr, size_t length)
+{
+	size_t head = (XDMA_VEC - ((uintptr_t) ptr % XDMA_VEC)) % XDMA_VEC;
+
+	return (head < length) ? head : length;
+}
+
+/* Fill 'length' bytes at 'dst' with the 32 bit 'pattern' repeated, in host
+ * byte order. The pattern phase is relative to 'dst', so filling a uint32_t
+ * array gives every element the value 'pattern'.
+ */
+void xdma_buf_fill(void *dst, uint32_t pattern, size_t length)
+{
+	uint8_t *d = (uint8_t *) dst;
+	uint8_t pb[4], rb[4];
+	uint32_t rotated;
+	xdma_vec_t v;
+	size_t head, i;
+
+	memcpy(pb, &pattern, sizeof(pb));
+
+	head = xdma_head_len(d, length);
+	for (i = 0; i < head; i++) {
+		d[i] = pb[i % 4];
+	}
+	d += head;
+	length -= head;
+
+	// rotate the pattern so the vector lanes continue the same phase
+	for (i = 0; i < 4; i++) {
+		rb[i] = pb[(head + i) % 4];
+	}
+	memcpy(&rotated, rb, sizeof(rotated));
+	v = xdma_vdup32(rotated);
+
+	for (; length >= XDMA_BLOCK; length -= XDMA_BLOCK, d += XDMA_BLOCK) {
+		for (i = 0; i < XDMA_BLOCK; i += XDMA_VEC) {
+			xdma_vstore(d + i, v);
+		}
+	}
+
+	for (; length >= XDMA_VEC; length -= XDMA_VEC, d += XDMA_VEC) {
+		xdma_vstore(d, v);
+	}
+
+	for (i = 0; i < length; i++) {
+		d[i] = rb[i % 4];
+	}
+}
+
+/* Copy 'length' bytes from cached memory at 'src' into the DMA memory area
+ * at 'dma_dst'. Stores to the DMA area are issued a block at a time in
+ * ascending order, which suits both uncached and write-combined mappings.
+ */
+void xdma_buf_copy_to(void *dma_dst, const void *src, size_t length)
+{
+	uint8_t *d = (uint8_t *) dma_dst;
+	const uint8_t *s = (const uint8_t *)src;
+	xdma_vec_t v[XDMA_BLOCK_VECS];
+	size_t head, i;
+
+	head = xdma_head_len(d, length);
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	length -= head;
+
+	for (; length >= XDMA_BLOCK; length -= XDMA_BLOCK) {
+		__builtin_prefetch(s + 4 * XDMA_BLOCK);
+		for (i = 0; i < XDMA_BLOCK_VECS; i++) {
+			v[i] = xdma_vload(s + i * XDMA_VEC);
+		}
+		for (i = 0; i < XDMA_BLOCK_VECS; i++) {
+			xdma_vstore(d + i * XDMA_VEC, v[i]);
+		}
+		d += XDMA_BLOCK;
+		s += XDMA_BLOCK;
+	}
+
+	for (; length >= XDMA_VEC; length -= XDMA_VEC) {
+		xdma_vstore(d, xdma_vload(s));
+		d += XDMA_VEC;
+		s += XDMA_VEC;
+	}
+
+	memcpy(d, s, length);
+}
+
+/* Copy 'length' bytes from the DMA memory area at 'dma_src' into cached
+ * memory at 'dst'. All loads of a block are issued before any store so the
+ * uncached reads can be merged into a single burst.
+ */
+void xdma_buf_copy_from(void *dst, const void *dma_src, size_t length)
+{
+	uint8_t *d = (uint8_t *) dst;
+	const uint8_t *s = (const uint8_t *)dma_src;
+	xdma_vec_t v[XDMA_BLOCK_VECS];
+	size_t head, i;
+
+	head = xdma_head_len(s, length);
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	length -= head;
+
+	for (; length >= XDMA_BLOCK; length -= XDMA_BLOCK) {
+		for (i = 0; i < XDMA_BLOCK_VECS; i++) {
+			v[i] = xdma_vload(s + i * XDMA_VEC);
+		}
+		for (i = 0; i < XDMA_BLOCK_VECS; i++) {
+			xdma_vstore(d + i * XDMA_VEC, v[i]);
+		}
+		d += XDMA_BLOCK;
+		s += XDMA_BLOCK;
+	}
+
+	for (; length >= XDMA_VEC; length -= XDMA_VEC) {
+		xdma_vstore(d, xdma_vload(s));
+		d += XDMA_VEC;
+		s += XDMA_VEC;
+	}
+
+	memcpy(d, s, length);
+}
+
+/* Compare 'length' bytes of 'a' and 'b'.
+ *
+ * Returns the offset of the first differing byte, or -1 if the buffers are
+ * equal. Either buffer may be in the DMA memory area.
+ */
+ssize_t xdma_buf_compare(const void *a, const void *b, size_t length)
+{
+	const uint8_t *pa = (const uint8_t *)a;
+	const uint8_t *pb = (const uint8_t *)b;
+	xdma_vec_t diff;
+	size_t i, k, n;
+
+	for (i = 0; i < length; i += n) {
+		n = length - i;
+		if (n >= XDMA_BLOCK) {
+			n = XDMA_BLOCK;
+			diff = xdma_vdup32(0);
+			for (k = 0; k < XDMA_BLOCK; k += XDMA_VEC) {
+				diff = xdma_vor(diff,
+						xdma_vxor(xdma_vload(pa + i + k),
+							  xdma_vload(pb + i + k)));
+			}
+
+			if (!xdma_vnonzero(diff)) {
+				continue;
+			}
+		}
+
+		// locate the mismatch within the block (or the tail)
+		for (k = 0; k < n; k++) {
+			if (pa[i + k] != pb[i + k]) {
+				return (ssize_t) (i + k);
+			}
+		}
+	}
+
+	return -1;
+}
+
+static const uint32_t xdma_crc32c_table[256] = {
+	0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4,
+	0xc79a971f, 0x35f1141c, 0x26a1e7e8, 0xd4ca64eb,
+	0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+	0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24,
+	0x105ec76f, 0xe235446c, 0xf165b798, 0x030e349b,
+	0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+	0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54,
+	0x5d1d08bf, 0xaf768bbc, 0xbc267848, 0x4e4dfb4b,
+	0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+	0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35,
+	0xaa64d611, 0x580f5512, 0x4b5fa6e6, 0xb93425e5,
+	0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+	0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45,
+	0xf779deae, 0x05125dad, 0x1642ae59, 0xe4292d5a,
+	0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+	0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595,
+	0x417b1dbc, 0xb3109ebf, 0xa0406d4b, 0x522bee48,
+	0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+	0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687,
+	0x0c38d26c, 0xfe53516f, 0xed03a29b, 0x1f682198,
+	0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+	0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38,
+	0xdbfc821c, 0x2997011f, 0x3ac7f2eb, 0xc8ac71e8,
+	0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+	0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096,
+	0xa65c047d, 0x5437877e, 0x4767748a, 0xb50cf789,
+	0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+	0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46,
+	0x7198540d, 0x83f3d70e, 0x90a324fa, 0x62c8a7f9,
+	0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+	0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36,
+	0x3cdb9bdd, 0xceb018de, 0xdde0eb2a, 0x2f8b6829,
+	0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+	0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93,
+	0x082f63b7, 0xfa44e0b4, 0xe9141340, 0x1b7f9043,
+	0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+	0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3,
+	0x55326b08, 0xa759e80b, 0xb4091bff, 0x466298fc,
+	0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+	0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033,
+	0xa24bb5a6, 0x502036a5, 0x4370c551, 0xb11b4652,
+	0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+	0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d,
+	0xef087a76, 0x1d63f975, 0x0e330a81, 0xfc588982,
+	0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+	0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622,
+	0x38cc2a06, 0xcaa7a905, 0xd9f75af1, 0x2b9cd9f2,
+	0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+	0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530,
+	0x0417b1db, 0xf67c32d8, 0xe52cc12c, 0x1747422f,
+	0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+	0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0,
+	0xd3d3e1ab, 0x21b862a8, 0x32e8915c, 0xc083125f,
+	0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+	0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90,
+	0x9e902e7b, 0x6cfbad78, 0x7fab5e8c, 0x8dc0dd8f,
+	0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+	0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1,
+	0x69e9f0d5, 0x9b8273d6, 0x88d28022, 0x7ab90321,
+	0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+	0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81,
+	0x34f4f86a, 0xc69f7b69, 0xd5cf889d, 0x27a40b9e,
+	0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+	0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351,
+};
+
+#if defined(__ARM_FEATURE_CRC32)
+/* ARMv8 CRC32C instructions, eight bytes at a time. */
+static uint32_t xdma_crc32c_update(uint32_t crc, const uint8_t * p, size_t n)
+{
+	uint64_t v;
+
+	for (; n >= 8; n -= 8) {
+		memcpy(&v, p, sizeof(v));
+		crc = __crc32cd(crc, v);
+		p += 8;
+	}
+
+	for (; n > 0; n--) {
+		crc = __crc32cb(crc, *p++);
+	}
+
+	return crc;
+}
+#else
+/* Slicing-by-8: table k gives the CRC of a byte followed by k zero bytes,
+ * so eight bytes are folded in with eight independent lookups.
+ */
+static uint32_t xdma_crc32c_slice[8][256];
+
+static void __attribute__ ((constructor)) xdma_crc32c_init(void)
+{
+	uint32_t crc;
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		crc = xdma_crc32c_table[i];
+		xdma_crc32c_slice[0][i] = crc;
+		for (k = 1; k < 8; k++) {
+			crc = xdma_crc32c_table[crc & 0xFF] ^ (crc >> 8);
+			xdma_crc32c_slice[k][i] = crc;
+		}
+	}
+}
+
+static uint32_t xdma_crc32c_update(uint32_t crc, const uint8_t * p, size_t n)
+{
+	const uint32_t(*t)[256] = xdma_crc32c_slice;
+	uint32_t lo, hi;
+
+	for (; n >= 8; n -= 8) {
+		lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) |
+			    ((uint32_t) p[3] << 24));
+		hi = p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t) p[7] << 24);
+		crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^
+		    t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+		    t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^
+		    t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+		p += 8;
+	}
+
+	for (; n > 0; n--) {
+		crc = xdma_crc32c_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	}
+
+	return crc;
+}
+#endif
+
+/* CRC32C (Castagnoli) of 'length' bytes at 'buf'.
+ *
+ * Pass 0 as 'crc' for the first block and the previous result to continue a
+ * running checksum. Data in the DMA memory area is first staged into a
+ * cached block with xdma_buf_copy_from() so it is read with burst accesses.
+ * The ARMv8 CRC instructions are used when the library is built for them
+ * (ARCH=arm64), otherwise a slicing-by-8 table walk.
+ */
+uint32_t xdma_buf_crc32c(uint32_t crc, const void *buf, size_t length)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	uint8_t block[4 * XDMA_BLOCK] __attribute__ ((aligned(XDMA_VEC)));
+	size_t n;
+
+	crc = ~crc;
+	while (length > 0) {
+		n = (length < sizeof(block)) ? length : sizeof(block);
+		xdma_buf_copy_from(block, p, n);
+		crc = xdma_crc32c_update(crc, block, n);
+
+		p += n;
+		length -= n;
+	}
+
+	return ~crc;
+}
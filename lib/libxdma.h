@@ -5,9 +5,11 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
 
-#define FILEPATH "/dev/xdma"
+#define FILEPATH "/dev/xdma%d"
 #define MAP_SIZE  (33554432)
 #define FILESIZE (MAP_SIZE * sizeof(uint8_t))
 
@@ -16,26 +18,246 @@ extern "C" {
 		XDMA_WAIT_SRC = (1 << 0),
 		XDMA_WAIT_DST = (1 << 1),
 		XDMA_WAIT_BOTH = (1 << 1) | (1 << 0),
+		XDMA_RETRY = (1 << 2),	/* resubmit after a channel reset */
 	};
 
+	/* Why a call failed
+	 *
+	 * Failing calls return -1 (NULL for the allocators) with errno set,
+	 * xdma_last_error() gives the details. The library never prints, see
+	 * xdma_set_log().
+	 */
+	enum xdma_error {
+		XDMA_OK = 0,
+		XDMA_ERR_SYSTEM,	/* other system call failed, errno */
+		XDMA_ERR_NO_DEVICE,	/* no driver loaded or no such device */
+		XDMA_ERR_ABI,	/* driver of another ABI version */
+		XDMA_ERR_INVALID,	/* bad argument */
+		XDMA_ERR_OFFSET,	/* buffer not in the DMA memory */
+		XDMA_ERR_NO_ENGINE,	/* device has no such engine */
+		XDMA_ERR_UNSUPPORTED,	/* engine driver can't do it */
+		XDMA_ERR_BUSY,	/* out of credits or engine busy, retry */
+		XDMA_ERR_TIMEOUT,	/* channel stalled and was reset */
+		XDMA_ERR_DMA,	/* engine reported an error */
+		XDMA_ERR_CANCELED,	/* stopped, canceled or a hop failed */
+		XDMA_ERR_NO_MEMORY,
+	};
+
+	struct xdma_error_info {
+		enum xdma_error code;
+		int sys_errno;	/* errno of the failure */
+		int device_id;	/* -1 if not about one device */
+		const char *call;	/* what failed, a static string */
+	};
+
+	typedef void (*xdma_log_fn) (void *arg,
+				     const struct xdma_error_info * err);
+
+	const struct xdma_error_info *xdma_last_error(void);
+
+	enum xdma_error xdma_error_code(int status);
+
+	const char *xdma_error_string(enum xdma_error code);
+
+	void xdma_set_log(xdma_log_fn fn, void *arg);
+
 	void *xdma_alloc(int length, int byte_num);
 
+	void *xdma_alloc_src(int length, int byte_num);
+
+	void *xdma_alloc_dev(int device_id, int length, int byte_num);
+
+	void *xdma_alloc_src_dev(int device_id, int length, int byte_num);
+
 	void xdma_alloc_reset(void);
 
+	uint32_t xdma_calc_size(int length, int byte_num);
+
+	uint32_t xdma_buf_align(int device_id);
+
 	int xdma_init(void);
 
 	int xdma_exit(void);
 
 	int xdma_num_of_devices(void);
 
+	int xdma_abi_version(void);
+
 	int xdma_perform_transaction(int device_id, enum xdma_wait wait,
 				     uint32_t * src_ptr, uint32_t src_length,
 				     uint32_t * dst_ptr, uint32_t dst_length);
 
+	/* One transfer of a chain, on the tx channel of 'device_id' if
+	 * 'src_ptr' is set or on its rx channel if 'dst_ptr' is. The buffer
+	 * may be in the DMA memory of any device.
+	 */
+	struct xdma_hop {
+		int device_id;
+		uint32_t *src_ptr;
+		uint32_t *dst_ptr;
+		uint32_t length;	/* in words */
+		int after;	/* earlier hop that starts this one, or -1 */
+	};
+
+	int xdma_perform_chain(struct xdma_hop *hops, int num_hops, int wait);
+
+	/* One buffer of a gather or scatter transfer. */
+	struct xdma_iov {
+		uint32_t *ptr;
+		uint32_t length;	/* in words */
+	};
+
+	int xdma_perform_gather(int device_id, enum xdma_wait wait,
+				const struct xdma_iov *iov, int iovcnt);
+
+	int xdma_perform_scatter(int device_id, enum xdma_wait wait,
+				 const struct xdma_iov *iov, int iovcnt);
+
+	int xdma_send_tile(int device_id, enum xdma_wait wait, uint32_t * ptr,
+			   uint32_t row_length, uint32_t stride,
+			   uint32_t rows);
+
+	int xdma_recv_tile(int device_id, enum xdma_wait wait, uint32_t * ptr,
+			   uint32_t row_length, uint32_t stride,
+			   uint32_t rows);
+
+	int xdma_start_cyclic(int device_id, uint32_t * ptr,
+			      uint32_t period_length, uint32_t periods,
+			      int32_t * cookie);
+
+	int xdma_swap_cyclic(int device_id, uint32_t * ptr);
+
+	int xdma_wait_cyclic(int device_id, uint64_t period,
+			     uint32_t timeout_ms, uint64_t * played,
+			     uint64_t * swapped);
+
+	int xdma_stop_cyclic(int device_id);
+
+	int xdma_device_engine(int device_id);
+
+	int xdma_memcpy(int device_id, enum xdma_wait wait, uint32_t * dst_ptr,
+			uint32_t * src_ptr, uint32_t length);
+
+	int xdma_export_dmabuf(int device_id, void *ptr, size_t size);
+
+	int xdma_send_dmabuf(int device_id, enum xdma_wait wait,
+			     int dmabuf_fd, uint64_t offset, uint64_t size);
+
+	int xdma_recv_dmabuf(int device_id, enum xdma_wait wait,
+			     int dmabuf_fd, uint64_t offset, uint64_t size);
+
+	int xdma_submit_transaction(int device_id,
+				    uint32_t * src_ptr, uint32_t src_length,
+				    uint32_t * dst_ptr, uint32_t dst_length,
+				    int32_t * src_cookie, int32_t * dst_cookie);
+
+	int xdma_perform_receive(int device_id, uint32_t * dst_ptr,
+				 uint32_t dst_length, uint64_t * received);
+
+	int xdma_cancel(int device_id, int32_t cookie, int engine);
+
+	int xdma_set_credits(int device_id, uint32_t credits);
+
+	int xdma_wait_space(int device_id, enum xdma_wait which,
+			    uint32_t timeout_ms);
+
+	int xdma_set_rate(int device_id, enum xdma_wait which,
+			  uint64_t bytes_per_sec);
+
+	struct xdma_chan_stats;	/* in xdma.h */
+
+	int xdma_get_chan_stats(int device_id, enum xdma_wait which,
+				struct xdma_chan_stats *stats);
+
+	/* Record of a transaction from the completion ring. */
+	struct xdma_completion {
+		int32_t cookie;
+		int32_t status;	/* 0 or a negative errno */
+		uint64_t bytes;	/* that actually landed */
+		uint64_t timestamp;	/* ns, CLOCK_MONOTONIC */
+	};
+
+	int xdma_ring_init(int device_id);
+
+	int xdma_reap(int device_id, struct xdma_completion *done, int max);
+
+	uint32_t xdma_ring_dropped(int device_id);
+
+	/* Measured transfer cost of a device, see xdma_calibrate(). */
+	struct xdma_calibration {
+		uint32_t overhead_ns;	/* per transfer */
+		uint32_t bandwidth;	/* MB/s */
+		uint32_t chunk;	/* best transfer size in bytes */
+	};
+
+	int xdma_calibrate(int device_id);
+
+	int xdma_get_calibration(int device_id, struct xdma_calibration *cal);
+
+	/* 'max_chunk' of xdma_set_qos() selecting the calibrated size */
+#define XDMA_CHUNK_AUTO	UINT32_MAX
+
+	int xdma_set_qos(int device_id, int prio, int weight,
+			 uint32_t max_chunk);
+
+	int xdma_reset_device(int device_id);
+
 	int xdma_stop_transaction(int device_id,
 				  uint32_t * src_ptr, uint32_t src_length,
 				  uint32_t * dst_ptr, uint32_t dst_length);
 
+	/* Call trace
+	 *
+	 * With tracing on, every allocation, transaction and stop is appended
+	 * to a binary file: a struct xdma_trace_header followed by one struct
+	 * xdma_trace_record per call, in host byte order. demo/xdma-replay
+	 * plays a trace back.
+	 */
+#define XDMA_TRACE_MAGIC	0x43525458	/* "XTRC" */
+#define XDMA_TRACE_VERSION	1
+
+	enum xdma_trace_op {
+		XDMA_TRACE_ALLOC,	/* dst_offset/dst_length: the buffer */
+		XDMA_TRACE_ALLOC_SRC,
+		XDMA_TRACE_PERFORM,
+		XDMA_TRACE_SUBMIT,
+		XDMA_TRACE_STOP,
+	};
+
+	struct xdma_trace_header {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t num_devices;
+		uint32_t record_size;
+	};
+
+	struct xdma_trace_record {
+		uint64_t timestamp;	/* ns, CLOCK_MONOTONIC, at the call */
+		uint32_t duration;	/* ns the call took */
+		uint8_t op;	/* enum xdma_trace_op */
+		uint8_t device_id;
+		uint8_t wait;	/* enum xdma_wait */
+		int8_t result;	/* 0 or -1 */
+		uint32_t src_offset;	/* in the DMA memory, in bytes */
+		uint32_t src_length;
+		uint32_t dst_offset;
+		uint32_t dst_length;
+	};
+
+	int xdma_trace_start(const char *path);
+
+	int xdma_trace_stop(void);
+
+	void xdma_buf_fill(void *dst, uint32_t pattern, size_t length);
+
+	void xdma_buf_copy_to(void *dma_dst, const void *src, size_t length);
+
+	void xdma_buf_copy_from(void *dst, const void *dma_src, size_t length);
+
+	ssize_t xdma_buf_compare(const void *a, const void *b, size_t length);
+
+	uint32_t xdma_buf_crc32c(uint32_t crc, const void *buf, size_t length);
+
 #ifdef __cplusplus
 }
 #endif